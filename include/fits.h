@@ -10,12 +10,110 @@
 #ifndef FITS_H
 #define FITS_H
 
+#define FITSBLOCKMIN 1024 /* min number of rows read or written at once */
+#define FITSTILESIZE  256        /* side of the tiles of images that are not tile-compressed */
+#define FITSCACHESIZE 268435456  /* memory for the tiles of an image in bytes (256 MB) */
+
+/* 	tiles of fits images (see tileImage()) */
+#define TILENONE    -1  /* not read or dropped */
+#define TILERAW     -2  /* pixels read in the mapped image */
+#define TILEPIXELS   0  /* array of pixels */
+#define TILEPACKED   1  /* 2 values, 1 bit per pixel */
+#define TILEUNIFORM  2  /* 1 value */
+
+/* 	tile summary pyramid (see summaryImage()) */
+#define SUMMARYZERO     1  /* at least one pixel = 0 (outside the mask) */
+#define SUMMARYNONZERO  2  /* at least one pixel != 0 (inside the mask) */
+#define SUMMARYUNIFORM  4  /* 1 value, in summaryValue (tiles only) */
+
+/* 	pixels of points (see pixelIndexKernel()) */
+#define GATHERBLOCK  1024  /* points converted into pixels at once */
+#define PIXELOUTSIDE   -1  /* outside the limits */
+#define PIXELNONE      -2  /* inside the limits, outside the image */
+
+/* 	WCS projections (see readWcs()) */
+#define WCSTAN 0
+#define WCSSIN 1
+#define WCSZEA 2
+#define WCSARC 3
+#define WCSSTG 4
+#define WCSCAR 5
+
+/* 	celestial WCS of a fits image: axis lng of the longitude, linear
+ * 	transformation cd (degrees per pixel) and its inverse, celestial
+ * 	coordinates (alphaP, deltaP) of the native pole and native
+ * 	longitude phiP of the celestial pole, in radians */
+typedef struct Wcs
+{
+	int projection, lng;
+	double crpix[2], crval[2], cd[2][2], cdInverse[2][2];
+	double alphaP, deltaP, phiP, cosDeltaP, sinDeltaP;
+} Wcs;
+
+/* 	fits image mask, read by tiles of tile[0] x tile[1] pixels from
+ * 	the file mapped (data points to the raw pixels, big-endian) or with
+ * 	CFITSIO (fptr). wcs is read with -coord spher (NULL otherwise).
+ * 	Tiles read are in slots (slotOf[tile]), in a list from the most
+ * 	(head) to the least (tail) recently used, which is dropped first.
+ * 	The two values of a packed tile are in slotPalette, in the type of
+ * 	the image (see openImage() and tileImage()). If built, summary[l]
+ * 	(summaryN[2*l] x summaryN[2*l+1] cells) holds the SUMMARY flags of
+ * 	the tiles (l = 0) and of blocks of 2^l x 2^l tiles, and
+ * 	summaryValue the value of uniform tiles (see summaryImage()) */
+typedef struct Image
+{
+	fitsfile *fptr;
+	long naxes[2];
+	int bitpix, typecode, size;
+	char tform;
+	double (*toDouble)(void *,long);
+	Wcs *wcs;
+
+	unsigned char *map;
+	const unsigned char *data;
+	size_t mapSize;
+
+	long tile[2], Ntiles[2], *slotOf;
+	long Nslots, Nfree, head, tail, *freeSlots, *slotTile, *slotPrev, *slotNext;
+	size_t cacheSize, *slotBytes;
+	char **slotData, *slotFormat, *scratch;
+	double *slotPalette;
+
+	int Nlevels;
+	long *summaryN;
+	char **summary;
+	double *summaryValue;
+} Image;
+
 
 /*
  *    FITS
  */
 
- void *readFits(const Config *para, int *bitpix, int *typecode, char *tform, int *status, long naxes[2], double (**toDouble)(void *,long ), int *size);
+Image *openImage(const Config *para, int *status);
+void closeImage(Image *image);
+long tileImage(Image *image, long t);
+void pixelImage(Image *image, long i, long j, void *pixel);
+double valueImage(Image *image, long i, long j);
+void summaryImage(Image *image, const double xmin[2], const double xmax[2]);
+Cells *createCellsImage(const Image *image, const double xmin[2], const double xmax[2], int inside);
+void addCellsImage(const Image *image, Cells *cells, int l, long ci, long cj, const double xmin[2], const double xmax[2], char keep);
+void valuesImage(Image *image, const double *x, const double *y, size_t N, const double xmin[2], const double xmax[2], double null, double *value);
+void pixelIndexKernel(const double *x, const double *y, size_t N, const double xmin[2], const double xmax[2], const long naxes[2], int *i, int *j);
+void gatherImageCHAR(Image *image, const int *i, const int *j, size_t N, double null, double *value);
+void gatherImageSHORT(Image *image, const int *i, const int *j, size_t N, double null, double *value);
+void gatherImageLONG(Image *image, const int *i, const int *j, size_t N, double null, double *value);
+void gatherImageFLOAT(Image *image, const int *i, const int *j, size_t N, double null, double *value);
+void gatherImageDOUBLE(Image *image, const int *i, const int *j, size_t N, double null, double *value);
+Wcs *readWcs(fitsfile *fptr);
+void worldToPixel(const Wcs *wcs, const double *lng, const double *lat, size_t N, const double min[2], const double max[2], double *x, double *y);
+void worldLimits(const Config *para, const Image *image, double xmin[2], double xmax[2], double wmin[2], double wmax[2]);
+uint16_t bigEndian16(const unsigned char *raw);
+uint32_t bigEndian32(const unsigned char *raw);
+uint64_t bigEndian64(const unsigned char *raw);
+float floatBigEndian(const unsigned char *raw);
+double doubleBigEndian(const unsigned char *raw);
+void decodePixelFits(const unsigned char *raw, int bitpix, void *pixel);
 
 double toDoubleCHAR(void *table, long i);
 double toDoubleSHORT(void *table, long i);
@@ -24,5 +122,8 @@ double toDoubleFLOAT(void *table, long i);
 double toDoubleDOUBLE(void *table, long i);
 
 void readColFits(fitsfile *fileIn, int id_num, long N, double *x);
+void readColsFits(fitsfile *fileIn, int Ncols, const int *id_num, long firstrow, long N, double **x);
+void copyRowsFits(fitsfile *fileIn, fitsfile *fileOut, long firstrow, long N, const char *keep, long *count, int *status);
+void writeColsFits(fitsfile *fileOut, int Ncols, const int *datatype, void **x, long firstrow, long N, int *status);
 
 #endif
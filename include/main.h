@@ -17,6 +17,7 @@ int mask2d(const Config *para);
 int flagCatFits(const Config *para);
 int flagCat(const Config *para);
 int randomCat(const Config *para);
+int areaMask(const Config *para);
 
 
 #endif
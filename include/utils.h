@@ -10,7 +10,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_rng.h>
@@ -19,6 +24,14 @@
 #include <gsl/gsl_histogram2d.h>
 #include <gsl/gsl_integration.h>
 
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #define FAILURE 0
 #define SUCCESS 1
 
@@ -53,6 +66,16 @@
 #define ASCII 0
 #define FITS  1
 
+/* 	random generators */
+#define RNG_GSL    0
+#define RNG_PHILOX 1
+
+/* 	sequences for random objects */
+#define SAMPLER_PSEUDO 0
+#define SAMPLER_SOBOL  1
+#define SAMPLER_HALTON 2
+#define QUASIDIM       5  /* draws per object: x, y, redshift, z, cell */
+
 #define MAX(x,y) ((x) > (y)) ? (x) : (y)
 #define MIN(x,y) ((x) < (y)) ? (x) : (y)
 #define ABS(a) ((a) < 0 ? -(a) : (a))
@@ -61,10 +84,49 @@
 #define SQUARE(a) ((a)*(a))
 
 #define FILENAMESIZE 1000
+#define NUMBERSIZE   512      /* longest number read by parseDouble() */
+#define PARSECHUNKMIN (1<<24) /* region files larger than this are parsed in parallel */
 
 #define NFIELD    500
 #define NCHAR     20
-#define NVERTICES 100
+#define NBATCH    4096 /* points per chunk in batch queries */
+#define NBLOCK    (64*NBATCH) /* catalogue rows read at once (default for -blockRows) */
+#define IOBUFFERSIZE (1<<24) /* bytes read or written at once (text catalogues) */
+#define PRECISION    6        /* default decimals of coordinates in ascii outputs */
+#define PRECISIONMAX 17
+
+/* 	region types */
+#define REG_POLYGON       0
+#define REG_CIRCLE        1
+#define REG_ELLIPSE       2
+#define REG_BOX           3
+#define REG_CIRCLE_SPHER  4
+#define REG_ELLIPSE_SPHER 5
+#define NPARAM            8
+
+#define LEAFSIZE      8     /* default max number of polygons per leaf */
+#define TREEBINS      32    /* split candidates per dimension */
+#define TREETRAVERSAL 4.0   /* cost of a tree level relative to a polygon test */
+#define TREEDEPTHMAX  64
+
+#define EDGESLABMIN  64       /* polygons with more vertices get an edge index */
+#define SLABEDGES    4        /* edges per slab in the edge index */
+#define SLABEDGESMAX 8        /* max edges in the edge index per vertex */
+
+#define GRIDCELLS    128      /* grid cells per polygon */
+#define GRIDCELLSMIN 16384
+#define GRIDCELLSMAX (1<<24)
+#define GRID_OUTSIDE (-1)
+
+#define AREATOL      1.0e-12  /* relative accuracy of the exact mask area */
+#define AREADEPTHMAX 40       /* max bisections of a slab when integrating the area */
+#define AREASCAN     32       /* steps to bracket where a region boundary leaves a cell */
+
+/* 	mask index file (see saveIndex()) */
+#define INDEXMAGIC   "VENICEIX"
+#define INDEXVERSION 2
+#define INDEXNARRAYS 15
+#define INDEXALIGN   64
 
 #define getDoubleValue(array,col)  atof(array+NCHAR*(col-1))
 #define getIntValue(array,col)     atoi(array+NCHAR*(col-1))
@@ -82,22 +144,67 @@ typedef struct Config
 	char fileCatInName[1000];
 	char fileOutName[1000];
 	char fileNofZName[1000];
+	char fileIndexInName[1000];
+	char fileIndexOutName[1000];
 	int nz, zrange;
 	int nx,ny,format;
 	char *xcol,*ycol;
 	int coordType, constDen;
 	size_t npart,seed;
+	int rng, sampler;
 	double min[3], max[3], redshiftmin, redshiftmax;
 	int minDefined[3];
 	int maxDefined[3];
 
 	int catFileType, oFileType;
 
+	/* 	region mask tree */
+	size_t leafSize;
+
+	int nthreads;
+
+	/* 	catalogue rows read at once */
+	size_t blockRows;
+
+	/* 	decimals of coordinates in ascii outputs */
+	int precision;
+
+	/* 	draw exactly npart accepted random objects */
+	int exactNpart;
+
 	/* 	cosmology */
 	double a[4];
 } Config;
 
 
+typedef struct Lines
+{
+	/* 	Block of text lines: line i is line[i] (length[i] bytes,
+	 * 	newline included), pointing into the reader's buffer */
+	size_t N, Nalloc;
+	const char **line;
+	size_t *length;
+	int *isObject;
+} Lines;
+
+typedef struct Reader
+{
+	/* 	Buffered text reader: the unread bytes are buffer[pos], ...,
+	 * 	buffer[size-1], total is the number of bytes consumed */
+	FILE *file;
+	char *buffer;
+	size_t pos, size, sizeAlloc, total;
+	int eof;
+} Reader;
+
+typedef struct Writer
+{
+	/* 	Buffered writer: buffer[0], ..., buffer[size-1] are pending */
+	FILE *file;
+	char *buffer;
+	size_t size, sizeAlloc;
+} Writer;
+
 typedef struct Complex
 {
 	double re;
@@ -106,26 +213,110 @@ typedef struct Complex
 
 typedef struct Polygon
 {
-	int N, id;
-	// double x[NVERTICES];
-	//double y[NVERTICES];
-	//double xmin[2];
-	//double xmax[2];
+	/* 	All polygons are packed into a single vertex arena. Polygon i
+	 * 	has N[i] vertices stored in x[start[i]], y[start[i]], ...
+	 * 	and its bounding box in bbox[4*i] = {xmin, ymin, xmax, ymax}.
+	 * 	Circles, ellipses and axis-aligned boxes (type[i] != REG_POLYGON)
+	 * 	have no vertices and are described by param[NPARAM*i], ...
+	 * 	(see setPrimitive()).
+	 * 	Polygons with many vertices also have an edge index: their edges
+	 * 	are listed per horizontal slab (see createEdgeIndex()).
+	 */
+	size_t Npolys, Nvertices, Nslabs, NslabEdges;
+	size_t *start;
+	int *N, *type;
 	double *x;
 	double *y;
-	double *xmin;
-	double *xmax;
+	double *bbox;
+	double *param;
+	size_t *slab, *slabStart;
+	int *slabEdges;
 } Polygon;
 
+#define BBOX_MIN(polys,i,dim) ((polys)->bbox[4*(i)+(dim)])
+#define BBOX_MAX(polys,i,dim) ((polys)->bbox[4*(i)+2+(dim)])
+
+typedef struct Grid
+{
+	/* 	Uniform grid over the mask limits. cell[j*nx+i] is a polygon id
+	 * 	if the cell is fully inside this polygon, GRID_OUTSIDE if it is
+	 * 	outside all polygons, or -2-b for the boundary cell b, whose
+	 * 	candidate polygons are ids[start[b]], ..., ids[start[b+1]-1].
+	 */
+	size_t nx, ny, Nboundary;
+	double xmin[2], xmax[2], dx[2], idx[2];
+	int *cell;
+	size_t *start;
+	int *ids;
+} Grid;
+
 typedef struct Node
 {
-	int type, *root, id, *polysAll, SplitDim;
+	/* 	Flat kd-tree node. An internal node splits at SplitValue along
+	 * 	SplitDim, its children are nodes[Left] and nodes[Left+1].
+	 * 	A leaf holds the polygons ids[start], ..., ids[start+Npolys-1].
+	 */
+	int type, SplitDim;
 	double SplitValue;
-	size_t Nnodes, Npolys, NpolysAll;
-	int *poly_id;
-	void *Left, *Right;
+	size_t Left, start, Npolys;
 } Node;
 
+typedef struct Tree
+{
+	size_t Nnodes, Nids, leafSize;
+	Node *nodes;        /* breadth-first, nodes[0] is the root */
+	int *ids;           /* polygon ids of all leaves */
+	Polygon *polys;
+	Grid *grid;
+	void *map;          /* if loaded from an index file, arrays point into this mapping */
+	size_t mapSize;
+} Tree;
+
+typedef struct Cells
+{
+	/* 	Rectangles [x0,x1] x [y0,y1] covering the region where random
+	 * 	objects are drawn. Cell i is picked with probability
+	 * 	(weight[i]-weight[i-1])/weight[N-1] (cumulative areas). In
+	 * 	spherical coordinates, y is sin(dec) so that areas are exact.
+	 */
+	size_t N;
+	double *x0, *x1, *y0, *y1, *weight;
+} Cells;
+
+typedef struct Slice
+{
+	/* 	Horizontal cross-sections of the union of the regions ids[0],
+	 * 	..., ids[N-1] clipped to [x0,x1] (see sliceLength()). buffer
+	 * 	holds the intervals of one cross-section and crossings the edge
+	 * 	crossings of one polygon.
+	 */
+	const Polygon *polys;
+	const int *ids;
+	size_t N;
+	int coordType;
+	double x0, x1;
+	double *buffer, *crossings;
+} Slice;
+
+typedef struct IndexHeader
+{
+	/* 	Header of a mask index file. It is followed by the arrays of
+	 * 	the polygon arena, tree and grid, each one starting at
+	 * 	offset[k] bytes (a multiple of INDEXALIGN) from the beginning
+	 * 	of the file, in this order: polys->start, N, type, x, y, bbox,
+	 * 	param, tree->nodes, ids, grid->cell, start, ids, polys->slab,
+	 * 	slabStart, slabEdges.
+	 */
+	char magic[8];
+	int version, sizeofNode;
+	unsigned long long hash;    /* hash of the .reg file */
+	size_t Npolys, Nvertices, Nslabs, NslabEdges, Nnodes, Nids, leafSize;
+	size_t nx, ny, Nboundary, Ngrid_ids;
+	double xmin[2], xmax[2];    /* mask limits */
+	double gridMin[2], gridMax[2], dx[2], idx[2];
+	size_t offset[INDEXNARRAYS], size[INDEXNARRAYS], fileSize;
+} IndexHeader;
+
 /*
  *    Global variables
  */
@@ -138,15 +329,58 @@ double EPS;
  * 	Utils - geometric
  */
 
-int insidePolygon(Polygon *p,int Npoly, double x0,double y0,double x,double y, int *poly_id);
-int insidePolygonTree(Node *polyTree, double x0[2], double x[2], int *poly_id);
-Polygon *readPolygonFile(FILE *fileIn, int *Npolys, Node *polyTree);
-Node *readPolygonFileTree(FILE *fileIn, double xmin[2], double xmax[2]);
-Node *createNode(Polygon *polys, size_t Npolys, double minArea, int SplitDim, double xmin[2], double xmax[2], int firstCall);
-void free_Polygon(Polygon *polygon, size_t N);
-void free_Node(Node *node);
-void cpyPolygonAddress(Polygon *a, Polygon *b);
-void cpyPolygon(Polygon *a, Polygon *b);
+int insidePolygon(Polygon *polys, int Npolys, double x0, double y0, double x, double y, int *poly_id);
+int insidePolygonTree(Tree *polyTree, double x[2], int *poly_id);
+void insidePolygonTreeBatch(Tree *polyTree, const double *x, const double *y, size_t N, int *inside, int *poly_id);
+Node *findLeaf(const Tree *polyTree, const double x[2]);
+int insidePolygonList(Polygon *polys, const int *ids, size_t N, double x[2], int *poly_id);
+int insideRegion(const Polygon *polys, int i, double x, double y);
+void insideRegionKernel(const Polygon *polys, int i, const double *x, const double *y, size_t N, int *odd);
+void setPrimitive(Polygon *polys, size_t i, int type, double x0, double y0, double rx, double ry, double angle);
+int classifyCell(const Polygon *polys, int i, const double xmin[2], const double xmax[2]);
+int classifyEllipseRect(const double *p, const double dx[2], const double dy[2]);
+int crossingNumberOdd(const double *px, const double *py, int n, double x, double y);
+int crossingNumberSlab(const Polygon *polys, int i, double x, double y);
+size_t slabIndex(const double *p, size_t Nslabs, double y);
+void createEdgeIndex(Polygon *polys);
+void insidePolygonKernel(const double *px, const double *py, int n, const double *x, const double *y, size_t N, int *odd);
+Polygon *readPolygonFile(FILE *fileIn, int *Npolys, Tree *polyTree);
+Tree *readPolygonFileTree(FILE *fileIn, double xmin[2], double xmax[2], size_t leafSize);
+Polygon *parseRegions(const char *begin, const char *end);
+Polygon *mergePolygons(Polygon **parts, int Nparts);
+const char *findWord(const char *s, const char *end, const char *word);
+int angleUnit(const char *s, const char *end, double *scale);
+double parseDouble(const char *s, const char *end);
+char *readFileBuffer(FILE *fileIn, size_t *size, int *mapped);
+Tree *createTree(Polygon *polys, double xmin[2], double xmax[2], size_t leafSize);
+int findSplit(Polygon *polys, const int *ids, size_t N, const double xmin[2], const double xmax[2], int *SplitDim, double *SplitValue);
+Grid *createGrid(Polygon *polys, double xmin[2], double xmax[2]);
+size_t gridIndex(const Grid *grid, double x, int dim);
+int gridLookup(const Grid *grid, double x, double y);
+void free_Grid(Grid *grid);
+Cells *createCells(const Tree *polyTree, const double xmin[2], const double xmax[2], int coordType, int inside);
+void addCell(Cells *cells, double x0, double x1, double y0, double y1, int coordType);
+void drawInCells(const Cells *cells, const double u[3], int coordType, double *x, double *y);
+void free_Cells(Cells *cells);
+double maskArea(const Tree *polyTree, const double xmin[2], const double xmax[2], int coordType);
+double rectArea(double x0, double x1, double y0, double y1, int coordType);
+double regionArea(const Polygon *polys, const int *ids, size_t N, const double xmin[2], const double xmax[2], int coordType);
+void addBreak(double **breaks, size_t *N, size_t *Nalloc, double y, double ymin, double ymax);
+void clipBreaks(const Polygon *polys, int i, const double xmin[2], const double xmax[2], double **breaks, size_t *N, size_t *Nalloc);
+double sliceLength(const Slice *slice, double y);
+int regionInterval(const Polygon *polys, int i, double y, double x[2]);
+void sortDoubles(double *x, size_t N, size_t stride);
+double integrateSlice(const Slice *slice, double y0, double y1, double t0, double t1, double tol, int depth);
+double kronrodSlice(const Slice *slice, double y0, double y1, double t0, double t1, double *error);
+Polygon *allocPolygon(size_t Npolys, size_t Nvertices);
+void reallocPolygon(Polygon *polys, size_t NpolysAlloc, size_t NverticesAlloc);
+void setBoundingBox(Polygon *polys, size_t i);
+void free_Polygon(Polygon *polys);
+void free_Tree(Tree *tree);
+Tree *readMaskTree(const Config *para, double xmin[2], double xmax[2]);
+void saveIndex(const Tree *tree, const double xmin[2], const double xmax[2], unsigned long long hash, const char *fileName);
+Tree *loadIndex(const char *fileName, double xmin[2], double xmax[2], unsigned long long *hash);
+unsigned long long hashFile(const char *fileName);
 
 /*
  *		Utils - numeric
@@ -160,8 +394,37 @@ void rotate(double x0, double y0, double x, double y, double *xrot, double *yrot
 double determineMachineEpsilon();
 size_t determineSize_tError();
 gsl_rng *randomInitialize(size_t seed);
+void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]);
+double randomUniform(size_t seed, size_t i, uint32_t j);
+double randomFlat(const Config *para, gsl_rng *r, size_t i, uint32_t j, double a, double b);
+int randomIsIndexed(const Config *para);
+double quasiRandom(int sampler, size_t seed, size_t i, uint32_t j);
+uint64_t sobol(uint64_t i, uint32_t j);
+double halton(uint64_t i, uint32_t j);
+uint64_t reverseBits(uint64_t x);
+uint64_t owenScramble(uint64_t x, uint64_t seed);
+void randomPoints(const Config *para, gsl_rng *r, size_t first, size_t N, const double xmin[2], const double xmax[2], const Cells *cells, double *x, double *y);
 FILE *fopenAndCheck(const char *filename,char *mode);
 int getStrings(char *line, char *strings, char *delimit, size_t *N);
+int isMainThread();
+Lines *allocLines(size_t N);
+void appendLine(Lines *lines, const char *line, size_t length, int isObject);
+void free_Lines(Lines *lines);
+Reader *openReader(FILE *file, size_t sizeAlloc);
+int nextLine(Reader *reader, const char **line, size_t *length);
+int fillReader(Reader *reader);
+void free_Reader(Reader *reader);
+Writer *openWriter(FILE *file, size_t sizeAlloc);
+void writeBytes(Writer *writer, const char *s, size_t length);
+void flushWriter(Writer *writer);
+void free_Writer(Writer *writer);
+int getColumns(const char *line, size_t length, const int *cols, int Ncols, double *values);
+size_t formatFixed(char *s, double x, int precision);
+size_t formatGeneral(char *s, double x);
+size_t formatInt(char *s, long n);
+void writeFixed(Writer *writer, double x, int precision);
+void writeGeneral(Writer *writer, double x);
+void writeInt(Writer *writer, long n);
 void printCount(const size_t *count, const size_t *total,  const size_t step);
 int checkFileExt(const char *s1, const char *s2);
 int roundToNi(double a);
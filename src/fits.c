@@ -6,95 +6,1004 @@
 
 #include "fits.h"
 
-void *readFits(const Config *para, int *bitpix, int *typecode, char *tform, int *status, long naxes[2], double (**toDouble)(void *,long), int *size){
-   /* Reads fits file and return info. "toDouble" is a pointer to a pointer of a function. */
-
-   if(para->coordType != CART){
-      fprintf(stderr,"%s: fits file detected. coord should be set to cart for image coordinates. Exiting...\n",MYNAME);
-      exit(EXIT_FAILURE);
-   }
-   fitsfile *fptr;
-
-   fits_open_file(&fptr, para->fileRegInName, READONLY, status);
-   if(*status == FILE_NOT_OPENED){
-      fprintf(stderr,"%s: %s not found. Exiting...\n",MYNAME,para->fileRegInName);
-      exit(EXIT_FAILURE);
-   }
-   fits_get_img_type(fptr, bitpix, status);
-   fits_get_img_size(fptr, 2, naxes, status);
-
-   long fpixel[2];
-   fpixel[0] = fpixel[1] = 1;
-
-   void   *result;
-   char   *table_CHAR;
-   short  *table_SHORT;
-   long   *table_LONG;
-   float  *table_FLOAT;
-   double *table_DOUBLE;
-
-   fprintf(stderr,"Reading fits file (format detected: ");
-   switch (*bitpix){
-      case BYTE_IMG:
-         fprintf(stderr,"BYTE)...\n");
-         table_CHAR = (char *)malloc(naxes[0]*naxes[1]*sizeof(char));
-         fits_read_pix(fptr,TBYTE,fpixel,naxes[0]*naxes[1],NULL,table_CHAR,NULL,status);
-         result = (void *)table_CHAR;
-         *toDouble = toDoubleCHAR;
-         if (size != NULL) *size = sizeof(char);
-         if (typecode != NULL) *typecode = TBYTE;
-         if (tform != NULL) *tform = 'B';
-         break;
-      case SHORT_IMG:
-         fprintf(stderr,"SHORT)...\n");
-         table_SHORT = (short *)malloc(naxes[0]*naxes[1]*sizeof(short));
-         fits_read_pix(fptr,TSHORT,fpixel,naxes[0]*naxes[1],NULL,table_SHORT,NULL,status);
-         result = (void *)table_SHORT;
-         *toDouble = toDoubleSHORT;
-         if (size != NULL) *size = sizeof(short);
-         if (typecode != NULL) *typecode = TSHORT;
-         if (tform != NULL) *tform = 'I';
-         break;
-      case LONG_IMG:
-         fprintf(stderr,"LONG)...\n");
-         table_LONG = (long *)malloc(naxes[0]*naxes[1]*sizeof(long));
-         fits_read_pix(fptr,TLONG,fpixel,naxes[0]*naxes[1],NULL,table_LONG,NULL,status);
-         result = (void *)table_LONG;
-         *toDouble = toDoubleLONG;
-         if (size != NULL) *size = sizeof(long);
-         if (typecode != NULL) *typecode = TLONG;
-         if (tform != NULL) *tform = 'K';
-         break;
-      case FLOAT_IMG:
-         fprintf(stderr,"FLOAT)...\n");
-         table_FLOAT = (float *)malloc(naxes[0]*naxes[1]*sizeof(float));
-         fits_read_pix(fptr,TFLOAT,fpixel,naxes[0]*naxes[1],NULL,table_FLOAT,NULL,status);
-         result = (void *)table_FLOAT;
-         *toDouble = toDoubleFLOAT;
-         if (size != NULL) *size = sizeof(float);
-         if (typecode != NULL) *typecode = TFLOAT;
-         if (tform != NULL) *tform = 'E';
-         break;
-      case DOUBLE_IMG:
-         fprintf(stderr,"DOUBLE)...\n");
-         table_DOUBLE = (double *)malloc(naxes[0]*naxes[1]*sizeof(double));
-         fits_read_pix(fptr,TDOUBLE,fpixel,naxes[0]*naxes[1],NULL,table_DOUBLE,NULL,status);
-         result = (void *)table_DOUBLE;
-         *toDouble = toDoubleDOUBLE;
-         if (size != NULL) *size = sizeof(double);
-         if (typecode != NULL) *typecode = TDOUBLE;
-         if (tform != NULL) *tform = 'D';
-         break;
-      default:
-         fprintf(stderr,"NULL) \n%s: fits format not recognized. Exiting...\n",MYNAME);
-         exit(EXIT_FAILURE);
-   }
-
-   fits_close_file(fptr, status);
-
-   if (*status) fits_report_error(stderr, *status);
-
-   return result;
+Image *openImage(const Config *para, int *status){
+	/* 	Opens the fits image para->fileRegInName for pixel access with
+	 * 	pixelImage() and valueImage(). No pixel is read here: the image
+	 * 	is read by tiles on demand (see tileImage()), from the file
+	 * 	mapped (mmap) if it is neither compressed nor scaled, with
+	 * 	CFITSIO otherwise (tile-compressed, gzipped, BSCALE/BZERO), so
+	 * 	that only the parts of the image the points fall in are read.
+	 * 	"toDouble" converts a pixel (in the type of the image, of "size"
+	 * 	bytes) into a double.
+	 */
+
+	int n, compressed = 0, fd;
+	long t, Ntiles;
+	double bscale = 1.0, bzero = 0.0;
+	char urltype[FLEN_FILENAME], fileName[FLEN_FILENAME];
+	LONGLONG headstart, datastart, dataend;
+	struct stat st;
+
+	Image *result = (Image *)malloc(sizeof(Image));
+
+	fits_open_file(&result->fptr, para->fileRegInName, READONLY, status);
+	if(*status == FILE_NOT_OPENED){
+		fprintf(stderr,"%s: %s not found. Exiting...\n",MYNAME,para->fileRegInName);
+		exit(EXIT_FAILURE);
+	}
+	fits_get_img_type(result->fptr, &result->bitpix, status);
+	fits_get_img_size(result->fptr, 2, result->naxes, status);
+
+	fprintf(stderr,"Reading fits file (format detected: ");
+	switch (result->bitpix){
+		case BYTE_IMG:
+			fprintf(stderr,"BYTE)...\n");
+			result->toDouble = toDoubleCHAR;
+			result->size     = sizeof(char);
+			result->typecode = TBYTE;
+			result->tform    = 'B';
+			break;
+		case SHORT_IMG:
+			fprintf(stderr,"SHORT)...\n");
+			result->toDouble = toDoubleSHORT;
+			result->size     = sizeof(short);
+			result->typecode = TSHORT;
+			result->tform    = 'I';
+			break;
+		case LONG_IMG:
+			fprintf(stderr,"LONG)...\n");
+			result->toDouble = toDoubleLONG;
+			result->size     = sizeof(long);
+			result->typecode = TLONG;
+			result->tform    = 'K';
+			break;
+		case FLOAT_IMG:
+			fprintf(stderr,"FLOAT)...\n");
+			result->toDouble = toDoubleFLOAT;
+			result->size     = sizeof(float);
+			result->typecode = TFLOAT;
+			result->tform    = 'E';
+			break;
+		case DOUBLE_IMG:
+			fprintf(stderr,"DOUBLE)...\n");
+			result->toDouble = toDoubleDOUBLE;
+			result->size     = sizeof(double);
+			result->typecode = TDOUBLE;
+			result->tform    = 'D';
+			break;
+		default:
+			fprintf(stderr,"NULL) \n%s: fits format not recognized. Exiting...\n",MYNAME);
+			exit(EXIT_FAILURE);
+	}
+	if (*status){
+		fits_report_error(stderr, *status);
+		exit(EXIT_FAILURE);
+	}
+
+	/* 	with -coord spher, points are given in RA/Dec (see worldToPixel()) */
+	result->wcs = NULL;
+	if(para->coordType == RADEC) result->wcs = readWcs(result->fptr);
+
+	/* 	raw pixels can be used as they are on disk if the image is
+	 * 	neither compressed nor scaled, in a plain file */
+	result->map  = NULL;
+	result->data = NULL;
+	compressed = fits_is_compressed_image(result->fptr, status);
+	fits_read_key_dbl(result->fptr, "BSCALE", &bscale, NULL, status);
+	if(*status == KEY_NO_EXIST) *status = 0;
+	fits_read_key_dbl(result->fptr, "BZERO", &bzero, NULL, status);
+	if(*status == KEY_NO_EXIST) *status = 0;
+	fits_get_hduaddrll(result->fptr, &headstart, &datastart, &dataend, status);
+	fits_url_type(result->fptr, urltype, status);
+	fits_file_name(result->fptr, fileName, status);
+
+	if(!*status && !compressed && bscale == 1.0 && bzero == 0.0 && !strcmp(urltype, "file://")){
+		fd = open(fileName, O_RDONLY);
+		if(fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+			&& datastart + (LONGLONG)result->naxes[0]*result->naxes[1]*abs(result->bitpix)/8 <= (LONGLONG)st.st_size){
+			result->map = (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if(result->map == MAP_FAILED){
+				result->map = NULL;
+			}else{
+				result->mapSize = st.st_size;
+				result->data    = result->map + datastart;
+			}
+		}
+		if(fd >= 0) close(fd);
+	}
+	*status = 0;
+
+	if(result->data != NULL){
+		fits_close_file(result->fptr, status);
+		result->fptr = NULL;
+	}
+
+	/* 	tiles: the compression tiles (rows by default) or squares */
+	if(compressed){
+		result->tile[0] = result->naxes[0];
+		result->tile[1] = 1;
+		fits_read_key_lng(result->fptr, "ZTILE1", &result->tile[0], NULL, status);
+		fits_read_key_lng(result->fptr, "ZTILE2", &result->tile[1], NULL, status);
+		*status = 0;
+	}else{
+		result->tile[0] = result->tile[1] = FITSTILESIZE;
+	}
+	for(n=0;n<2;n++){
+		if(result->tile[n] < 1 || result->tile[n] > result->naxes[n]) result->tile[n] = result->naxes[n];
+		result->Ntiles[n] = (result->naxes[n] + result->tile[n] - 1)/result->tile[n];
+	}
+	Ntiles = result->Ntiles[0]*result->Ntiles[1];
+
+	/* 	as many slots as packed tiles fit in the cache */
+	result->Nslots = MIN((long)(FITSCACHESIZE/((result->tile[0]*result->tile[1] + 7)/8 + 2*sizeof(double))), Ntiles);
+	if(result->Nslots < 1) result->Nslots = 1;
+	result->cacheSize   = 0;
+	result->head        = result->tail = -1;
+	result->Nfree       = result->Nslots;
+	result->slotOf      = (long *)malloc(Ntiles*sizeof(long));
+	result->freeSlots   = (long *)malloc(result->Nslots*sizeof(long));
+	result->slotTile    = (long *)malloc(result->Nslots*sizeof(long));
+	result->slotPrev    = (long *)malloc(result->Nslots*sizeof(long));
+	result->slotNext    = (long *)malloc(result->Nslots*sizeof(long));
+	result->slotBytes   = (size_t *)malloc(result->Nslots*sizeof(size_t));
+	result->slotData    = (char **)malloc(result->Nslots*sizeof(char *));
+	result->slotFormat  = (char *)malloc(result->Nslots*sizeof(char));
+	result->slotPalette = (double *)malloc(2*result->Nslots*sizeof(double));
+	result->scratch     = (char *)malloc(result->tile[0]*result->tile[1]*result->size);
+	if(result->slotOf == NULL || result->freeSlots == NULL || result->slotTile == NULL || result->slotPrev == NULL
+		|| result->slotNext == NULL || result->slotBytes == NULL || result->slotData == NULL
+		|| result->slotFormat == NULL || result->slotPalette == NULL || result->scratch == NULL){
+		fprintf(stderr,"%s: not enough memory for the tiles of the image. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+	for(t=0;t<Ntiles;t++) result->slotOf[t] = TILENONE;
+	result->Nlevels      = 0;
+	result->summaryN     = NULL;
+	result->summary      = NULL;
+	result->summaryValue = NULL;
+	for(t=0;t<result->Nslots;t++){
+		result->freeSlots[t] = result->Nslots - 1 - t;
+		result->slotData[t]  = NULL;
+	}
+
+	fprintf(stderr,"Image %s by tiles of %ld x %ld pixels (%ld x %ld pixels)\n",
+		result->data != NULL ? "mapped, read" : "read", result->tile[0], result->tile[1], result->naxes[0], result->naxes[1]);
+
+	return result;
+}
+
+void closeImage(Image *image){
+	/* 	Unmaps or closes the image and frees the tile cache. */
+
+	int status = 0;
+	long n;
+
+	if(image == NULL) return;
+	if(image->map != NULL){
+		munmap(image->map, image->mapSize);
+	}else{
+		fits_close_file(image->fptr, &status);
+	}
+	for(n=0;n<image->Nslots;n++) free(image->slotData[n]);
+	free(image->slotOf);
+	free(image->freeSlots);
+	free(image->slotTile);
+	free(image->slotPrev);
+	free(image->slotNext);
+	free(image->slotBytes);
+	free(image->slotData);
+	free(image->slotFormat);
+	free(image->slotPalette);
+	free(image->scratch);
+	for(n=0;n<image->Nlevels;n++) free(image->summary[n]);
+	free(image->summary);
+	free(image->summaryN);
+	free(image->summaryValue);
+	free(image->wcs);
+	free(image);
+
+	return;
+}
+
+long tileImage(Image *image, long t){
+	/* 	Returns the slot of tile t, read if it is not in the cache, or
+	 * 	TILERAW if the pixels of the tile are used in the mapped image.
+	 * 	A tile with one or two pixel values (e.g. a 0/1 mask) is kept
+	 * 	as these values and one bit per pixel (none if uniform), the
+	 * 	others as an array of pixels (row-major, tiles of the last
+	 * 	column and row may be smaller). Least recently used tiles are
+	 * 	dropped to keep the cache under FITSCACHESIZE bytes.
+	 */
+
+	int status = 0, Nvalues;
+	long n, k, x0, y0, width, height, Npixels, fpixel[2], lpixel[2], inc[2] = {1, 1};
+	size_t bytes, size = image->size;
+	char *value[2], *pixels = image->scratch;
+
+	n = image->slotOf[t];
+	if(n == TILERAW) return n;
+	if(n >= 0){
+		/* 	move to the head of the list (most recently used) */
+		if(n != image->head){
+			image->slotNext[image->slotPrev[n]] = image->slotNext[n];
+			if(image->slotNext[n] >= 0) image->slotPrev[image->slotNext[n]] = image->slotPrev[n];
+			else image->tail = image->slotPrev[n];
+			image->slotPrev[n] = -1;
+			image->slotNext[n] = image->head;
+			image->slotPrev[image->head] = n;
+			image->head = n;
+		}
+		return n;
+	}
+
+	x0      = (t % image->Ntiles[0])*image->tile[0];
+	y0      = (t / image->Ntiles[0])*image->tile[1];
+	width   = MIN(image->tile[0], image->naxes[0] - x0);
+	height  = MIN(image->tile[1], image->naxes[1] - y0);
+	Npixels = width*height;
+
+	/* 	read the tile */
+	if(image->data != NULL){
+		int s = abs(image->bitpix)/8;
+		for(k=0;k<Npixels;k++){
+			decodePixelFits(image->data + ((y0 + k/width)*image->naxes[0] + x0 + k%width)*s, image->bitpix, pixels + k*size);
+		}
+	}else{
+		fpixel[0] = x0 + 1;
+		fpixel[1] = y0 + 1;
+		lpixel[0] = x0 + width;
+		lpixel[1] = y0 + height;
+		fits_read_subset(image->fptr, image->typecode, fpixel, lpixel, inc, NULL, pixels, NULL, &status);
+		if(status){
+			fits_report_error(stderr, status);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* 	number of pixel values (up to 3) */
+	value[0] = pixels;
+	Nvalues  = 1;
+	for(k=1;k<Npixels && Nvalues < 3;k++){
+		if(memcmp(pixels + k*size, value[0], size) && (Nvalues == 1 || memcmp(pixels + k*size, value[1], size))){
+			if(Nvalues < 2) value[1] = pixels + k*size;
+			Nvalues++;
+		}
+	}
+	if(Nvalues > 2 && image->data != NULL){
+		image->slotOf[t] = TILERAW;
+		return TILERAW;
+	}
+	bytes = (Nvalues == 1) ? 0 : (Nvalues == 2) ? (size_t)(Npixels + 7)/8 : Npixels*size;
+
+	/* 	free a slot and room in the cache */
+	while(image->tail >= 0 && (image->Nfree == 0 || image->cacheSize + bytes > FITSCACHESIZE)){
+		n = image->tail;
+		image->tail = image->slotPrev[n];
+		if(image->tail >= 0) image->slotNext[image->tail] = -1;
+		else image->head = -1;
+		image->slotOf[image->slotTile[n]] = TILENONE;
+		image->cacheSize -= image->slotBytes[n];
+		free(image->slotData[n]);
+		image->slotData[n] = NULL;
+		image->freeSlots[image->Nfree++] = n;
+	}
+	n = image->freeSlots[--image->Nfree];
+
+	image->slotData[n] = NULL;
+	if(bytes > 0){
+		image->slotData[n] = (char *)malloc(bytes);
+		if(image->slotData[n] == NULL){
+			fprintf(stderr,"%s: not enough memory for the tiles of the image. Exiting...\n",MYNAME);
+			exit(EXIT_FAILURE);
+		}
+	}
+	switch (Nvalues){
+		case 1:
+			image->slotFormat[n] = TILEUNIFORM;
+			memcpy(image->slotPalette + 2*n, value[0], size);
+			break;
+		case 2:
+			image->slotFormat[n] = TILEPACKED;
+			memcpy(image->slotPalette + 2*n, value[0], size);
+			memcpy(image->slotPalette + 2*n + 1, value[1], size);
+			memset(image->slotData[n], 0, bytes);
+			for(k=0;k<Npixels;k++){
+				if(memcmp(pixels + k*size, value[0], size)) image->slotData[n][k >> 3] |= 1 << (k & 7);
+			}
+			break;
+		default:
+			image->slotFormat[n] = TILEPIXELS;
+			memcpy(image->slotData[n], pixels, bytes);
+	}
+	image->slotTile[n]  = t;
+	image->slotBytes[n] = bytes;
+	image->cacheSize   += bytes;
+	image->slotOf[t]    = n;
+
+	image->slotPrev[n] = -1;
+	image->slotNext[n] = image->head;
+	if(image->head >= 0) image->slotPrev[image->head] = n;
+	else image->tail = n;
+	image->head = n;
+
+	return n;
+}
+
+void pixelImage(Image *image, long i, long j, void *pixel){
+	/* 	Copies pixel (i,j) (starting at 0) into pixel, in the type of
+	 * 	the image, from the summary if its tile is uniform (see
+	 * 	summaryImage()), from its tile otherwise (see tileImage()).
+	 * 	Pixels outside the image are 0. Not thread-safe (the cache is
+	 * 	updated).
+	 */
+
+	long n, k, t, ti, tj, width;
+
+	if(i < 0 || j < 0 || i >= image->naxes[0] || j >= image->naxes[1]){
+		memset(pixel, 0, image->size);
+		return;
+	}
+
+	ti = i / image->tile[0];
+	tj = j / image->tile[1];
+	t  = tj*image->Ntiles[0] + ti;
+	if(image->summary != NULL && (image->summary[0][t] & SUMMARYUNIFORM)){
+		memcpy(pixel, image->summaryValue + t, image->size);
+		return;
+	}
+	n  = tileImage(image, t);
+	if(n == TILERAW){
+		decodePixelFits(image->data + (j*image->naxes[0] + i)*(abs(image->bitpix)/8), image->bitpix, pixel);
+		return;
+	}
+
+	width = MIN(image->tile[0], image->naxes[0] - ti*image->tile[0]);
+	k     = (j - tj*image->tile[1])*width + i - ti*image->tile[0];
+	switch (image->slotFormat[n]){
+		case TILEUNIFORM:
+			memcpy(pixel, image->slotPalette + 2*n, image->size);
+			break;
+		case TILEPACKED:
+			memcpy(pixel, image->slotPalette + 2*n + ((image->slotData[n][k >> 3] >> (k & 7)) & 1), image->size);
+			break;
+		default:
+			memcpy(pixel, image->slotData[n] + k*image->size, image->size);
+	}
+
+	return;
+}
+
+double valueImage(Image *image, long i, long j){
+	/* 	Value of pixel (i,j) (starting at 0) as a double (see pixelImage()). */
+
+	double pixel[1];
+
+	pixelImage(image, i, j, pixel);
+
+	return image->toDouble(pixel, 0);
+}
+
+void summaryImage(Image *image, const double xmin[2], const double xmax[2]){
+	/* 	Builds the tile summary pyramid: each tile overlapping the limits
+	 * 	(xmin,xmax) in image coordinates is read once (see tileImage())
+	 * 	and flagged SUMMARYZERO if one of its pixels is 0 (outside the
+	 * 	mask), SUMMARYNONZERO if one is not: only one flag means all
+	 * 	good, resp. all bad, both a mixed tile. Uniform tiles are also
+	 * 	flagged SUMMARYUNIFORM, their value is kept in summaryValue and
+	 * 	they are never read again. Tiles outside the limits are not read
+	 * 	and counted as mixed. Level l+1 merges 2 x 2 cells of level l,
+	 * 	up to a single cell (see createCellsImage()).
+	 */
+
+	int d, l;
+	long n, k, t, ti, tj, t0[2], t1[2], width, height, Npixels, Nread = 0, Nuniform = 0, Nmixed = 0;
+	double a, b, v, pixel[1];
+	char flags;
+	const long *N;
+
+	if(image->summary != NULL) return;
+
+	/* 	number of levels */
+	image->Nlevels = 1;
+	for(n=MAX(image->Ntiles[0], image->Ntiles[1]);n>1;n=(n+1)/2) image->Nlevels++;
+	image->summaryN     = (long *)malloc(2*image->Nlevels*sizeof(long));
+	image->summary      = (char **)malloc(image->Nlevels*sizeof(char *));
+	image->summaryValue = (double *)malloc(image->Ntiles[0]*image->Ntiles[1]*sizeof(double));
+	if(image->summaryN == NULL || image->summary == NULL || image->summaryValue == NULL){
+		fprintf(stderr,"%s: not enough memory for the tile summary of the image. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+	for(l=0;l<image->Nlevels;l++){
+		image->summaryN[2*l]   = (l == 0) ? image->Ntiles[0] : (image->summaryN[2*(l-1)] + 1)/2;
+		image->summaryN[2*l+1] = (l == 0) ? image->Ntiles[1] : (image->summaryN[2*(l-1)+1] + 1)/2;
+		image->summary[l]      = (char *)malloc(image->summaryN[2*l]*image->summaryN[2*l+1]*sizeof(char));
+		if(image->summary[l] == NULL){
+			fprintf(stderr,"%s: not enough memory for the tile summary of the image. Exiting...\n",MYNAME);
+			exit(EXIT_FAILURE);
+		}
+	}
+	memset(image->summary[0], SUMMARYZERO | SUMMARYNONZERO, image->Ntiles[0]*image->Ntiles[1]);
+
+	/* 	tiles with pixels (i,j) (centers at i+1, j+1) that points within the limits can fall in */
+	t0[0] = t0[1] = 0;
+	t1[0] = t1[1] = -1;
+	for(d=0;d<2;d++){
+		a = xmin[d] - 1.5;
+		b = xmax[d] - 0.5;
+		if(a < 0.0) a = 0.0;
+		if(b > image->naxes[d] - 1) b = image->naxes[d] - 1;
+		if(a > b) break;
+		t0[d] = (long)floor(a)/image->tile[d];
+		t1[d] = (long)ceil(b)/image->tile[d];
+	}
+
+	/* 	level 0: the tiles */
+	for(tj=t0[1];tj<=t1[1];tj++){
+		for(ti=t0[0];ti<=t1[0];ti++){
+			t       = tj*image->Ntiles[0] + ti;
+			width   = MIN(image->tile[0], image->naxes[0] - ti*image->tile[0]);
+			height  = MIN(image->tile[1], image->naxes[1] - tj*image->tile[1]);
+			Npixels = width*height;
+			n       = tileImage(image, t);
+			flags   = 0;
+			if(n == TILERAW){
+				for(k=0;k<Npixels && flags != (SUMMARYZERO | SUMMARYNONZERO);k++){
+					decodePixelFits(image->data + ((tj*image->tile[1] + k/width)*image->naxes[0] + ti*image->tile[0] + k%width)*(abs(image->bitpix)/8), image->bitpix, pixel);
+					flags |= (image->toDouble(pixel, 0) == 0.0) ? SUMMARYZERO : SUMMARYNONZERO;
+				}
+			}else{
+				switch (image->slotFormat[n]){
+					case TILEUNIFORM:
+						v      = image->toDouble(image->slotPalette + 2*n, 0);
+						flags  = ((v == 0.0) ? SUMMARYZERO : SUMMARYNONZERO) | SUMMARYUNIFORM;
+						memcpy(image->summaryValue + t, image->slotPalette + 2*n, image->size);
+						Nuniform++;
+						break;
+					case TILEPACKED:
+						flags  = (image->toDouble(image->slotPalette + 2*n, 0) == 0.0) ? SUMMARYZERO : SUMMARYNONZERO;
+						flags |= (image->toDouble(image->slotPalette + 2*n + 1, 0) == 0.0) ? SUMMARYZERO : SUMMARYNONZERO;
+						break;
+					default:
+						for(k=0;k<Npixels && flags != (SUMMARYZERO | SUMMARYNONZERO);k++){
+							flags |= (image->toDouble(image->slotData[n], k) == 0.0) ? SUMMARYZERO : SUMMARYNONZERO;
+						}
+				}
+			}
+			if((flags & (SUMMARYZERO | SUMMARYNONZERO)) == (SUMMARYZERO | SUMMARYNONZERO)) Nmixed++;
+			image->summary[0][t] = flags;
+			Nread++;
+		}
+	}
+
+	/* 	coarser levels: a cell has the flags of its (up to) 4 cells */
+	for(l=1;l<image->Nlevels;l++){
+		N = image->summaryN + 2*(l-1);
+		for(tj=0;tj<image->summaryN[2*l+1];tj++){
+			for(ti=0;ti<image->summaryN[2*l];ti++){
+				flags = image->summary[l-1][2*tj*N[0] + 2*ti];
+				if(2*ti+1 < N[0]) flags |= image->summary[l-1][2*tj*N[0] + 2*ti+1];
+				if(2*tj+1 < N[1]) flags |= image->summary[l-1][(2*tj+1)*N[0] + 2*ti];
+				if(2*ti+1 < N[0] && 2*tj+1 < N[1]) flags |= image->summary[l-1][(2*tj+1)*N[0] + 2*ti+1];
+				image->summary[l][tj*image->summaryN[2*l] + ti] = flags & (SUMMARYZERO | SUMMARYNONZERO);
+			}
+		}
+	}
+
+	fprintf(stderr,"Tile summary: %ld tiles read (%ld uniform, %ld mixed), %d levels\n", Nread, Nuniform, Nmixed, image->Nlevels);
+
+	return;
+}
+
+Cells *createCellsImage(const Image *image, const double xmin[2], const double xmax[2], int inside){
+	/* 	Decomposes the limits [xmin,xmax] (image coordinates) into the
+	 * 	cells where random objects outside the mask (pixel = 0, or
+	 * 	pixel != 0 if inside = 1) can fall, from the tile summary (see
+	 * 	summaryImage(), which must be built): the largest blocks of all
+	 * 	good tiles, the mixed tiles, and the parts of the limits outside
+	 * 	the image (pixels = 0). All bad blocks are dropped, so that only
+	 * 	objects drawn in mixed tiles can be rejected.
+	 */
+
+	size_t Nalloc;
+	double g0[2], g1[2];
+
+	Cells *result  = (Cells *)malloc(sizeof(Cells));
+	Nalloc         = image->Ntiles[0]*image->Ntiles[1] + 5;
+	result->N      = 0;
+	result->x0     = (double *)malloc(Nalloc*sizeof(double));
+	result->x1     = (double *)malloc(Nalloc*sizeof(double));
+	result->y0     = (double *)malloc(Nalloc*sizeof(double));
+	result->y1     = (double *)malloc(Nalloc*sizeof(double));
+	result->weight = (double *)malloc(Nalloc*sizeof(double));
+	if(result->x0 == NULL || result->x1 == NULL || result->y0 == NULL || result->y1 == NULL || result->weight == NULL){
+		fprintf(stderr,"%s: not enough memory for %zd sampling cells. Exiting...\n",MYNAME,Nalloc);
+		exit(EXIT_FAILURE);
+	}
+
+	addCellsImage(image, result, image->Nlevels-1, 0, 0, xmin, xmax, inside ? SUMMARYNONZERO : SUMMARYZERO);
+
+	/* 	limits outside the image: left, right, bottom and top strips */
+	if(!inside){
+		g0[0] = (0.5 > xmin[0]) ? 0.5 : xmin[0];
+		g1[0] = (image->naxes[0]+0.5 < xmax[0]) ? image->naxes[0]+0.5 : xmax[0];
+		g0[1] = (0.5 > xmin[1]) ? 0.5 : xmin[1];
+		g1[1] = (image->naxes[1]+0.5 < xmax[1]) ? image->naxes[1]+0.5 : xmax[1];
+		if(g0[0] > g1[0] || g0[1] > g1[1]){
+			/* 	the limits do not overlap the image */
+			addCell(result, xmin[0], xmax[0], xmin[1], xmax[1], CART);
+		}else{
+			addCell(result, xmin[0], g0[0], xmin[1], xmax[1], CART);
+			addCell(result, g1[0], xmax[0], xmin[1], xmax[1], CART);
+			addCell(result, g0[0], g1[0], xmin[1], g0[1], CART);
+			addCell(result, g0[0], g1[0], g1[1], xmax[1], CART);
+		}
+	}
+
+	return result;
+}
+
+void addCellsImage(const Image *image, Cells *cells, int l, long ci, long cj, const double xmin[2], const double xmax[2], char keep){
+	/* 	Appends the cell (ci,cj) of level l of the tile summary, clipped
+	 * 	to the limits, if all its pixels are kept (flag keep only) or if
+	 * 	it is a mixed tile, or its 4 cells of level l-1 otherwise. Cells
+	 * 	with no pixel kept are dropped (see createCellsImage()).
+	 */
+
+	int d;
+	long a, b;
+	double x0[2], x1[2];
+	char flags = image->summary[l][cj*image->summaryN[2*l] + ci];
+
+	if(!(flags & keep)) return;
+
+	if(l > 0 && (flags & (SUMMARYZERO | SUMMARYNONZERO)) != keep){
+		for(b=2*cj;b<=2*cj+1 && b<image->summaryN[2*(l-1)+1];b++){
+			for(a=2*ci;a<=2*ci+1 && a<image->summaryN[2*(l-1)];a++){
+				addCellsImage(image, cells, l-1, a, b, xmin, xmax, keep);
+			}
+		}
+		return;
+	}
+
+	/* 	pixels of the tiles [ci*2^l, (ci+1)*2^l) x [cj*2^l, (cj+1)*2^l),
+	 * 	pixel i (from 0) covers [i+0.5,i+1.5] */
+	for(d=0;d<2;d++){
+		a     = ((d == 0) ? ci : cj) << l;
+		b     = MIN(((((d == 0) ? ci : cj) + 1) << l)*image->tile[d], image->naxes[d]);
+		x0[d] = a*image->tile[d] + 0.5;
+		x1[d] = b + 0.5;
+		if(x0[d] < xmin[d]) x0[d] = xmin[d];
+		if(x1[d] > xmax[d]) x1[d] = xmax[d];
+	}
+	addCell(cells, x0[0], x1[0], x0[1], x1[1], CART);
+
+	return;
+}
+
+void valuesImage(Image *image, const double *x, const double *y, size_t N, const double xmin[2], const double xmax[2], double null, double *value){
+	/* 	Values (as doubles) of the pixels of the N points (x,y) in
+	 * 	image coordinates, null for points outside the limits and 0
+	 * 	for points inside the limits but outside the image. Points are
+	 * 	converted into pixels by blocks of GATHERBLOCK (see
+	 * 	pixelIndexKernel()) and the values gathered by the kernel of
+	 * 	the image type (see GATHERIMAGE()), with no call per point.
+	 * 	Not thread-safe (see pixelImage()).
+	 */
+
+	size_t k, Nk;
+	int i[GATHERBLOCK], j[GATHERBLOCK];
+
+	for(k=0;k<N;k+=GATHERBLOCK){
+		Nk = MIN(N - k, GATHERBLOCK);
+		pixelIndexKernel(x+k, y+k, Nk, xmin, xmax, image->naxes, i, j);
+		switch (image->bitpix){
+			case BYTE_IMG:   gatherImageCHAR(image, i, j, Nk, null, value+k);   break;
+			case SHORT_IMG:  gatherImageSHORT(image, i, j, Nk, null, value+k);  break;
+			case LONG_IMG:   gatherImageLONG(image, i, j, Nk, null, value+k);   break;
+			case FLOAT_IMG:  gatherImageFLOAT(image, i, j, Nk, null, value+k);  break;
+			case DOUBLE_IMG: gatherImageDOUBLE(image, i, j, Nk, null, value+k); break;
+		}
+	}
+
+	return;
+}
+
+void pixelIndexKernel(const double *x, const double *y, size_t N, const double xmin[2], const double xmax[2], const long naxes[2], int *i, int *j){
+	/* 	Pixels (i[k],j[k]) (starting at 0) of the N points (x,y), with
+	 * 	the pixel centers at integer coordinates (rounded half away
+	 * 	from zero, as roundToNi()). i[k] is set to PIXELOUTSIDE for
+	 * 	points not strictly inside the limits and to PIXELNONE for
+	 * 	points inside the limits but outside the image. Vectorised
+	 * 	with AVX-512 or AVX2 when available.
+	 */
+
+	size_t k = 0;
+	double rx, ry;
+
+#if defined(__AVX512F__)
+	__m512d one = _mm512_set1_pd(1.0), half = _mm512_set1_pd(0.5);
+	__m512d x0 = _mm512_set1_pd(xmin[0]), x1 = _mm512_set1_pd(xmax[0]);
+	__m512d y0 = _mm512_set1_pd(xmin[1]), y1 = _mm512_set1_pd(xmax[1]);
+	__m512d nx = _mm512_set1_pd((double)naxes[0]), ny = _mm512_set1_pd((double)naxes[1]);
+	for(;k+8<=N;k+=8){
+		__m512d X = _mm512_loadu_pd(x+k);
+		__m512d Y = _mm512_loadu_pd(y+k);
+		__mmask8 in = _mm512_cmp_pd_mask(x0, X, _CMP_LT_OQ) & _mm512_cmp_pd_mask(X, x1, _CMP_LT_OQ)
+			& _mm512_cmp_pd_mask(y0, Y, _CMP_LT_OQ) & _mm512_cmp_pd_mask(Y, y1, _CMP_LT_OQ);
+		/* 	round half away from zero: trunc, +-1 if the rest is >= 1/2 */
+		__m512d TX = _mm512_roundscale_pd(X, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+		__m512d TY = _mm512_roundscale_pd(Y, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+		__m512d RX = _mm512_mask_add_pd(TX, _mm512_cmp_pd_mask(_mm512_sub_pd(X, TX), half, _CMP_GE_OQ), TX, one);
+		__m512d RY = _mm512_mask_add_pd(TY, _mm512_cmp_pd_mask(_mm512_sub_pd(Y, TY), half, _CMP_GE_OQ), TY, one);
+		RX = _mm512_mask_sub_pd(RX, _mm512_cmp_pd_mask(_mm512_sub_pd(TX, X), half, _CMP_GE_OQ), RX, one);
+		RY = _mm512_mask_sub_pd(RY, _mm512_cmp_pd_mask(_mm512_sub_pd(TY, Y), half, _CMP_GE_OQ), RY, one);
+		__mmask8 image = _mm512_cmp_pd_mask(one, RX, _CMP_LE_OQ) & _mm512_cmp_pd_mask(RX, nx, _CMP_LE_OQ)
+			& _mm512_cmp_pd_mask(one, RY, _CMP_LE_OQ) & _mm512_cmp_pd_mask(RY, ny, _CMP_LE_OQ);
+		__m512d I = _mm512_mask_blend_pd(in, _mm512_set1_pd(PIXELOUTSIDE), _mm512_mask_blend_pd(image, _mm512_set1_pd(PIXELNONE), _mm512_sub_pd(RX, one)));
+		__m512d J = _mm512_mask_blend_pd(in & image, _mm512_setzero_pd(), _mm512_sub_pd(RY, one));
+		_mm256_storeu_si256((__m256i *)(i+k), _mm512_cvttpd_epi32(I));
+		_mm256_storeu_si256((__m256i *)(j+k), _mm512_cvttpd_epi32(J));
+	}
+#elif defined(__AVX2__)
+	__m256d one = _mm256_set1_pd(1.0), half = _mm256_set1_pd(0.5);
+	__m256d x0 = _mm256_set1_pd(xmin[0]), x1 = _mm256_set1_pd(xmax[0]);
+	__m256d y0 = _mm256_set1_pd(xmin[1]), y1 = _mm256_set1_pd(xmax[1]);
+	__m256d nx = _mm256_set1_pd((double)naxes[0]), ny = _mm256_set1_pd((double)naxes[1]);
+	for(;k+4<=N;k+=4){
+		__m256d X = _mm256_loadu_pd(x+k);
+		__m256d Y = _mm256_loadu_pd(y+k);
+		__m256d in = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(x0, X, _CMP_LT_OQ), _mm256_cmp_pd(X, x1, _CMP_LT_OQ)),
+			_mm256_and_pd(_mm256_cmp_pd(y0, Y, _CMP_LT_OQ), _mm256_cmp_pd(Y, y1, _CMP_LT_OQ)));
+		/* 	round half away from zero: trunc, +-1 if the rest is >= 1/2 */
+		__m256d TX = _mm256_round_pd(X, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+		__m256d TY = _mm256_round_pd(Y, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+		__m256d RX = _mm256_add_pd(TX, _mm256_and_pd(_mm256_cmp_pd(_mm256_sub_pd(X, TX), half, _CMP_GE_OQ), one));
+		__m256d RY = _mm256_add_pd(TY, _mm256_and_pd(_mm256_cmp_pd(_mm256_sub_pd(Y, TY), half, _CMP_GE_OQ), one));
+		RX = _mm256_sub_pd(RX, _mm256_and_pd(_mm256_cmp_pd(_mm256_sub_pd(TX, X), half, _CMP_GE_OQ), one));
+		RY = _mm256_sub_pd(RY, _mm256_and_pd(_mm256_cmp_pd(_mm256_sub_pd(TY, Y), half, _CMP_GE_OQ), one));
+		__m256d image = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(one, RX, _CMP_LE_OQ), _mm256_cmp_pd(RX, nx, _CMP_LE_OQ)),
+			_mm256_and_pd(_mm256_cmp_pd(one, RY, _CMP_LE_OQ), _mm256_cmp_pd(RY, ny, _CMP_LE_OQ)));
+		__m256d I = _mm256_blendv_pd(_mm256_set1_pd(PIXELOUTSIDE), _mm256_blendv_pd(_mm256_set1_pd(PIXELNONE), _mm256_sub_pd(RX, one), image), in);
+		__m256d J = _mm256_and_pd(_mm256_and_pd(in, image), _mm256_sub_pd(RY, one));
+		_mm_storeu_si128((__m128i *)(i+k), _mm256_cvttpd_epi32(I));
+		_mm_storeu_si128((__m128i *)(j+k), _mm256_cvttpd_epi32(J));
+	}
+#endif
+
+	/* 	scalar fallback and remainder */
+	for(;k<N;k++){
+		j[k] = 0;
+		if(!(xmin[0] < x[k] && x[k] < xmax[0] && xmin[1] < y[k] && y[k] < xmax[1])){
+			i[k] = PIXELOUTSIDE;
+			continue;
+		}
+		rx = round(x[k]);
+		ry = round(y[k]);
+		if(1.0 <= rx && rx <= naxes[0] && 1.0 <= ry && ry <= naxes[1]){
+			i[k] = (int)rx - 1;
+			j[k] = (int)ry - 1;
+		}else{
+			i[k] = PIXELNONE;
+		}
+	}
+
+	return;
+}
+
+/* 	Gather kernels: value[k] = pixel (i[k],j[k]) of an image of type
+ * 	TYPE, from the summary if its tile is uniform (see summaryImage()),
+ * 	read from its tile otherwise (see tileImage()), or with RAW() from
+ * 	the big-endian pixels of RAWSIZE bytes of the mapped image. One
+ * 	function per image type, so that the conversion is inlined. */
+#define GATHERIMAGE(NAME, TYPE, RAWSIZE, RAW)                                          \
+void NAME(Image *image, const int *i, const int *j, size_t N, double null, double *value){ \
+	size_t k;                                                                          \
+	long n, p, t, ti, tj, width;                                                       \
+	TYPE v;                                                                            \
+	const unsigned char *raw;                                                          \
+	for(k=0;k<N;k++){                                                                  \
+		if(i[k] < 0){                                                                  \
+			value[k] = (i[k] == PIXELOUTSIDE) ? null : 0.0;                            \
+			continue;                                                                  \
+		}                                                                              \
+		ti = i[k] / image->tile[0];                                                    \
+		tj = j[k] / image->tile[1];                                                    \
+		t  = tj*image->Ntiles[0] + ti;                                                 \
+		if(image->summary != NULL && (image->summary[0][t] & SUMMARYUNIFORM)){         \
+			memcpy(&v, image->summaryValue + t, sizeof(TYPE));                         \
+			value[k] = (double)v;                                                      \
+			continue;                                                                  \
+		}                                                                              \
+		n  = tileImage(image, t);                                                      \
+		if(n == TILERAW){                                                              \
+			raw = image->data + ((long)j[k]*image->naxes[0] + i[k])*RAWSIZE;            \
+			value[k] = (double)(RAW);                                                  \
+			continue;                                                                  \
+		}                                                                              \
+		width = MIN(image->tile[0], image->naxes[0] - ti*image->tile[0]);              \
+		p     = (j[k] - tj*image->tile[1])*width + i[k] - ti*image->tile[0];           \
+		switch (image->slotFormat[n]){                                                 \
+			case TILEUNIFORM:                                                          \
+				memcpy(&v, image->slotPalette + 2*n, sizeof(TYPE));                    \
+				break;                                                                 \
+			case TILEPACKED:                                                           \
+				memcpy(&v, image->slotPalette + 2*n + ((image->slotData[n][p >> 3] >> (p & 7)) & 1), sizeof(TYPE)); \
+				break;                                                                 \
+			default:                                                                   \
+				memcpy(&v, image->slotData[n] + p*sizeof(TYPE), sizeof(TYPE));         \
+		}                                                                              \
+		value[k] = (double)v;                                                          \
+	}                                                                                  \
+	return;                                                                            \
+}
+
+GATHERIMAGE(gatherImageCHAR,   char,   1, (char)raw[0])
+GATHERIMAGE(gatherImageSHORT,  short,  2, (short)bigEndian16(raw))
+GATHERIMAGE(gatherImageLONG,   long,   4, (int32_t)bigEndian32(raw))
+GATHERIMAGE(gatherImageFLOAT,  float,  4, floatBigEndian(raw))
+GATHERIMAGE(gatherImageDOUBLE, double, 8, doubleBigEndian(raw))
+
+Wcs *readWcs(fitsfile *fptr){
+	/* 	Reads the celestial WCS of the current image of fptr (Calabretta
+	 * 	& Greisen 2002, A&A 395, 1077): projection (TAN, SIN, ZEA, ARC,
+	 * 	STG or CAR), reference pixel and linear transformation (CDi_j,
+	 * 	or PCi_j and CDELTi, or CROTA2 and CDELTi) and the celestial
+	 * 	coordinates of the native pole, from CRVALi, LONPOLE and LATPOLE.
+	 * 	Distortions (SIP, PVi_m) are not supported.
+	 */
+
+	int i, k, status = 0;
+	char ctype[2][FLEN_VALUE], key[FLEN_KEYWORD];
+	double cdelt[2] = {1.0, 1.0}, pc[2][2] = {{1.0, 0.0}, {0.0, 1.0}}, crota = 0.0, det;
+	double phi0, theta0, lonpole, latpole = 90.0, psi, R, d, dp[2];
+
+	Wcs *result = (Wcs *)malloc(sizeof(Wcs));
+
+	for(i=0;i<2;i++){
+		sprintf(key, "CTYPE%d", i+1);
+		fits_read_key_str(fptr, key, ctype[i], NULL, &status);
+		sprintf(key, "CRPIX%d", i+1);
+		fits_read_key_dbl(fptr, key, &result->crpix[i], NULL, &status);
+		sprintf(key, "CRVAL%d", i+1);
+		fits_read_key_dbl(fptr, key, &result->crval[i], NULL, &status);
+	}
+	if(status){
+		fprintf(stderr,"%s: no WCS (CTYPEi, CRPIXi, CRVALi) in the fits mask header for -coord spher. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+
+	/* 	axes: "RA---TAN", "DEC--TAN", "GLON-ZEA", etc. */
+	result->lng = (!strncmp(ctype[0], "DEC", 3) || !strncmp(ctype[0]+1, "LAT", 3)) ? 1 : 0;
+	if(strlen(ctype[0]) < 8 || strlen(ctype[1]) < 8 || strcmp(ctype[0]+4, ctype[1]+4)){
+		fprintf(stderr,"%s: WCS types %s and %s not recognized. Exiting...\n",MYNAME,ctype[0],ctype[1]);
+		exit(EXIT_FAILURE);
+	}
+	if(strlen(ctype[0]) > 8){
+		fprintf(stderr,"%s: WCS distortions (%s) are ignored\n",MYNAME,ctype[0]+8);
+	}
+	if(!strncmp(ctype[0]+5, "TAN", 3))      result->projection = WCSTAN;
+	else if(!strncmp(ctype[0]+5, "SIN", 3)) result->projection = WCSSIN;
+	else if(!strncmp(ctype[0]+5, "ZEA", 3)) result->projection = WCSZEA;
+	else if(!strncmp(ctype[0]+5, "ARC", 3)) result->projection = WCSARC;
+	else if(!strncmp(ctype[0]+5, "STG", 3)) result->projection = WCSSTG;
+	else if(!strncmp(ctype[0]+5, "CAR", 3)) result->projection = WCSCAR;
+	else{
+		fprintf(stderr,"%s: WCS projection %.3s not supported (TAN, SIN, ZEA, ARC, STG or CAR). Exiting...\n",MYNAME,ctype[0]+5);
+		exit(EXIT_FAILURE);
+	}
+
+	/* 	linear transformation: CD (missing elements are 0), or PC and
+	 * 	CDELT, or CROTA2 and CDELT */
+	result->cd[0][0] = result->cd[0][1] = result->cd[1][0] = result->cd[1][1] = 0.0;
+	fits_read_key_dbl(fptr, "CD1_1", &result->cd[0][0], NULL, &status);
+	if(status == 0){
+		fits_read_key_dbl(fptr, "CD1_2", &result->cd[0][1], NULL, &status); status = 0;
+		fits_read_key_dbl(fptr, "CD2_1", &result->cd[1][0], NULL, &status); status = 0;
+		fits_read_key_dbl(fptr, "CD2_2", &result->cd[1][1], NULL, &status); status = 0;
+	}else{
+		status = 0;
+		fits_read_key_dbl(fptr, "CDELT1", &cdelt[0], NULL, &status); status = 0;
+		fits_read_key_dbl(fptr, "CDELT2", &cdelt[1], NULL, &status); status = 0;
+		fits_read_key_dbl(fptr, "CROTA2", &crota, NULL, &status);
+		if(status == 0){
+			crota *= PI/180.0;
+			pc[0][0] = cos(crota);
+			pc[0][1] = -sin(crota)*cdelt[1]/cdelt[0];
+			pc[1][0] = sin(crota)*cdelt[0]/cdelt[1];
+			pc[1][1] = cos(crota);
+		}
+		for(i=0;i<2;i++){
+			for(k=0;k<2;k++){
+				status = 0;
+				sprintf(key, "PC%d_%d", i+1, k+1);
+				fits_read_key_dbl(fptr, key, &pc[i][k], NULL, &status);
+				result->cd[i][k] = cdelt[i]*pc[i][k];
+			}
+		}
+	}
+	status = 0;
+	det = result->cd[0][0]*result->cd[1][1] - result->cd[0][1]*result->cd[1][0];
+	if(det == 0.0){
+		fprintf(stderr,"%s: singular WCS matrix in the fits mask header. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+	result->cdInverse[0][0] =  result->cd[1][1]/det;
+	result->cdInverse[0][1] = -result->cd[0][1]/det;
+	result->cdInverse[1][0] = -result->cd[1][0]/det;
+	result->cdInverse[1][1] =  result->cd[0][0]/det;
+
+	/* 	native coordinates of the reference point, celestial pole */
+	double alpha0 = result->crval[result->lng]*PI/180.0, delta0 = result->crval[1-result->lng]*PI/180.0;
+	phi0    = 0.0;
+	theta0  = (result->projection == WCSCAR) ? 0.0 : PI/2.0;
+	lonpole = (delta0 >= theta0) ? 0.0 : 180.0;
+	fits_read_key_dbl(fptr, "LONPOLE", &lonpole, NULL, &status); status = 0;
+	fits_read_key_dbl(fptr, "LATPOLE", &latpole, NULL, &status); status = 0;
+	result->phiP = lonpole*PI/180.0;
+
+	if(theta0 == PI/2.0){
+		result->alphaP = alpha0;
+		result->deltaP = delta0;
+	}else{
+		/* 	sin(delta0) = sin(theta0) sin(deltaP) + cos(theta0) cos(deltaP) cos(phi0 - phiP)
+		 * 	= R cos(deltaP - psi): two solutions, the one in [-90,90]
+		 * 	closest to LATPOLE is taken */
+		psi = atan2(sin(theta0), cos(theta0)*cos(phi0 - result->phiP));
+		R   = sqrt(SQUARE(sin(theta0)) + SQUARE(cos(theta0)*cos(phi0 - result->phiP)));
+		if(R == 0.0 || fabs(sin(delta0)) > R + 1.0e-10){
+			fprintf(stderr,"%s: invalid WCS (CRVAL, LONPOLE) in the fits mask header. Exiting...\n",MYNAME);
+			exit(EXIT_FAILURE);
+		}
+		d     = acos(MIN(MAX(sin(delta0)/R, -1.0), 1.0));
+		dp[0] = psi + d;
+		dp[1] = psi - d;
+		for(k=0;k<2;k++){
+			if(dp[k] > PI) dp[k] -= TWOPI;
+			if(dp[k] < -PI) dp[k] += TWOPI;
+		}
+		if(fabs(dp[0]) > PI/2.0 + 1.0e-10) k = 1;
+		else if(fabs(dp[1]) > PI/2.0 + 1.0e-10) k = 0;
+		else k = (fabs(dp[0] - latpole*PI/180.0) <= fabs(dp[1] - latpole*PI/180.0)) ? 0 : 1;
+		result->deltaP = MIN(MAX(dp[k], -PI/2.0), PI/2.0);
+		result->alphaP = alpha0 - atan2(-cos(theta0)*sin(phi0 - result->phiP),
+			sin(theta0)*cos(result->deltaP) - cos(theta0)*sin(result->deltaP)*cos(phi0 - result->phiP));
+	}
+	result->cosDeltaP = cos(result->deltaP);
+	result->sinDeltaP = sin(result->deltaP);
+
+	fprintf(stderr,"WCS: %s %s, CRVAL = (%g,%g), CRPIX = (%g,%g)\n", ctype[0], ctype[1],
+		result->crval[0], result->crval[1], result->crpix[0], result->crpix[1]);
+
+	return result;
+}
+
+void worldToPixel(const Wcs *wcs, const double *lng, const double *lat, size_t N, const double min[2], const double max[2], double *x, double *y){
+	/* 	Pixel coordinates (x,y) (FITS convention, pixel centers at
+	 * 	integers starting at 1) of the N points (lng,lat) in degrees,
+	 * 	see readWcs(). Points outside the limits (min,max) in (lng,lat)
+	 * 	or with no projection (e.g. the other hemisphere for TAN and
+	 * 	SIN) are set to NaN. x and y may be lng and lat. The points are
+	 * 	split among threads.
+	 */
+
+	long k;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for(k=0;k<(long)N;k++){
+		double alpha, delta, cosDelta, sinDelta, cosDAlpha, phi, theta, R, X[2];
+
+		if(!(min[0] < lng[k] && lng[k] < max[0] && min[1] < lat[k] && lat[k] < max[1])){
+			x[k] = y[k] = NAN;
+			continue;
+		}
+
+		/* 	native spherical coordinates */
+		alpha     = lng[k]*PI/180.0 - wcs->alphaP;
+		delta     = lat[k]*PI/180.0;
+		cosDelta  = cos(delta);
+		sinDelta  = sin(delta);
+		cosDAlpha = cos(alpha);
+		phi       = wcs->phiP + atan2(-cosDelta*sin(alpha), sinDelta*wcs->cosDeltaP - cosDelta*wcs->sinDeltaP*cosDAlpha);
+		theta     = asin(MIN(MAX(sinDelta*wcs->sinDeltaP + cosDelta*wcs->cosDeltaP*cosDAlpha, -1.0), 1.0));
+
+		/* 	projection plane, in degrees */
+		switch (wcs->projection){
+			case WCSTAN: R = (theta > 0.0) ? cos(theta)/sin(theta) : NAN; break;
+			case WCSSIN: R = (theta >= 0.0) ? cos(theta) : NAN; break;
+			case WCSZEA: R = sqrt(2.0*(1.0 - sin(theta))); break;
+			case WCSARC: R = PI/2.0 - theta; break;
+			case WCSSTG: R = (theta > -PI/2.0) ? 2.0*cos(theta)/(1.0 + sin(theta)) : NAN; break;
+			default:     R = 0.0;
+		}
+		if(wcs->projection == WCSCAR){
+			phi  = remainder(phi, TWOPI);
+			X[wcs->lng]   = phi*180.0/PI;
+			X[1-wcs->lng] = theta*180.0/PI;
+		}else{
+			X[wcs->lng]   =  R*sin(phi)*180.0/PI;
+			X[1-wcs->lng] = -R*cos(phi)*180.0/PI;
+		}
+
+		/* 	pixel coordinates */
+		x[k] = wcs->crpix[0] + wcs->cdInverse[0][0]*X[0] + wcs->cdInverse[0][1]*X[1];
+		y[k] = wcs->crpix[1] + wcs->cdInverse[1][0]*X[0] + wcs->cdInverse[1][1]*X[1];
+	}
+
+	return;
+}
+
+void worldLimits(const Config *para, const Image *image, double xmin[2], double xmax[2], double wmin[2], double wmax[2]){
+	/* 	With a WCS, the user's limits (-xmin, etc.) are in RA DEC:
+	 * 	they are moved to (wmin,wmax) (no limit otherwise) and
+	 * 	(xmin,xmax) are set back to the image limits.
+	 */
+
+	int dim;
+
+	for(dim=0;dim<2;dim++){
+		wmin[dim] = para->minDefined[dim] ? para->min[dim] : -INF;
+		wmax[dim] = para->maxDefined[dim] ? para->max[dim] :  INF;
+		xmin[dim] = 0.5;
+		xmax[dim] = image->naxes[dim]+0.5;
+	}
+
+	if(para->minDefined[0] || para->maxDefined[0] || para->minDefined[1] || para->maxDefined[1]){
+		fprintf(stderr,"RA DEC limits:\n");
+		fprintf(stderr,"-xmin %g -xmax %g -ymin %g -ymax %g\n",wmin[0],wmax[0],wmin[1],wmax[1]);
+	}
+
+	return;
+}
+
+uint16_t bigEndian16(const unsigned char *raw){
+	return ((uint16_t)raw[0] << 8) | raw[1];
+}
+uint32_t bigEndian32(const unsigned char *raw){
+	return ((uint32_t)raw[0] << 24) | ((uint32_t)raw[1] << 16) | ((uint32_t)raw[2] << 8) | raw[3];
+}
+uint64_t bigEndian64(const unsigned char *raw){
+	return ((uint64_t)bigEndian32(raw) << 32) | bigEndian32(raw+4);
+}
+float floatBigEndian(const unsigned char *raw){
+	uint32_t u = bigEndian32(raw);
+	float result;
+	memcpy(&result, &u, sizeof(float));
+	return result;
+}
+double doubleBigEndian(const unsigned char *raw){
+	uint64_t u = bigEndian64(raw);
+	double result;
+	memcpy(&result, &u, sizeof(double));
+	return result;
+}
+
+void decodePixelFits(const unsigned char *raw, int bitpix, void *pixel){
+	/* 	Converts a pixel stored in a fits file (big-endian, bitpix
+	 * 	format) into the type used for the image in memory (see
+	 * 	openImage()), whatever the byte order of the machine.
+	 */
+
+	switch (bitpix){
+		case BYTE_IMG:
+			*(char *)pixel = (char)raw[0];
+			break;
+		case SHORT_IMG:
+			*(short *)pixel = (short)bigEndian16(raw);
+			break;
+		case LONG_IMG:
+			*(long *)pixel = (long)(int32_t)bigEndian32(raw);
+			break;
+		case FLOAT_IMG:
+			*(float *)pixel = floatBigEndian(raw);
+			break;
+		case DOUBLE_IMG:
+			*(double *)pixel = doubleBigEndian(raw);
+			break;
+	}
+
+	return;
 }
 
 
@@ -121,77 +1030,163 @@ double toDoubleDOUBLE(void *table, long i){
 
 
 void readColFits(fitsfile *fileIn, int id_num, long N, double *x){
-	/* 	Read one column in fits file. */
+	/* 	Read one column in fits file (see readColsFits()). */
 
+	readColsFits(fileIn, 1, &id_num, 1, N, &x);
 
-		int status = 0, datatype, anynul; /* MUST initialize status */
-		long n, repeat, width;
+	return;
+}
 
-		char tmp_string[1000];
-		short tmp_short;
-		int tmp_int;
-		long tmp_long;
-		float tmp_float;
-		double tmp_double;
+void readColsFits(fitsfile *fileIn, int Ncols, const int *id_num, long firstrow, long N, double **x){
+	/* 	Read N rows from firstrow (starts at 1) of Ncols columns in fits
+	 * 	file, column id_num[k] into x[k].
+	 * 	Rows are read by blocks of the optimal number of rows given by
+	 * 	fits_get_rowsize() (the rows that fit in the CFITSIO buffers),
+	 * 	all columns for each block, so that the file is read only once.
+	 * 	Numerical columns are converted by CFITSIO straight into the
+	 * 	double arrays, string columns are read into a block of strings
+	 * 	and converted with atof(). For vector columns (repeat > 1), the
+	 * 	whole rows are read into a buffer and only the first element of
+	 * 	each row is kept.
+	 */
 
-      /* 	get colum format */
-		fits_get_coltype(fileIn, id_num, &datatype, &repeat, &width, &status);
+	int k, status = 0, anynul, *datatype; /* MUST initialize status */
+	long n, first, Nrows, *repeat, width, Nchar = 0, Nrepeat = 1;
+	char **strings = NULL, *stringBuffer = NULL;
+	double *vector = NULL;
 
-		/* 	loop over rows depending on column format*/
-		switch(datatype){
+	datatype = (int *)malloc(Ncols*sizeof(int));
+	repeat   = (long *)malloc(Ncols*sizeof(long));
 
+	/* 	get column formats */
+	for(k=0;k<Ncols;k++){
+		fits_get_coltype(fileIn, id_num[k], &datatype[k], &repeat[k], &width, &status);
+		switch(datatype[k]){
 			case TSTRING :
-				for(n=0;n<N;n++){
-					fits_read_col(fileIn, datatype, id_num, n+1, 1, 1, NULL, &tmp_string, &anynul, &status);
-					x[n] = atof(tmp_string);
-				}
+				if(repeat[k] > Nchar) Nchar = repeat[k];
 				break;
-
+			case TBYTE :
 			case TSHORT :
-				for(n=0;n<N;n++){
-					fits_read_col(fileIn, datatype, id_num, n+1, 1, 1, NULL, &tmp_short, &anynul, &status);
-					x[n] = (double) tmp_short;
-				}
-				break;
-
 			case TINT :
-				for(n=0;n<N;n++){
-					fits_read_col(fileIn, datatype, id_num, n+1, 1, 1, NULL, &tmp_int, &anynul, &status);
-					x[n] = (double) tmp_int;
-				}
-				break;
-
 			case TLONG :
-				for(n=0;n<N;n++){
-					fits_read_col(fileIn, datatype, id_num, n+1, 1, 1, NULL, &tmp_long, &anynul, &status);
-					x[n] = (double) tmp_long;
-				}
-				break;
-
+			case TLONGLONG :
 			case TFLOAT :
-				for(n=0;n<N;n++){
-					fits_read_col(fileIn, datatype, id_num, n+1, 1, 1, NULL, &tmp_float, &anynul, &status);
-					x[n] = (double) tmp_float;
-				}
-				break;
-
 			case TDOUBLE :
-				for(n=0;n<N;n++){
-					fits_read_col(fileIn, datatype, id_num, n+1, 1, 1, NULL, &tmp_double, &anynul, &status);
-					x[n] = tmp_double;
-				}
+				if(repeat[k] > Nrepeat) Nrepeat = repeat[k];
 				break;
 			default :
+				fprintf(stderr,"\n%s: **ERROR** format \"%d\" (see CFITSIO doc) not recognized in input file. Exiting...\n", MYNAME, datatype[k]);
+				exit(EXIT_FAILURE);
+				break;
+		}
+	}
 
-	         fprintf(stderr,"\n%s: **ERROR** format \"%d\" (see CFITSIO doc) not recognized in input file. Exiting...\n", MYNAME, datatype);
+	/* 	block size */
+	fits_get_rowsize(fileIn, &Nrows, &status);
+	if(Nrows < FITSBLOCKMIN) Nrows = FITSBLOCKMIN;
+	if(Nrows > N) Nrows = N > 0 ? N : 1;
 
-	         exit(EXIT_FAILURE);
-				break;
+	if(Nchar > 0){
+		strings      = (char **)malloc(Nrows*sizeof(char *));
+		stringBuffer = (char *)malloc(Nrows*(Nchar+1)*sizeof(char));
+		for(n=0;n<Nrows;n++) strings[n] = stringBuffer + n*(Nchar+1);
+	}
+	if(Nrepeat > 1){
+		vector = (double *)malloc(Nrows*Nrepeat*sizeof(double));
+		if(vector == NULL){
+			fprintf(stderr,"%s: not enough memory to read vector columns of %ld elements. Exiting...\n",MYNAME,Nrepeat);
+			exit(EXIT_FAILURE);
+		}
+	}
 
+	/* 	loop over blocks of rows */
+	for(first=0;first<N && !status;first+=Nrows){
+		if(first+Nrows > N) Nrows = N - first;
+		for(k=0;k<Ncols;k++){
+			if(datatype[k] == TSTRING){
+				fits_read_col(fileIn, TSTRING, id_num[k], firstrow+first, 1, Nrows, NULL, strings, &anynul, &status);
+				for(n=0;n<Nrows;n++) x[k][first+n] = atof(strings[n]);
+			}else if(repeat[k] > 1){
+				/* 	rows of repeat[k] elements, the first one is kept */
+				fits_read_col(fileIn, TDOUBLE, id_num[k], firstrow+first, 1, Nrows*repeat[k], NULL, vector, &anynul, &status);
+				for(n=0;n<Nrows;n++) x[k][first+n] = vector[n*repeat[k]];
+			}else{
+				fits_read_col(fileIn, TDOUBLE, id_num[k], firstrow+first, 1, Nrows, NULL, x[k]+first, &anynul, &status);
+			}
+		}
+	}
+
+	if (status) fits_report_error(stderr, status);
+
+	free(strings);
+	free(stringBuffer);
+	free(vector);
+	free(repeat);
+	free(datatype);
+
+	return;
+}
 
+void copyRowsFits(fitsfile *fileIn, fitsfile *fileOut, long firstrow, long N, const char *keep, long *count, int *status){
+	/* 	Appends to the table of fileOut the rows firstrow+i (starts at 1)
+	 * 	of the current table of fileIn, for i < N and keep[i] non-zero.
+	 * 	*count is the number of rows of fileOut, updated. The rows of
+	 * 	fileOut may be longer than the ones of fileIn (extra columns at
+	 * 	the end, left to 0). Rows are read by blocks (see readColsFits())
+	 * 	and the table must not have variable-length columns (its heap is
+	 * 	not copied).
+	 */
+
+	long k, m, first, Nrows, naxis1In, naxis1Out;
+	unsigned char *bufferIn, *bufferOut;
+
+	fits_read_key_lng(fileIn, "NAXIS1", &naxis1In, NULL, status);
+	fits_read_key_lng(fileOut, "NAXIS1", &naxis1Out, NULL, status);
+	fits_get_rowsize(fileIn, &Nrows, status);
+	if (*status) return;
+
+	if(Nrows < FITSBLOCKMIN) Nrows = FITSBLOCKMIN;
+	if(Nrows > N) Nrows = N > 0 ? N : 1;
+
+	bufferIn  = (unsigned char *)malloc(Nrows*naxis1In*sizeof(unsigned char));
+	bufferOut = (unsigned char *)calloc(Nrows*naxis1Out, sizeof(unsigned char));
+	if(bufferIn == NULL || bufferOut == NULL){
+		fprintf(stderr,"%s: not enough memory to copy %ld rows of %ld bytes. Exiting...\n",MYNAME,Nrows,naxis1Out);
+		exit(EXIT_FAILURE);
+	}
+
+	for(first=0;first<N && !*status;first+=Nrows){
+		if(first+Nrows > N) Nrows = N - first;
+		fits_read_tblbytes(fileIn, firstrow+first, 1, Nrows*naxis1In, bufferIn, status);
+		for(k=0,m=0;k<Nrows;k++){
+			if(keep[first+k]){
+				memcpy(bufferOut+m*naxis1Out, bufferIn+k*naxis1In, naxis1In);
+				m++;
+			}
 		}
+		if(m > 0) fits_write_tblbytes(fileOut, *count+1, 1, m*naxis1Out, bufferOut, status);
+		*count += m;
+	}
+
+	free(bufferIn);
+	free(bufferOut);
+
+	return;
+}
+
+void writeColsFits(fitsfile *fileOut, int Ncols, const int *datatype, void **x, long firstrow, long N, int *status){
+	/* 	Writes N rows from firstrow (starts at 1) of the first Ncols
+	 * 	columns of fileOut, column k+1 from x[k] (of type datatype[k]),
+	 * 	with one call per column. Used to flush blocks of rows of
+	 * 	fits_get_rowsize() rows built in memory.
+	 */
+
+	int k;
 
-		if (status) fits_report_error(stderr, status);
+	if(N <= 0) return;
+	for(k=0;k<Ncols && !*status;k++){
+		fits_write_col(fileOut, datatype[k], k+1, firstrow, 1, N, x[k], status);
+	}
 
 	return;
 }
@@ -28,11 +28,18 @@ int readParameters(int argc, char **argv, Config *para){
 	para->format    = 1;
 	para->coordType = CART;
 	para->seed      = 20091982;
+	para->rng       = RNG_GSL;
+	para->sampler   = SAMPLER_PSEUDO;
 	para->constDen  = 0;
 	para->nz        = 0;
 	para->zrange    = 0;
 	para->catFileType = FITS;
 	para->oFileType = FITS;
+	para->leafSize  = LEAFSIZE;
+	para->nthreads  = 1;
+	para->blockRows = NBLOCK;
+	para->precision = PRECISION;
+	para->exactNpart = 0;
 
 
 	/* 	default cosmology <=> WMAP5 */
@@ -55,6 +62,8 @@ int readParameters(int argc, char **argv, Config *para){
 	strcpy(para->fileCatInName,"\0");
 	strcpy(para->fileRegInName,"\0");
 	strcpy(para->fileNofZName,"\0");
+	strcpy(para->fileIndexInName,"\0");
+	strcpy(para->fileIndexOutName,"\0");
 	strcpy(para->flagName,"flag");
 
 
@@ -63,13 +72,15 @@ int readParameters(int argc, char **argv, Config *para){
 		/*		help */
 		if(!strcmp(argv[i],"-h") || !strcmp(argv[i],"--help") || argc == 1){
 			fprintf(stderr,"\n\n                   V E N I C E\n\n");
-			fprintf(stderr,"           mask utility program version 4.0.4 \n\n");
+			fprintf(stderr,"           mask utility program version 4.1.0 \n\n");
 			fprintf(stderr,"Usage: %s -m mask.[reg,fits]               [OPTIONS] -> binary mask for visualization\n",argv[0]);
 			fprintf(stderr,"    or %s -m mask.[reg,fits] -cat file.cat [OPTIONS] -> objects in/out of mask\n",argv[0]);
 			fprintf(stderr,"    or %s -m mask.[reg,fits] -cat -        [OPTIONS] -> objects in/out of mask (from stdin)\n",argv[0]);
-			fprintf(stderr,"    or %s -m mask.[reg,fits] -r            [OPTIONS] -> random catalogue\n\n",argv[0]);
+			fprintf(stderr,"    or %s -m mask.[reg,fits] -r            [OPTIONS] -> random catalogue\n",argv[0]);
+			fprintf(stderr,"    or %s -m mask.reg -area                [OPTIONS] -> exact area inside/outside the mask\n\n",argv[0]);
 			fprintf(stderr,"Options:\n");
 			fprintf(stderr,"    -r                       create random catalogue\n");
+			fprintf(stderr,"    -area                    exact area of the limits, inside and outside the mask\n");
 			fprintf(stderr,"    -cat FILE                input catalogue file name, default:stdin\n");
 			fprintf(stderr,"    -o FILE                  output file name, default:stdout\n");
 			fprintf(stderr,"    -catfmt [ascii,fits]     input catalogue format, default:fits if stdin\n");
@@ -83,9 +94,18 @@ int readParameters(int argc, char **argv, Config *para){
 			fprintf(stderr,"    -nz file_nz.in           redshift distribution for random objects\n");
 			fprintf(stderr,"    -z redshiftmin,redshiftmax             redshift range for random objects (if volume limited)\n");
 			fprintf(stderr,"    -seed  N                 random seed\n");
+			fprintf(stderr,"    -rng [gsl,philox]        random generator. philox: same points for any -nthreads, default:gsl\n");
+			fprintf(stderr,"    -sampler [pseudo,sobol,halton] random sequence, sobol/halton: scrambled quasi-random, default:pseudo\n");
 			fprintf(stderr,"    -npart N                 number of random objects\n");
 			fprintf(stderr,"    -cd                      multiply npart by the mask area (for constant density)\n");
+			fprintf(stderr,"    -exactNpart              npart is the number of objects written (-f outside/inside)\n");
 			fprintf(stderr,"    -flagName NAME           name of the flag colum for fits files. default: flag\n");
+			fprintf(stderr,"    -leafSize N              max number of polygons per tree leaf, default:%d\n",LEAFSIZE);
+			fprintf(stderr,"    -nthreads N              number of threads (0: all cores), default:1\n");
+			fprintf(stderr,"    -blockRows N             catalogue rows read at once, default:%d\n",NBLOCK);
+			fprintf(stderr,"    -precision N             decimals of coordinates in ascii outputs, default:%d\n",PRECISION);
+			fprintf(stderr,"    -saveIndex FILE          write the .reg mask index into FILE\n");
+			fprintf(stderr,"    -loadIndex FILE          read the mask from the index FILE (no need for -m)\n");
 			fprintf(stderr,"    -h, --help               this message\n\n");
 			fprintf(stderr,"For .reg files, the region must be \"polygon\", \"circle\", \"ellipse\" or \"box\".\n");
 			fprintf(stderr,"Notice: 0 means inside the mask, 1 outside; for .fits files,\n");
@@ -114,10 +134,18 @@ int readParameters(int argc, char **argv, Config *para){
 		if(!strcmp(argv[i],"-r")){
 			task = 3;
 		}
+		/*		exact mask area */
+		if(!strcmp(argv[i],"-area")){
+			task = 4;
+		}
 		/*		constant density */
 		if(!strcmp(argv[i],"-cd")){
 			para->constDen = 1;
 		}
+		/*		draw exactly npart accepted objects */
+		if(!strcmp(argv[i],"-exactNpart")){
+			para->exactNpart = 1;
+		}
 		/*		output file */
 		if(!strcmp(argv[i],"-o")){
 			if(argv[i+1] == NULL){
@@ -272,6 +300,38 @@ int readParameters(int argc, char **argv, Config *para){
 			}
 			if(atoi(argv[i+1]) > 0) para->seed = atoi(argv[i+1]);
 		}
+		/*		random generator */
+		if(!strcmp(argv[i],"-rng")){
+			if(argv[i+1] == NULL){
+				fprintf(stderr,"Missing argument after %s\nExiting...\n",argv[i]);
+				exit(-1);
+			}
+			if(!strcmp(argv[i+1],"gsl")){
+				para->rng = RNG_GSL;
+			}else if(!strcmp(argv[i+1],"philox")){
+				para->rng = RNG_PHILOX;
+			}else{
+				fprintf(stderr,"%s: -rng must be gsl or philox. Exiting...\n",MYNAME);
+				exit(EXIT_FAILURE);
+			}
+		}
+		/*		random sequence */
+		if(!strcmp(argv[i],"-sampler")){
+			if(argv[i+1] == NULL){
+				fprintf(stderr,"Missing argument after %s\nExiting...\n",argv[i]);
+				exit(-1);
+			}
+			if(!strcmp(argv[i+1],"pseudo")){
+				para->sampler = SAMPLER_PSEUDO;
+			}else if(!strcmp(argv[i+1],"sobol")){
+				para->sampler = SAMPLER_SOBOL;
+			}else if(!strcmp(argv[i+1],"halton")){
+				para->sampler = SAMPLER_HALTON;
+			}else{
+				fprintf(stderr,"%s: -sampler must be pseudo, sobol or halton. Exiting...\n",MYNAME);
+				exit(EXIT_FAILURE);
+			}
+		}
 
 		/* 	input file type */
 		if(!strcmp(argv[i],"-catfmt")) {
@@ -299,6 +359,65 @@ int readParameters(int argc, char **argv, Config *para){
 			}
 			strcpy(para->flagName,argv[i+1]);
 		}
+		/*		max number of polygons per leaf of the region mask tree */
+		if(!strcmp(argv[i],"-leafSize")){
+			if(argv[i+1] == NULL){
+				fprintf(stderr,"Missing argument after %s\nExiting...\n",argv[i]);
+				exit(-1);
+			}
+			if(atoi(argv[i+1]) > 0) para->leafSize = atoi(argv[i+1]);
+		}
+		/*		catalogue rows read at once (bounds the memory) */
+		if(!strcmp(argv[i],"-blockRows")){
+			if(argv[i+1] == NULL){
+				fprintf(stderr,"Missing argument after %s\nExiting...\n",argv[i]);
+				exit(-1);
+			}
+			if(atol(argv[i+1]) > 0) para->blockRows = atol(argv[i+1]);
+		}
+		/*		decimals of coordinates in ascii outputs */
+		if(!strcmp(argv[i],"-precision")){
+			if(argv[i+1] == NULL){
+				fprintf(stderr,"Missing argument after %s\nExiting...\n",argv[i]);
+				exit(-1);
+			}
+			para->precision = atoi(argv[i+1]);
+			if(para->precision < 0 || para->precision > PRECISIONMAX){
+				fprintf(stderr,"%s: -precision must be between 0 and %d. Exiting...\n",MYNAME,PRECISIONMAX);
+				exit(EXIT_FAILURE);
+			}
+		}
+		/*		mask index file out */
+		if(!strcmp(argv[i],"-saveIndex")){
+			if(argv[i+1] == NULL){
+				fprintf(stderr,"Missing argument after %s\nExiting...\n",argv[i]);
+				exit(-1);
+			}
+			strcpy(para->fileIndexOutName,argv[i+1]);
+		}
+		/*		mask index file in */
+		if(!strcmp(argv[i],"-loadIndex")){
+			if(argv[i+1] == NULL){
+				fprintf(stderr,"Missing argument after %s\nExiting...\n",argv[i]);
+				exit(-1);
+			}
+			strcpy(para->fileIndexInName,argv[i+1]);
+			nomask = 0;
+		}
+		/*		number of threads */
+		if(!strcmp(argv[i],"-nthreads")){
+			if(argv[i+1] == NULL){
+				fprintf(stderr,"Missing argument after %s\nExiting...\n",argv[i]);
+				exit(-1);
+			}
+			para->nthreads = atoi(argv[i+1]);
+#ifdef _OPENMP
+			if(para->nthreads < 1) para->nthreads = omp_get_num_procs();
+#else
+			if(para->nthreads != 1) fprintf(stderr,"%s: compiled without OpenMP, -nthreads is ignored\n",MYNAME);
+			para->nthreads = 1;
+#endif
+		}
 
 
 
@@ -330,6 +449,20 @@ int readParameters(int argc, char **argv, Config *para){
 	}
 
 
+	/* 	the mask index is only for .reg masks */
+	if((strcmp(para->fileIndexInName,"") || strcmp(para->fileIndexOutName,"")) && strcmp(para->fileRegInName,"") && !checkFileExt(para->fileRegInName,".reg")){
+		fprintf(stderr,"%s: -saveIndex and -loadIndex only work with .reg masks. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+	if(para->exactNpart && para->format == 3){
+		fprintf(stderr,"%s: -exactNpart only works with -f outside or -f inside. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+	if(strcmp(para->fileIndexOutName,"") && !strcmp(para->fileRegInName,"")){
+		fprintf(stderr,"%s: please provide the .reg mask to index with -m. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+
 	/*		if input file ends with .ascii or .cat set ascii format */
    if(checkFileExt(para->fileCatInName,".ascii") || checkFileExt(para->fileCatInName,".cat")){
 		para->catFileType = ASCII;
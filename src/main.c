@@ -12,10 +12,11 @@
  *    venice -m mask.reg -cat file.cat [OPTIONS]
  *    3. Generates a random catalogue of objects inside/outside a mask.
  *    venice -m mask.reg -r [OPTIONS]
+ *    4. Computes the exact area inside/outside a mask.
+ *    venice -m mask.reg -area [OPTIONS]
  *
  *    TODO:
  *    - adapt to be used with python
- *    - use RA DEC as input even with fits masks (use wcs functions)
  *    - allow different input and output files
  */
 
@@ -35,7 +36,11 @@ int main(int argc, char **argv)
    Config para;
 
    /*    tasks */
-   switch (readParameters(argc,argv,&para)){
+   int task = readParameters(argc,argv,&para);
+#ifdef _OPENMP
+   omp_set_num_threads(para.nthreads);
+#endif
+   switch (task){
       case 1:
          mask2d(&para);     /* binary mask for visualization */
          break;
@@ -49,6 +54,9 @@ int main(int argc, char **argv)
       case 3:
          randomCat(&para);  /* random catalogue */
          break;
+      case 4:
+         areaMask(&para);   /* exact mask area */
+         break;
    }
    return EXIT_SUCCESS;
 }
@@ -64,9 +72,9 @@ int  mask2d(const Config *para){
     *     For fits format, it writes the pixel value.
     */
 
-   int Npolys,poly_id,flag;
+   int poly_id;
    size_t i, j, count, total;
-   double x[2], x0[2], xmin[2], xmax[2];
+   double x[2], xmin[2], xmax[2];
 
    FILE *fileOut = fopenAndCheck(para->fileOutName,"w");
 
@@ -74,17 +82,20 @@ int  mask2d(const Config *para){
    total = para->nx*para->ny;
 
    if(checkFileExt(para->fileRegInName,".fits")){           /*     fits file */
-      long fpixel[2], naxes[2];
-      int bitpix, status = 0;
-      double (*toDouble)(void *,long ) = NULL;
+      int status = 0;
 
-      /*   read fits file and put in table */
-      void *table = readFits(para,&bitpix,NULL,NULL,&status,naxes,&toDouble,NULL);
+      if(para->coordType != CART){
+         fprintf(stderr,"%s: fits file detected. coord should be set to cart for image coordinates. Exiting...\n",MYNAME);
+         exit(EXIT_FAILURE);
+      }
+
+      /*   open fits file, pixels are read where they are needed */
+      Image *image = openImage(para,&status);
 
       /* define limits */
       xmin[0] = xmin[1] = 1.0;
-      xmax[0] = naxes[0];
-      xmax[1] = naxes[1];
+      xmax[0] = image->naxes[0];
+      xmax[1] = image->naxes[1];
       if(para->minDefined[0]) xmin[0] = para->min[0];
       if(para->maxDefined[0]) xmax[0] = para->max[0];
       if(para->minDefined[1]) xmin[1] = para->min[1];
@@ -95,30 +106,37 @@ int  mask2d(const Config *para){
 
       gsl_histogram2d_set_ranges_uniform(mask,xmin[0],xmax[0],xmin[1],xmax[1]);
 
-      /*    ATTENTION "toDouble" converts everything into double */
+      /*    with more mask pixels than image pixels, uniform tiles
+       *    are read once (see summaryImage()) */
+      if((double)total >= (xmax[0] - xmin[0] + 1.0)*(xmax[1] - xmin[1] + 1.0)){
+         double limits[2][2] = {{xmin[0] - 0.5, xmin[1] - 0.5}, {xmax[0] + 0.5, xmax[1] + 0.5}};
+         summaryImage(image, limits[0], limits[1]);
+      }
+
+      /*    ATTENTION "valuesImage" converts everything into double.
+       *    Pixels are gathered by columns of the mask (see valuesImage()) */
+      double all[2][2] = {{-INF, -INF}, {INF, INF}};
+      double *xx = (double *)malloc(mask->ny*sizeof(double));
+      double *yy = (double *)malloc(mask->ny*sizeof(double));
       fprintf(stderr,"\nProgress =     ");
       for(i=0; i<mask->nx; i++){
+         count = i*para->ny;
+         printCount(&count,&total,para->ny);
          for(j=0; j<mask->ny; j++){
-            count = i*para->ny+j;
-            printCount(&count,&total,1000);
-            x[0] = (mask->xrange[i]+mask->xrange[i+1])/2.0;  /* center of the pixel */
-            x[1] = (mask->yrange[j]+mask->yrange[j+1])/2.0;
-            fpixel[0] = roundToNi(x[0]) - 1;
-            fpixel[1] = roundToNi(x[1]) - 1;
-            mask->bin[i*mask->ny+j] = toDouble(table,fpixel[1]*naxes[0]+fpixel[0]);
+            xx[j] = (mask->xrange[i]+mask->xrange[i+1])/2.0;  /* center of the pixel */
+            yy[j] = (mask->yrange[j]+mask->yrange[j+1])/2.0;
          }
+         valuesImage(image, xx, yy, mask->ny, all[0], all[1], 0.0, mask->bin+i*mask->ny);
       }
       fprintf(stderr,"\b\b\b\b100%%\n");
 
-      free(table);
+      free(xx);
+      free(yy);
+      closeImage(image);
 
-   }else if(checkFileExt(para->fileRegInName,".reg")){          /* ds9 file */
+   }else if(checkFileExt(para->fileRegInName,".reg") || strcmp(para->fileIndexInName,"")){          /* ds9 file */
 
-      FILE *fileRegIn = fopenAndCheck(para->fileRegInName,"r");
-      Node *polyTree  = readPolygonFileTree(fileRegIn,xmin,xmax);
-      Polygon *polys  = (Polygon *)polyTree->polysAll;
-      Npolys          = polyTree->Npolys;
-      fclose(fileRegIn);
+      Tree *polyTree  = readMaskTree(para,xmin,xmax);
 
       /*    define limits */
       if(para->minDefined[0]) xmin[0] = para->min[0];
@@ -129,22 +147,22 @@ int  mask2d(const Config *para){
       fprintf(stderr,"limits:\n");
       fprintf(stderr,"-xmin %g -xmax %g -ymin %g -ymax %g\n",xmin[0],xmax[0],xmin[1],xmax[1]);
 
-      /*    reference point. It must be outside the mask */
-      x0[0] = xmin[0] - 1.0; x0[1] = xmin[1] - 1.0;
-
       gsl_histogram2d_set_ranges_uniform(mask,xmin[0],xmax[0],xmin[1],xmax[1]);
 
       total = para->nx*para->ny;
 
       fprintf(stderr,"Progress =     ");
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) private(j,count,x,poly_id)
+#endif
       for(i=0; i<mask->nx; i++){
          for(j=0; j<mask->ny; j++){
             count = i*para->ny+j;
-            printCount(&count,&total,1000);
+            if(isMainThread()) printCount(&count,&total,1000);
             x[0] = (mask->xrange[i]+mask->xrange[i+1])/2.0; /* center of the pixel */
             x[1] = (mask->yrange[j]+mask->yrange[j+1])/2.0;
             /* 1 = outside the mask, 0 = inside the mask */
-            if(!insidePolygonTree(polyTree,x0,x,&poly_id)) mask->bin[i*mask->ny+j] = 1.0;
+            if(!insidePolygonTree(polyTree,x,&poly_id)) mask->bin[i*mask->ny+j] = 1.0;
          }
       }
       fflush(stdout);
@@ -155,12 +173,15 @@ int  mask2d(const Config *para){
    }
 
    /*    write the output file */
+   Writer *writer = openWriter(fileOut, IOBUFFERSIZE);
    for(j=0; j<mask->ny; j++){
       for(i=0; i<mask->nx; i++){
-         fprintf(fileOut,"%g ",mask->bin[i*mask->ny+j]);
+         writeGeneral(writer,mask->bin[i*mask->ny+j]);
+         writeBytes(writer," ",1);
       }
-      fprintf(fileOut,"\n");
+      writeBytes(writer,"\n",1);
    }
+   free_Writer(writer);
    fclose(fileOut);
 
    return EXIT_SUCCESS;
@@ -174,16 +195,21 @@ int flagCatFits(const Config *para){
     *    the mask and 0 is inside the mask. xcol and ycol are the column ids
     *    of resp. x coordinate and y coordinate.
     *    For mask fits format, it writes the pixel value.
+    *
+    *    The catalogue is processed by blocks of para->blockRows rows: the
+    *    rows of a block are read, flagged and appended to the output table,
+    *    so that memory does not depend on the catalogue size (see copyRowsFits()).
+    *    Tables with variable-length columns (PCOUNT > 0) are copied
+    *    entirely first, flagged, and the unwanted rows deleted.
     */
 
 
-   int Npolys, poly_id, flag, verbose = 1, size, firstelem=1, firstrow=1;
-   double x[2], x0[2], xmin[2], xmax[2];
-   size_t i, Ncol;
-   long N;
+   int flag, firstelem=1;
+   double xmin[2], xmax[2];
+   long i, N, first, Nrows, count = 0;
 
 	fitsfile *fileCatIn;
-	int status = 0, datatype, id_num[2];
+	int status = 0;
 
 	fits_open_table(&fileCatIn, para->fileCatInName, READONLY, &status);
 	if (status) {
@@ -214,167 +240,174 @@ int flagCatFits(const Config *para){
          }
 	}
 
-   fitsfile *fileOutFits;     /* pointer to the FITS file, defined in fitsio.h */
-
-   fits_create_file(&fileOutFits, para->fileOutName, &status);
-	if (status){
-      fits_report_error(stderr, status);
-      if (status){
-         fprintf(stderr, "Add \"!\" in front of the file name to overwrite: -o \"!FILEOUT\"\n");
-      }
-      exit(EXIT_FAILURE);
-   }
-   fits_copy_file(fileCatIn, fileOutFits, 1, 1, 1, &status);
-	if (status){
-      fits_report_error(stderr, status);
-      exit(EXIT_FAILURE);
-   }
    int ncols;
-
-   fits_get_num_cols(fileOutFits, &ncols, &status);
+   fits_get_num_cols(fileCatIn, &ncols, &status);
 	if (status){
       fits_report_error(stderr, status);
       exit(EXIT_FAILURE);
    }
 
-   if(checkFileExt(para->fileRegInName,".fits")){
-      if(para->coordType != CART){
-         fprintf(stderr,"%s: fits file detected. coord should be set to cart for image coordinates. Exiting...\n",MYNAME);
-         exit(EXIT_FAILURE);
-      }
+   /*    mask: fits image or region tree */
+   char tform[3] = "1I";
+   double null = -99.0;
+   Image *image   = NULL;
+   Tree *polyTree = NULL;
+   int flagOnly   = (para->format == 1 || para->format == 2);
 
-      long fpixel[2], naxes[2];
-      int bitpix, typecode;
-      char tform_char;
-      double null = -99.0;
-      double (*toDouble)(void *,long ) = NULL;
+   if(checkFileExt(para->fileRegInName,".fits")){
 
-      /*    read fits file and put in table */
-      void *table = readFits(para,&bitpix,&typecode,&tform_char,&status,naxes,&toDouble,&size);
+      /*    open fits file, pixels are read where they are needed */
+      image   = openImage(para,&status);
+      tform[1] = image->tform;
 
       /*    define limits */
       xmin[0] = xmin[1] = 0.5;
-      xmax[0] = naxes[0]+0.5;
-      xmax[1] = naxes[1]+0.5;
-      if(para->minDefined[0]) xmin[0] = para->min[0];
-      if(para->maxDefined[0]) xmax[0] = para->max[0];
-      if(para->minDefined[1]) xmin[1] = para->min[1];
-      if(para->maxDefined[1]) xmax[1] = para->max[1];
-      /*    print out limits */
-      fprintf(stderr,"Mask limits:\n");
-      fprintf(stderr,"-xmin %g -xmax %g -ymin %g -ymax %g\n",xmin[0],xmax[0],xmin[1],xmax[1]);
-
-      fits_insert_col(fileOutFits, ncols+1, para->flagName,  concat("1", &tform_char), &status);
-	   if (status){
-         fits_report_error(stderr, status);
-         exit(EXIT_FAILURE);
-      }
-
-      double *xx = (double *)malloc(N*sizeof(double));
-      double *yy = (double *)malloc(N*sizeof(double));
-
-      readColFits(fileCatIn, xcol, N, xx);
-      readColFits(fileCatIn, ycol, N, yy);
-
-      size_t N_size_t = (size_t)N;
+      xmax[0] = image->naxes[0]+0.5;
+      xmax[1] = image->naxes[1]+0.5;
 
-      if(verbose) fprintf(stderr,"Progress =     ");
-      for (i=0; i<N;i++){
-         if(verbose) printCount(&i,&N_size_t,1000);
-
-         fpixel[0] = roundToNi(xx[i]) - 1;
-         fpixel[1] = roundToNi(yy[i]) - 1;
-
-         if(xmin[0] < xx[i] && xx[i] < xmax[0] && xmin[1] < yy[i] && yy[i] < xmax[1]){
-            fits_write_col(fileOutFits, typecode, ncols+1, firstrow+i, firstelem, 1, table + (fpixel[1]*naxes[0]+fpixel[0])*size, &status);
-         }else{
-            fits_write_col(fileOutFits, typecode, ncols+1, firstrow+i, firstelem, 1, &null, &status);
-         }
+      /*    all objects are written with the pixel value */
+      flagOnly = 0;
 
-      }
-      fprintf(stderr,"\b\b\b\b100%%\n");
-      free(xx);
-      free(yy);
+   }else if(checkFileExt(para->fileRegInName,".reg") || strcmp(para->fileIndexInName,"")){
+      polyTree  = readMaskTree(para,xmin,xmax);
+   }else{
+      fprintf(stderr,"%s: mask file format not recognized. Please provide .reg, .fits or no mask but input limits. Exiting...\n",MYNAME);
+      exit(EXIT_FAILURE);
+   }
 
-   }else if(checkFileExt(para->fileRegInName,".reg")){
-      FILE *fileRegIn = fopenAndCheck(para->fileRegInName,"r");
-      Node *polyTree  = readPolygonFileTree(fileRegIn,xmin,xmax);
-      Polygon *polys = (Polygon *)polyTree->polysAll;
-      Npolys          = polyTree->Npolys;
-      fclose(fileRegIn);
+   /*    or if the limits are defined by the user */
+   if(para->minDefined[0]) xmin[0] = para->min[0];
+   if(para->maxDefined[0]) xmax[0] = para->max[0];
+   if(para->minDefined[1]) xmin[1] = para->min[1];
+   if(para->maxDefined[1]) xmax[1] = para->max[1];
 
-      /*    or if the limits are defined by the user */
-      if(para->minDefined[0]) xmin[0] = para->min[0];
-      if(para->maxDefined[0]) xmax[0] = para->max[0];
-      if(para->minDefined[1]) xmin[1] = para->min[1];
-      if(para->maxDefined[1]) xmax[1] = para->max[1];
+   /*    with a WCS, the limits are in RA DEC and objects
+    *    are projected onto the image (see worldToPixel()) */
+   double wmin[2], wmax[2];
+   if(image != NULL && image->wcs != NULL) worldLimits(para, image, xmin, xmax, wmin, wmax);
 
-      /* print out limits */
-      fprintf(stderr,"Mask limits:\n");
-      fprintf(stderr,"-xmin %g -xmax %g -ymin %g -ymax %g\n",xmin[0],xmax[0],xmin[1],xmax[1]);
+   /* print out limits */
+   fprintf(stderr,"Mask limits:\n");
+   fprintf(stderr,"-xmin %g -xmax %g -ymin %g -ymax %g\n",xmin[0],xmax[0],xmin[1],xmax[1]);
 
-      /*    reference point. It must be outside the mask */
-      x0[0] = xmin[0] - 1.0; x0[1] = xmin[1] - 1.0;
+   /*    output file */
+   fitsfile *fileOutFits;     /* pointer to the FITS file, defined in fitsio.h */
 
-      fits_insert_col(fileOutFits, ncols+1, para->flagName,  "1I", &status);
-	   if (status) {
-         fits_report_error(stderr, status);
-         exit(EXIT_FAILURE);
+   fits_create_file(&fileOutFits, para->fileOutName, &status);
+	if (status){
+      fits_report_error(stderr, status);
+      if (status){
+         fprintf(stderr, "Add \"!\" in front of the file name to overwrite: -o \"!FILEOUT\"\n");
       }
+      exit(EXIT_FAILURE);
+   }
 
+   long pcount = 0;
+   fits_read_key_lng(fileCatIn, "PCOUNT", &pcount, NULL, &status);
+   status = 0;
+   int stream = (pcount == 0);
+
+   if(stream){
+      /*    HDUs before the catalogue, then an empty table with the same columns */
+      fits_copy_file(fileCatIn, fileOutFits, 1, 0, 0, &status);
+      fits_copy_header(fileCatIn, fileOutFits, &status);
+      fits_modify_key_lng(fileOutFits, "NAXIS2", 0, "&", &status);
+      fits_set_hdustruc(fileOutFits, &status);
+   }else{
+      fits_copy_file(fileCatIn, fileOutFits, 1, 1, 1, &status);
+   }
+	if (status){
+      fits_report_error(stderr, status);
+      exit(EXIT_FAILURE);
+   }
 
-      double *xx = (double *)malloc(N*sizeof(double));
-      double *yy = (double *)malloc(N*sizeof(double));
-      long *rowlist = (long *)malloc(N*sizeof(long));
-
-
-      readColFits(fileCatIn, xcol, N, xx);
-      readColFits(fileCatIn, ycol, N, yy);
-
-      size_t N_size_t = (size_t)N;
-
+   /*    flag column */
+   if(!flagOnly || !stream) fits_insert_col(fileOutFits, ncols+1, para->flagName, tform, &status);
+   if (status){
+      fits_report_error(stderr, status);
+      exit(EXIT_FAILURE);
+   }
 
-      long count = 0;
-      if(verbose) fprintf(stderr,"Progress =     ");
-      for (i=0; i<N;i++){
+   Nrows          = MIN((long)para->blockRows, N);
+   if(Nrows < 1) Nrows = 1;
+   double *xx     = (double *)malloc(Nrows*sizeof(double));
+   double *yy     = (double *)malloc(Nrows*sizeof(double));
+   double *value  = (double *)malloc(Nrows*sizeof(double));
+   int *inside    = (int *)malloc(Nrows*sizeof(int));
+   char *keep     = (char *)malloc(Nrows*sizeof(char));
+   long *rowlist  = NULL;
+   if(!stream && flagOnly) rowlist = (long *)malloc(N*sizeof(long));
+   if(xx == NULL || yy == NULL || value == NULL || inside == NULL || keep == NULL || (!stream && flagOnly && rowlist == NULL)){
+      fprintf(stderr,"%s: not enough memory for %ld rows, try a smaller -blockRows. Exiting...\n",MYNAME,Nrows);
+      exit(EXIT_FAILURE);
+   }
 
-         if(verbose) printCount(&i,&N_size_t,1000);
+   int cols[2]    = {xcol, ycol};
+   double *xy[2]  = {xx, yy};
+   size_t N_size_t = (size_t)N, k;
 
-         x[0] = xx[i];
-         x[1] = yy[i];
+   fprintf(stderr,"Progress =     ");
+   for(first=0; first<N; first+=Nrows){
+      if(first+Nrows > N) Nrows = N - first;
+      k = (size_t)first;
+      printCount(&k,&N_size_t,1);
 
-         if(flag=0,!insidePolygonTree(polyTree,x0,x,&poly_id)) flag = 1;
-         fits_write_col(fileOutFits, TSHORT, ncols+1, firstrow+i, firstelem, 1, &flag, &status);
-         if (status){
-            fits_report_error(stderr, status);
-            exit(EXIT_FAILURE);
-         }
+      readColsFits(fileCatIn, 2, cols, first+1, Nrows, xy);
 
-         if(para->format == 1 && !flag){
-            rowlist[count] = i+1;
-            count++;
-         }
-         if(para->format == 2 && flag){
-            rowlist[count] = i+1;
-            count++;
+      if(image != NULL){
+         if(image->wcs != NULL) worldToPixel(image->wcs, xx, yy, (size_t)Nrows, wmin, wmax, xx, yy);
+         valuesImage(image, xx, yy, (size_t)Nrows, xmin, xmax, null, value);
+         for (i=0; i<Nrows;i++) keep[i] = 1;
+      }else{
+         /*    1 = outside the mask, 0 = inside the mask */
+         insidePolygonTreeBatch(polyTree, xx, yy, (size_t)Nrows, inside, NULL);
+         for (i=0; i<Nrows;i++){
+            flag     = !inside[i];
+            value[i] = flag;
+            /*    -f outside (1) keeps the objects outside the mask, -f inside (2) the others */
+            keep[i]  = (para->format == 1) ? flag : (para->format == 2) ? !flag : 1;
+            if(!stream && !keep[i]) rowlist[count++] = first+i+1;
          }
       }
 
-      fprintf(stderr,"\b\b\b\b100%%\n");
-      free(xx);
-      free(yy);
-
-      if(para->format == 1 || para->format == 2){
-         fits_delete_rowlist(fileOutFits, rowlist, count, &status);
-         fits_delete_col(fileOutFits, ncols+1, &status);
-         if (status){
-            fits_report_error(stderr, status);
-            exit(EXIT_FAILURE);
-         }
-
+      if(stream){
+         copyRowsFits(fileCatIn, fileOutFits, first+1, Nrows, keep, &count, &status);
+         /*    values are written into the rows just appended */
+         if(!flagOnly) fits_write_col(fileOutFits, TDOUBLE, ncols+1, count-Nrows+1, firstelem, Nrows, value, &status);
+      }else{
+         fits_write_col(fileOutFits, TDOUBLE, ncols+1, first+1, firstelem, Nrows, value, &status);
       }
-
+      if (status){
+         fits_report_error(stderr, status);
+         exit(EXIT_FAILURE);
+      }
+   }
+   fprintf(stderr,"\b\b\b\b100%%\n");
+
+   if(stream){
+      /*    number of rows written, then HDUs following the catalogue */
+      fits_modify_key_lng(fileOutFits, "NAXIS2", count, "&", &status);
+      fits_copy_file(fileCatIn, fileOutFits, 0, 0, 1, &status);
+   }else if(flagOnly){
+      fits_delete_rowlist(fileOutFits, rowlist, count, &status);
+      fits_delete_col(fileOutFits, ncols+1, &status);
+      count = N - count;
+   }else{
+      count = N;
    }
+   if (status){
+      fits_report_error(stderr, status);
+      exit(EXIT_FAILURE);
+   }
+   fprintf(stderr,"%ld object(s) written\n", count);
+
+   free(xx);
+   free(yy);
+   free(value);
+   free(inside);
+   free(keep);
+   free(rowlist);
+   closeImage(image);
 
 	fits_close_file(fileOutFits, &status);
 	if (status) {
@@ -399,138 +432,199 @@ int flagCat(const Config *para){
     *    the mask and 0 is inside the mask. xcol and ycol are the column ids
     *    of resp. x coordinate and y coordinate.
     *    For mask fits format, it writes the pixel value.
+    *    The catalogue is read once (stdin is fine), by blocks of
+    *    para->blockRows objects: only the x and y fields are parsed and
+    *    the lines are written back unchanged, followed by the flag.
     */
 
-   int Npolys, poly_id, flag, verbose = 1;
-   size_t i,N, Ncol;
-   double x[3], x0[3], xmin[3], xmax[3];
-   char line[NFIELD*NCHAR], item[NFIELD*NCHAR],*str_end;
+   int fitsMask, verbose = 1, cols[2];
+   size_t i, k, length, fileSize = 0;
+   double xmin[3], xmax[3];
+   const char *line;
+   struct stat st;
 
    FILE *fileOut   = fopenAndCheck(para->fileOutName,"w");
    FILE *fileCatIn = fopenAndCheck(para->fileCatInName,"r");
 
-   N = 0;
-   if(fileCatIn != stdin){
-      while(fgets(line,NFIELD*NCHAR,fileCatIn) != NULL)
-      if(getStrings(line,item," ",&Ncol))  N++;
-      rewind(fileCatIn);
-      fprintf(stderr,"Nobjects = %zd\n", N);
+   /*    progress is measured in bytes read */
+   if(fileCatIn != stdin && fstat(fileno(fileCatIn),&st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+      fileSize = (size_t)st.st_size;
    }else{
       verbose = 0;
    }
 
-   int xcol = atoi(para->xcol);
-   int ycol = atoi(para->ycol);
+   cols[0] = atoi(para->xcol);
+   cols[1] = atoi(para->ycol);
 
-   if(checkFileExt(para->fileRegInName,".fits")){
+   /*    fits mask */
+   int status = 0;
+   Image *image    = NULL;
+   Tree *polyTree  = NULL;
 
-      if(para->coordType != CART){
-         fprintf(stderr,"%s: fits file detected. coord should be set to cart for image coordinates. Exiting...\n",MYNAME);
-         exit(EXIT_FAILURE);
-      }
-
-
-      long fpixel[2], naxes[2];
-      int bitpix, status = 0;
-      double (*toDouble)(void *,long ) = NULL;
+   if(checkFileExt(para->fileRegInName,".fits")){
 
-      /*    read fits file and put in table */
-      void *table = readFits(para,&bitpix,NULL,NULL,&status,naxes,&toDouble,NULL);
+      /*    open fits file, pixels are read where they are needed */
+      image = openImage(para,&status);
 
       /*    define limits */
       xmin[0] = xmin[1] = 0.5;
-      xmax[0] = naxes[0]+0.5;
-      xmax[1] = naxes[1]+0.5;
-      if(para->minDefined[0]) xmin[0] = para->min[0];
-      if(para->maxDefined[0]) xmax[0] = para->max[0];
-      if(para->minDefined[1]) xmin[1] = para->min[1];
-      if(para->maxDefined[1]) xmax[1] = para->max[1];
-      /*    print out limits */
-      fprintf(stderr,"Mask limits:\n");
-      fprintf(stderr,"-xmin %g -xmax %g -ymin %g -ymax %g\n",xmin[0],xmax[0],xmin[1],xmax[1]);
-
-      /*    ATTENTION "toDouble" converts everything into double */
-      i = 0;
-      if(verbose) fprintf(stderr,"Progress =     ");
-      while(fgets(line,NFIELD*NCHAR,fileCatIn) != NULL){
+      xmax[0] = image->naxes[0]+0.5;
+      xmax[1] = image->naxes[1]+0.5;
+      fitsMask = 1;
 
-         /*    keep commented lines */
-         if (line[0] == '#') fprintf(fileOut,"%s",line);
-
-         if(getStrings(line,item," ",&Ncol)){
-            i++;
-            if(verbose) printCount(&i,&N,1000);
-            x[0] = getDoubleValue(item,xcol);
-            x[1] = getDoubleValue(item,ycol);
-            fpixel[0] = roundToNi(x[0]) - 1;
-            fpixel[1] = roundToNi(x[1]) - 1;
-            str_end = strstr(line,"\n");/* cariage return to the end of the line */
-            strcpy(str_end,"\0");       /* "end" symbol to the line              */
-            if(xmin[0] < x[0] && x[0] < xmax[0] && xmin[1] < x[1] && x[1] < xmax[1]){
-               fprintf(fileOut,"%s %g\n",line,toDouble(table,fpixel[1]*naxes[0]+fpixel[0]));
-            }else{
-               fprintf(fileOut,"%s %d\n",line,-99);
-            }
-         }
-      }
-      if(verbose) fprintf(stderr,"\b\b\b\b100%%\n");
-
-      free(table);
-
-   }else if(checkFileExt(para->fileRegInName,".reg")){
-      FILE *fileRegIn = fopenAndCheck(para->fileRegInName,"r");
-      Node *polyTree  = readPolygonFileTree(fileRegIn,xmin,xmax);
-      Polygon *polys = (Polygon *)polyTree->polysAll;
-      Npolys          = polyTree->Npolys;
-      fclose(fileRegIn);
-
-      /*    or if the limits are defined by the user */
-      if(para->minDefined[0]) xmin[0] = para->min[0];
-      if(para->maxDefined[0]) xmax[0] = para->max[0];
-      if(para->minDefined[1]) xmin[1] = para->min[1];
-      if(para->maxDefined[1]) xmax[1] = para->max[1];
-      /* print out limits */
-      fprintf(stderr,"Mask limits:\n");
-      fprintf(stderr,"-xmin %g -xmax %g -ymin %g -ymax %g\n",xmin[0],xmax[0],xmin[1],xmax[1]);
-
-      /*    reference point. It must be outside the mask */
-      x0[0] = xmin[0] - 1.0; x0[1] = xmin[1] - 1.0;
+   }else if(checkFileExt(para->fileRegInName,".reg") || strcmp(para->fileIndexInName,"")){
+      polyTree = readMaskTree(para,xmin,xmax);
+      fitsMask = 0;
+   }else{
+      fprintf(stderr,"%s: mask file format not recognized. Please provide .reg, .fits or no mask with input limits. Exiting...\n",MYNAME);
+      exit(EXIT_FAILURE);
+   }
 
-      i = 0;
-      if(verbose) fprintf(stderr,"Progress =     ");
-      while(fgets(line,NFIELD*NCHAR,fileCatIn) != NULL){
+   /*    or if the limits are defined by the user */
+   if(para->minDefined[0]) xmin[0] = para->min[0];
+   if(para->maxDefined[0]) xmax[0] = para->max[0];
+   if(para->minDefined[1]) xmin[1] = para->min[1];
+   if(para->maxDefined[1]) xmax[1] = para->max[1];
+
+   /*    with a WCS, the limits are in RA DEC and objects
+    *    are projected onto the image (see worldToPixel()) */
+   double wmin[2], wmax[2];
+   if(fitsMask && image->wcs != NULL) worldLimits(para, image, xmin, xmax, wmin, wmax);
+
+   /* print out limits */
+   fprintf(stderr,"Mask limits:\n");
+   fprintf(stderr,"-xmin %g -xmax %g -ymin %g -ymax %g\n",xmin[0],xmax[0],xmin[1],xmax[1]);
+
+   /*    lines are read by blocks of para->blockRows lines. The lines of a block
+    *    are parsed in parallel, flagged all at once (see insidePolygonTreeBatch(),
+    *    shared among threads) and formatted in parallel into one buffer per
+    *    chunk of lines. The chunks are then written in input order, so the
+    *    output does not depend on the number of threads */
+   long t, Nchunks = 1;
+#ifdef _OPENMP
+   Nchunks = omp_get_max_threads();
+#endif
+   Reader *reader  = openReader(fileCatIn, IOBUFFERSIZE);
+   Writer *writer  = openWriter(fileOut, IOBUFFERSIZE);
+   Writer **chunks = (Writer **)malloc(Nchunks*sizeof(Writer *));
+   Lines *block    = allocLines(para->blockRows);
+   double *xx      = (double *)malloc(para->blockRows*sizeof(double));
+   double *yy      = (double *)malloc(para->blockRows*sizeof(double));
+   int *inside     = (int *)malloc(para->blockRows*sizeof(int));
+   double *value   = fitsMask ? (double *)malloc(para->blockRows*sizeof(double)) : NULL;
+   if(chunks == NULL || xx == NULL || yy == NULL || inside == NULL || (fitsMask && value == NULL)){
+      fprintf(stderr,"%s: not enough memory to read the catalogue. Exiting...\n",MYNAME);
+      exit(EXIT_FAILURE);
+   }
+   for(t=0;t<Nchunks;t++) chunks[t] = openWriter(NULL, IOBUFFERSIZE/Nchunks);
 
-         /*    keep commented lines */
-         if (line[0] == '#') fprintf(fileOut,"%s",line);
+   i = 0;
+   if(verbose) fprintf(stderr,"Progress =     ");
+   while(1){
 
-         if(getStrings(line,item," ",&Ncol)){
-            i++;
-            if(verbose) printCount(&i,&N,1000);
-            x[0] = getDoubleValue(item,xcol);
-            x[1] = getDoubleValue(item,ycol);
+      /*    read a block (only the line boundaries are searched here) */
+      block->N = 0;
+      while(block->N < para->blockRows && nextLine(reader,&line,&length)){
+         appendLine(block,line,length,0);
+      }
 
-            if(flag=0, !insidePolygonTree(polyTree,x0,x,&poly_id)) flag = 1;
+      /*    parse the coordinates. Commented lines are kept as they are
+       *    and empty lines are dropped (isObject = 0) */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+      for(k=0;k<block->N;k++){
+         double xk[2];
+         block->isObject[k] = getColumns(block->line[k],block->length[k],cols,2,xk);
+         xx[k] = xk[0];
+         yy[k] = xk[1];
+      }
+      for(k=0;k<block->N;k++) i += block->isObject[k];
+
+      /*    1 = outside the mask, 0 = inside the mask */
+      if(!fitsMask) insidePolygonTreeBatch(polyTree, xx, yy, block->N, inside, NULL);
+
+      /*    pixel values, read by one thread (the tiles of the image are
+       *    read on demand, see valuesImage()) */
+      if(fitsMask && image->wcs != NULL) worldToPixel(image->wcs, xx, yy, block->N, wmin, wmax, xx, yy);
+      if(fitsMask) valuesImage(image, xx, yy, block->N, xmin, xmax, -99.0, value);
+
+      /*    format the block, one chunk of lines per thread */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,1) num_threads(Nchunks)
+#endif
+      for(t=0;t<Nchunks;t++){
+         size_t kt, lengthk, start = block->N*t/Nchunks, end = block->N*(t+1)/Nchunks;
+         const char *linek;
+         int flagk;
+         Writer *out = chunks[t];
+
+         out->size = 0;
+         for(kt=start;kt<end;kt++){
+            linek   = block->line[kt];
+            lengthk = block->length[kt];
+            if(!block->isObject[kt]){
+               if(linek[0] == '#') writeBytes(out,linek,lengthk);
+               continue;
+            }
+            /*    line without the newline */
+            if(lengthk > 0 && linek[lengthk-1] == '\n') lengthk--;
+
+            if(fitsMask){
+               /*    ATTENTION "valueImage" converts everything into double */
+               if(xmin[0] < xx[kt] && xx[kt] < xmax[0] && xmin[1] < yy[kt] && yy[kt] < xmax[1]){
+                  writeBytes(out,linek,lengthk);
+                  writeBytes(out," ",1);
+                  writeGeneral(out,value[kt]);
+                  writeBytes(out,"\n",1);
+               }else{
+                  writeBytes(out,linek,lengthk);
+                  writeBytes(out," -99\n",5);
+               }
+               continue;
+            }
 
-            str_end = strstr(line,"\n");/*   cariage return to the end of the line */
-            strcpy(str_end,"\0");       /*   "end" symbol to the line */
+            flagk = !inside[kt];
             switch (para->format){
                case 1: /*  only objects outside the mask and inside the user's Defined limits */
-               if(flag) fprintf(fileOut,"%s\n",line);
+               if(flagk){
+                  writeBytes(out,linek,lengthk);
+                  writeBytes(out,"\n",1);
+               }
                break;
                case 2: /*  only objects inside the mask or outside the user's Defined limits */
-               if(!flag) fprintf(fileOut,"%s\n",line);
+               if(!flagk){
+                  writeBytes(out,linek,lengthk);
+                  writeBytes(out,"\n",1);
+               }
                break;
                case 3: /*  all objects with the flag */
-               fprintf(fileOut,"%s %d\n",line,flag);
+               writeBytes(out,linek,lengthk);
+               writeBytes(out,flagk ? " 1\n" : " 0\n",3);
             }
          }
       }
-      fflush(stdout);
-      if(verbose) fprintf(stderr,"\b\b\b\b100%%\n");
-   }else{
-      fprintf(stderr,"%s: mask file format not recognized. Please provide .reg, .fits or no mask with input limits. Exiting...\n",MYNAME);
-      exit(EXIT_FAILURE);
+
+      /*    write the chunks in order */
+      for(t=0;t<Nchunks;t++) writeBytes(writer,chunks[t]->buffer,chunks[t]->size);
+      if(verbose) printCount(&reader->total,&fileSize,1);
+
+      /*    the buffer is refilled only once the block is written */
+      if(block->N < para->blockRows && !fillReader(reader)) break;
    }
+   if(verbose) fprintf(stderr,"\b\b\b\b100%%\n");
+   fprintf(stderr,"Nobjects = %zd\n", i);
+
+   for(t=0;t<Nchunks;t++) free_Writer(chunks[t]);
+   free(chunks);
+   free_Writer(writer);
+   free_Reader(reader);
+   free_Lines(block);
+   free(xx);
+   free(yy);
+   free(inside);
+   free(value);
+   closeImage(image);
 
    fclose(fileOut);
    fclose(fileCatIn);
@@ -547,14 +641,15 @@ int randomCat(const Config *para){
     *    outside the mask.
     */
 
-   int Npolys,poly_id,flag, verbose = 1, status = 0, size;
-   long firstrow =1, firstelem = 1;
+   int flag, status = 0, size;
+   long firstrow =1;
 
    size_t i, npart;
-   double x[3], x0[3], xmin[3], xmax[3], z, area;
+   double x[3], xmin[3], xmax[3], z = 0.0, area, inside;
    gsl_rng *r = randomInitialize(para->seed);
 
    FILE *fileOut;             /* pointer to the ascii file */
+   Writer *writer = NULL;     /* buffered output on fileOut */
    fitsfile *fileOutFits;     /* pointer to the FITS file, defined in fitsio.h */
 
    /*    redshift distribution
@@ -617,18 +712,17 @@ int randomCat(const Config *para){
          exit(EXIT_FAILURE);
       }
 
-      long fpixel[2], naxes[2];
-      int bitpix, typecode;
       char tform_char;
-      double (*toDouble)(void *,long ) = NULL;
 
-      /*    read fits file and put in table */
-      void *table = readFits(para, &bitpix, &typecode, &tform_char, &status, naxes, &toDouble, &size);
+      /*    open fits file, pixels are read where they are needed */
+      Image *image = openImage(para, &status);
+      tform_char   = image->tform;
+      size         = image->size;
 
       /*    define limits */
       xmin[0] = xmin[1] = 0.5;
-      xmax[0] = naxes[0]+0.5;
-      xmax[1] = naxes[1]+0.5;
+      xmax[0] = image->naxes[0]+0.5;
+      xmax[1] = image->naxes[1]+0.5;
       if(para->minDefined[0]) xmin[0] = para->min[0];
       if(para->maxDefined[0]) xmax[0] = para->max[0];
       if(para->minDefined[1]) xmin[1] = para->min[1];
@@ -638,6 +732,25 @@ int randomCat(const Config *para){
       fprintf(stderr,"Mask limits:\n");
       fprintf(stderr,"-xmin %g -xmax %g -ymin %g -ymax %g\n",xmin[0],xmax[0],xmin[1],xmax[1]);
 
+      /*    the tile summary costs one read of the tiles within the limits
+       *    (see summaryImage()): built with more objects than pixels, and
+       *    with -exactNpart, where objects are only drawn in the tiles where
+       *    they can be kept (pixel = 0 with -f outside, != 0 with -f inside,
+       *    see createCellsImage()) until npart objects are accepted */
+      size_t Naccepted = 0;
+      Cells *cells     = NULL;
+      if(para->exactNpart || (double)para->npart >= (xmax[0] - xmin[0])*(xmax[1] - xmin[1])){
+         summaryImage(image, xmin, xmax);
+      }
+      if(para->exactNpart){
+         cells = createCellsImage(image, xmin, xmax, para->format == 2);
+         if(cells->N == 0){
+            fprintf(stderr,"%s: no area to draw random objects %s the mask. Exiting...\n",MYNAME,para->format == 2 ? "inside" : "outside");
+            exit(EXIT_FAILURE);
+         }
+         fprintf(stderr,"Sampling in %zd cells\n",cells->N);
+      }
+
       if(para->oFileType == FITS){
          fprintf(stderr, "Outpout file or stdout format: fits\n");
 
@@ -671,59 +784,145 @@ int randomCat(const Config *para){
          fprintf(stderr,"Creates a random catalogue with N = %zd objects. Format = %d\n",npart,para->format);
 
 
+         /*    rows are built in memory by blocks (see writeColsFits()).
+          *    With -exactNpart, objects are drawn by blocks and their
+          *    pixels gathered to be accepted or not (see valuesImage()) */
+         long n = 0, Nrows;
+         size_t j, k, Nk;
+         double all[2][2] = {{-INF, -INF}, {INF, INF}};
+         fits_get_rowsize(fileOutFits, &Nrows, &status);
+         if(Nrows < FITSBLOCKMIN) Nrows = FITSBLOCKMIN;
+         double *bx     = (double *)malloc(Nrows*sizeof(double));
+         double *by     = (double *)malloc(Nrows*sizeof(double));
+         double *bz     = (double *)malloc(Nrows*sizeof(double));
+         char *bvalue   = (char *)malloc(Nrows*size*sizeof(char));
+         double *xx     = (double *)malloc(GATHERBLOCK*sizeof(double));
+         double *yy     = (double *)malloc(GATHERBLOCK*sizeof(double));
+         double *value  = (double *)malloc(GATHERBLOCK*sizeof(double));
+         void *cols[4]  = {bx, by, bvalue, bz};
+         int types[4]   = {TDOUBLE, TDOUBLE, image->typecode, TDOUBLE};
+         int Ncols      = (para->nz || para->zrange) ? 4 : 3;
+         if(bx == NULL || by == NULL || bz == NULL || bvalue == NULL || xx == NULL || yy == NULL || value == NULL){
+            fprintf(stderr,"%s: not enough memory for %ld rows. Exiting...\n",MYNAME,Nrows);
+            exit(EXIT_FAILURE);
+         }
+
          fprintf(stderr,"Progress =     ");
-         for(i=0;i<npart;i++){
-            printCount(&i,&para->npart, 1000);
-            x[0] = gsl_ran_flat(r,xmin[0],xmax[0]);
-            x[1] = gsl_ran_flat(r,xmin[1],xmax[1]);
-            fpixel[0] = roundToNi(x[0]) - 1;
-            fpixel[1] = roundToNi(x[1]) - 1;
-            fits_write_col(fileOutFits, TDOUBLE,  1, firstrow+i, firstelem, 1, &(x[0]), &status);
-            fits_write_col(fileOutFits, TDOUBLE,  2, firstrow+i, firstelem, 1, &(x[1]), &status);
-            fits_write_col(fileOutFits, typecode, 3, firstrow+i, firstelem, 1, table + (fpixel[1]*naxes[0]+fpixel[0])*size, &status);
-            if(para->nz || para->zrange){
-               z = gsl_histogram_pdf_sample (nz_PDF, gsl_ran_flat(r, 0.0, 1.0));
-               fits_write_col(fileOutFits, TDOUBLE, 4, firstrow+i, firstelem, 1, &z, &status);
+         for(i=0;(cells != NULL ? Naccepted : i) < npart;i+=Nk){
+            if(cells != NULL){
+               /*    never more than the objects still needed */
+               Nk = MIN(npart - Naccepted, GATHERBLOCK);
+               randomPoints(para, r, i, Nk, xmin, xmax, cells, xx, yy);
+               valuesImage(image, xx, yy, Nk, all[0], all[1], 0.0, value);
+            }else{
+               Nk    = 1;
+               xx[0] = randomFlat(para,r,i,0,xmin[0],xmax[0]);
+               yy[0] = randomFlat(para,r,i,1,xmin[1],xmax[1]);
             }
-            if (status) {
-               fits_report_error(stderr, status);
-               exit(EXIT_FAILURE);
+            for(k=0;k<Nk;k++){
+               j = i+k;
+               printCount(cells != NULL ? &Naccepted : &j,&npart,1000);
+               /*    1: only objects in pixels = 0, 2: only objects in pixels != 0 */
+               if(cells != NULL && (value[k] != 0.0) != (para->format == 2)) continue;
+               Naccepted++;
+               bx[n] = xx[k];
+               by[n] = yy[k];
+               pixelImage(image, roundToNi(xx[k]) - 1, roundToNi(yy[k]) - 1, bvalue+n*size);
+               if(para->nz || para->zrange){
+                  bz[n] = gsl_histogram_pdf_sample (nz_PDF, randomFlat(para,r,j,2,0.0,1.0));
+               }
+               if(++n == Nrows){
+                  writeColsFits(fileOutFits, Ncols, types, cols, firstrow, n, &status);
+                  if (status) {
+                     fits_report_error(stderr, status);
+                     exit(EXIT_FAILURE);
+                  }
+                  firstrow += n;
+                  n = 0;
+               }
             }
          }
+         if(n > 0) writeColsFits(fileOutFits, Ncols, types, cols, firstrow, n, &status);
+         if (status) {
+            fits_report_error(stderr, status);
+            exit(EXIT_FAILURE);
+         }
+         free(bx);
+         free(by);
+         free(bz);
+         free(bvalue);
+         free(xx);
+         free(yy);
+         free(value);
 
       }else{
          fprintf(stderr, "Outpout file or stdout format: ascii\n");
 
          fileOut = fopenAndCheck(para->fileOutName,"w");
-         /*    ATTENTION "toDouble" converts everything into double */
+         writer  = openWriter(fileOut, IOBUFFERSIZE);
+         /*    ATTENTION "valuesImage" converts everything into double.
+          *    Points are drawn by blocks (in the same order), then the
+          *    pixels of the block are gathered (see valuesImage()) */
+         size_t k, Nk;
+         double all[2][2] = {{-INF, -INF}, {INF, INF}};
+         double *bx     = (double *)malloc(GATHERBLOCK*sizeof(double));
+         double *by     = (double *)malloc(GATHERBLOCK*sizeof(double));
+         double *bz     = (double *)malloc(GATHERBLOCK*sizeof(double));
+         double *bvalue = (double *)malloc(GATHERBLOCK*sizeof(double));
          fprintf(stderr,"Progress =     ");
-         for(i=0;i<para->npart;i++){
-            printCount(&i,&para->npart,1000);
-            x[0] = gsl_ran_flat(r,xmin[0],xmax[0]);
-            x[1] = gsl_ran_flat(r,xmin[1],xmax[1]);
-            fpixel[0] = roundToNi(x[0]) - 1;
-            fpixel[1] = roundToNi(x[1]) - 1;
-            if(para->nz || para->zrange){
-               z = gsl_histogram_pdf_sample (nz_PDF, gsl_ran_flat(r, 0.0, 1.0));
-               fprintf(fileOut,"%f %f %g %f\n", x[0], x[1], toDouble(table,fpixel[1]*naxes[0]+fpixel[0]), z);
+         for(i=0;(cells != NULL ? Naccepted : i) < para->npart;i+=Nk){
+            printCount(cells != NULL ? &Naccepted : &i,&para->npart,1);
+            /*    with -exactNpart, never more than the objects still needed */
+            Nk = MIN(para->npart - (cells != NULL ? Naccepted : i), GATHERBLOCK);
+            if(cells != NULL){
+               randomPoints(para, r, i, Nk, xmin, xmax, cells, bx, by);
             }else{
-               fprintf(fileOut,"%f %f %g\n", x[0], x[1], toDouble(table,fpixel[1]*naxes[0]+fpixel[0]));
+               for(k=0;k<Nk;k++){
+                  bx[k] = randomFlat(para,r,i+k,0,xmin[0],xmax[0]);
+                  by[k] = randomFlat(para,r,i+k,1,xmin[1],xmax[1]);
+                  if(para->nz || para->zrange){
+                     bz[k] = gsl_histogram_pdf_sample (nz_PDF, randomFlat(para,r,i+k,2,0.0,1.0));
+                  }
+               }
+            }
+            valuesImage(image, bx, by, Nk, all[0], all[1], 0.0, bvalue);
+            for(k=0;k<Nk;k++){
+               if(cells != NULL){
+                  /*    1: only objects in pixels = 0, 2: only objects in pixels != 0 */
+                  if((bvalue[k] != 0.0) != (para->format == 2)) continue;
+                  Naccepted++;
+                  if(para->nz || para->zrange){
+                     bz[k] = gsl_histogram_pdf_sample (nz_PDF, randomFlat(para,r,i+k,2,0.0,1.0));
+                  }
+               }
+               writeFixed(writer,bx[k],para->precision);
+               writeBytes(writer," ",1);
+               writeFixed(writer,by[k],para->precision);
+               writeBytes(writer," ",1);
+               writeGeneral(writer,bvalue[k]);
+               if(para->nz || para->zrange){
+                  writeBytes(writer," ",1);
+                  writeFixed(writer,bz[k],para->precision);
+               }
+               writeBytes(writer,"\n",1);
             }
          }
+         free(bx);
+         free(by);
+         free(bz);
+         free(bvalue);
       }
 
       fprintf(stderr,"\b\b\b\b100%%\n");
-      free(table);
+      if(cells != NULL) free_Cells(cells);
+      closeImage(image);
 
-   }else if(checkFileExt(para->fileRegInName,".reg")){
+   }else if(checkFileExt(para->fileRegInName,".reg") || strcmp(para->fileIndexInName,"")){
 
       long count;
+      size_t j, k, n;
 
-      FILE *fileRegIn = fopenAndCheck(para->fileRegInName,"r");
-      Node *polyTree  = readPolygonFileTree(fileRegIn,xmin,xmax);
-      Polygon *polys  = (Polygon *)polyTree->polysAll;
-      Npolys          = polyTree->Npolys;
-      fclose(fileRegIn);
+      Tree *polyTree  = readMaskTree(para,xmin,xmax);
 
       /*    or if the limits are defined by the user */
       if(para->minDefined[0]) xmin[0] = para->min[0];
@@ -734,9 +933,6 @@ int randomCat(const Config *para){
       fprintf(stderr,"Mask limits:\n");
       fprintf(stderr,"-xmin %g -xmax %g -ymin %g -ymax %g\n",xmin[0],xmax[0],xmin[1],xmax[1]);
 
-      /*    reference point. It must be outside the mask */
-      x0[0] = xmin[0] - 1.0; x0[1] = xmin[1] - 1.0;
-
       //fprintf(stderr,"xmin = %f \nxmax = %f \nymin = %f \nymax = %f\n",xmin[0],xmax[0],xmin[1],xmax[1]);
       if(para->coordType == RADEC){
          area = (xmax[0] - xmin[0])*(sin(xmax[1]*PI/180.0) - sin(xmin[1]*PI/180.0))*180.0/PI;
@@ -745,6 +941,14 @@ int randomCat(const Config *para){
       }
       fprintf(stderr, "Area = %f\n", area);
 
+      /*    with -exactNpart, npart is the number of objects written, so
+       *    -cd and the header use the exact area where they are kept */
+      if(para->exactNpart){
+         inside = maskArea(polyTree, xmin, xmax, para->coordType);
+         area   = (para->format == 2) ? inside : area - inside;
+         fprintf(stderr, "Area %s the mask = %f\n", para->format == 2 ? "inside" : "outside", area);
+      }
+
       if(para->constDen){
          npart =  (size_t)round((double)para->npart*area);
       }else{
@@ -752,6 +956,32 @@ int randomCat(const Config *para){
       }
       fprintf(stderr,"Creates a random catalogue with N = %zd objects. Format = %d\n",npart,para->format);
 
+      /*    points are drawn and flagged by blocks of NBATCH per thread.
+       *    With the gsl generator, redshifts are drawn from the same generator
+       *    right after each point, so to keep the same sequence the blocks are
+       *    of 1 point with -nz/-z, and points are drawn by one thread. With
+       *    -rng philox or -sampler sobol/halton, point i only depends on the seed
+       *    and i: points are drawn in parallel and the output is the same for
+       *    any number of threads */
+      size_t Nblock = ((para->nz || para->zrange) && !randomIsIndexed(para)) ? 1 : NBATCH*(size_t)para->nthreads;
+      double *xx    = (double *)malloc(Nblock*sizeof(double));
+      double *yy    = (double *)malloc(Nblock*sizeof(double));
+      int *inside   = (int *)malloc(Nblock*sizeof(int));
+
+      /*    with -exactNpart, objects are drawn in the grid cells where they can
+       *    be accepted (see createCells()) until npart objects are accepted.
+       *    Only objects drawn in boundary cells can be rejected */
+      size_t Naccepted = 0;
+      Cells *cells     = NULL;
+      if(para->exactNpart){
+         cells = createCells(polyTree, xmin, xmax, para->coordType, para->format == 2);
+         if(cells->N == 0){
+            fprintf(stderr,"%s: no area to draw random objects %s the mask. Exiting...\n",MYNAME,para->format == 2 ? "inside" : "outside");
+            exit(EXIT_FAILURE);
+         }
+         fprintf(stderr,"Sampling in %zd cells\n",cells->N);
+      }
+
       if(para->oFileType == FITS){
          fprintf(stderr, "Outpout file or stdout format: fits\n");
 
@@ -792,72 +1022,76 @@ int randomCat(const Config *para){
             exit(EXIT_FAILURE);
          }
 
+         /*    surviving rows are built in memory by blocks (see writeColsFits()).
+          *    As before, redshifts are only drawn for the rows written */
+         long m = 0, Nrows;
+         fits_get_rowsize(fileOutFits, &Nrows, &status);
+         if(Nrows < FITSBLOCKMIN) Nrows = FITSBLOCKMIN;
+         double *bx     = (double *)malloc(Nrows*sizeof(double));
+         double *by     = (double *)malloc(Nrows*sizeof(double));
+         double *bz     = (double *)malloc(Nrows*sizeof(double));
+         short *bflag   = (short *)malloc(Nrows*sizeof(short));
+         void *cols[4]  = {bx, by, bz, bflag};
+         int types[4]   = {TDOUBLE, TDOUBLE, TDOUBLE, TSHORT};
+         int Ncols      = 2;
+         if(bx == NULL || by == NULL || bz == NULL || bflag == NULL){
+            fprintf(stderr,"%s: not enough memory for %ld rows. Exiting...\n",MYNAME,Nrows);
+            exit(EXIT_FAILURE);
+         }
+         if(para->nz || para->zrange){
+            Ncols++;
+         }else{
+            /*    no redshift: the flag is the third column */
+            cols[2]  = bflag;
+            types[2] = TSHORT;
+         }
+         if(para->format == 3) Ncols++;
+
          fprintf(stderr,"Progress =     ");
          count = 0;
-         for(i=0;i<npart;i++){
-            printCount(&i,&npart,1000);
-            if(para->coordType == CART){
-               x[0] = gsl_ran_flat(r,xmin[0],xmax[0]);
-               x[1] = gsl_ran_flat(r,xmin[1],xmax[1]);
-            }else{
-               x[0] = gsl_ran_flat(r,xmin[0],xmax[0]);
-               x[1] = gsl_ran_flat(r,sin(xmin[1]*PI/180.0),sin(xmax[1]*PI/180.0));
-               x[1] = asin(x[1])*180.0/PI;
-            }
+         for(i=0;(cells != NULL ? Naccepted : i) < npart;i+=n){
+            /*    with -exactNpart, never more than the objects still needed */
+            n = npart - (cells != NULL ? Naccepted : i);
+            if(n > Nblock) n = Nblock;
+            randomPoints(para, r, i, n, xmin, xmax, cells, xx, yy);
             /*    1 = outside the mask, 0 = inside the mask */
-            if(flag=0,!insidePolygonTree(polyTree,x0,x,&poly_id)) flag = 1;
-
-
-            switch (para->format){
-               case 1: /* only objects outside the mask */
-                  if(flag){
-                     fits_write_col(fileOutFits, TDOUBLE, 1, firstrow+count, firstelem, 1, &(x[0]), &status);
-                     fits_write_col(fileOutFits, TDOUBLE, 2, firstrow+count, firstelem, 1, &(x[1]), &status);
-                     if(para->nz || para->zrange){
-                        z = gsl_histogram_pdf_sample (nz_PDF, gsl_ran_flat(r, 0.0, 1.0));
-                        fits_write_col(fileOutFits, TDOUBLE, 3, firstrow+count, firstelem, 1, &z, &status);
-                     }
-                     if (status){
-                        fits_report_error(stderr, status);
-                        exit(EXIT_FAILURE);
-                     }
-                     count++;
-                  }
-                  break;
-               case 2: /* only objects inside the mask */
-                  if(!flag){
-                     fits_write_col(fileOutFits, TDOUBLE, 1, firstrow+count, firstelem, 1, &(x[0]), &status);
-                     fits_write_col(fileOutFits, TDOUBLE, 2, firstrow+count, firstelem, 1, &(x[1]), &status);
-                     if(para->nz || para->zrange){
-                        z = gsl_histogram_pdf_sample (nz_PDF, gsl_ran_flat(r, 0.0, 1.0));
-                        fits_write_col(fileOutFits, TDOUBLE, 3, firstrow+count, firstelem, 1, &z, &status);
-                     }
-                     if (status) {
-                        fits_report_error(stderr, status);
-                        exit(EXIT_FAILURE);
-                     }
-                     count++;
-                  }
-                  break;
-               case 3: /* all objects with the flag */
-                  fits_write_col(fileOutFits, TDOUBLE, 1, firstrow+i, firstelem, 1, &(x[0]), &status);
-                  fits_write_col(fileOutFits, TDOUBLE, 2, firstrow+i, firstelem, 1, &(x[1]), &status);
-                  if(para->nz || para->zrange){
-                     z = gsl_histogram_pdf_sample (nz_PDF, gsl_ran_flat(r, 0.0, 1.0));
-                     fits_write_col(fileOutFits, TDOUBLE, 3, firstrow+count, firstelem, 1, &z, &status);
-                     fits_write_col(fileOutFits, TSHORT, 4, firstrow+count, firstelem, 1, &flag, &status);
-                  }else{
-                     fits_write_col(fileOutFits, TSHORT, 3, firstrow+count, firstelem, 1, &flag, &status);
-                  }
-                  if (status){
-                     fits_report_error(stderr, status);
-                     exit(EXIT_FAILURE);
-                  }
-                  count++;
-                  break;
+            insidePolygonTreeBatch(polyTree, xx, yy, n, inside, NULL);
+
+            for(k=0;k<n;k++){
+               j = i+k;
+               printCount(cells != NULL ? &Naccepted : &j,&npart,1000);
+               flag = !inside[k];
+
+               /* 1: only objects outside the mask, 2: only objects inside the mask,
+                * 3: all objects with the flag */
+               if((para->format == 1 && !flag) || (para->format == 2 && flag)) continue;
+               Naccepted++;
+               bx[m]    = xx[k];
+               by[m]    = yy[k];
+               bflag[m] = (short)flag;
+               if(para->nz || para->zrange){
+                  bz[m] = gsl_histogram_pdf_sample (nz_PDF, randomFlat(para,r,j,2,0.0,1.0));
+               }
+               if(++m == Nrows){
+                  writeColsFits(fileOutFits, Ncols, types, cols, firstrow+count, m, &status);
+                  count += m;
+                  m = 0;
+               }
+               if (status){
+                  fits_report_error(stderr, status);
+                  exit(EXIT_FAILURE);
+               }
             }
-
          }
+         writeColsFits(fileOutFits, Ncols, types, cols, firstrow+count, m, &status);
+         if (status){
+            fits_report_error(stderr, status);
+            exit(EXIT_FAILURE);
+         }
+         free(bx);
+         free(by);
+         free(bz);
+         free(bflag);
          fprintf(stderr,"\b\b\b\b100%%\n");
 
 
@@ -865,53 +1099,55 @@ int randomCat(const Config *para){
          fprintf(stderr, "Outpout file or stdout format: ascii\n");
 
          fileOut = fopenAndCheck(para->fileOutName,"w");
+         writer  = openWriter(fileOut, IOBUFFERSIZE);
 
-         fprintf(fileOut,"# %f\n", area);
+         writeBytes(writer,"# ",2);
+         writeFixed(writer,area,6);
+         writeBytes(writer,"\n",1);
 
          fprintf(stderr,"Progress =     ");
-         for(i=0;i<npart;i++){
-            printCount(&i,&npart,1000);
-            if(para->coordType == CART){
-               x[0] = gsl_ran_flat(r,xmin[0],xmax[0]);
-               x[1] = gsl_ran_flat(r,xmin[1],xmax[1]);
-            }else{
-               x[0] = gsl_ran_flat(r,xmin[0],xmax[0]);
-               x[1] = gsl_ran_flat(r,sin(xmin[1]*PI/180.0),sin(xmax[1]*PI/180.0));
-               x[1] = asin(x[1])*180.0/PI;
-            }
+         for(i=0;(cells != NULL ? Naccepted : i) < npart;i+=n){
+            /*    with -exactNpart, never more than the objects still needed */
+            n = npart - (cells != NULL ? Naccepted : i);
+            if(n > Nblock) n = Nblock;
+            randomPoints(para, r, i, n, xmin, xmax, cells, xx, yy);
             /*    1 = outside the mask, 0 = inside the mask */
-            if(flag=0,!insidePolygonTree(polyTree,x0,x,&poly_id)) flag = 1;
-            if(para->nz || para->zrange){
-               z = gsl_histogram_pdf_sample (nz_PDF, gsl_ran_flat(r, 0.0, 1.0));
-               switch (para->format){
-                  case 1: /* only objects outside the mask */
-                     if(flag) fprintf(fileOut,"%f %f %f\n",x[0],x[1],z);
-                     break;
-                  case 2: /* only objects inside the mask */
-                     if(!flag) fprintf(fileOut,"%f %f %f\n",x[0],x[1],z);
-                     break;
-                  case 3: /* all objects with the flag */
-                     fprintf(fileOut,"%f %f %d %f\n",x[0],x[1],flag,z);
-                     break;
+            insidePolygonTreeBatch(polyTree, xx, yy, n, inside, NULL);
+
+            for(k=0;k<n;k++){
+               j = i+k;
+               printCount(cells != NULL ? &Naccepted : &j,&npart,1000);
+               x[0] = xx[k];
+               x[1] = yy[k];
+               flag = !inside[k];
+               if(para->nz || para->zrange){
+                  z = gsl_histogram_pdf_sample (nz_PDF, randomFlat(para,r,j,2,0.0,1.0));
                }
-            }else{
-               switch (para->format){
-                  case 1: /* only objects outside the mask */
-                     if(flag) fprintf(fileOut,"%f %f\n",x[0],x[1]);
-                     break;
-                  case 2: /* only objects inside the mask */
-                     if(!flag) fprintf(fileOut,"%f %f\n",x[0],x[1]);
-                     break;
-                  case 3: /* all objects with the flag */
-                     fprintf(fileOut,"%f %f %d\n",x[0],x[1],flag);
-                     break;
+               /* 1: only objects outside the mask, 2: only objects inside the mask,
+                * 3: all objects with the flag */
+               if((para->format == 1 && !flag) || (para->format == 2 && flag)) continue;
+               Naccepted++;
+               writeFixed(writer,x[0],para->precision);
+               writeBytes(writer," ",1);
+               writeFixed(writer,x[1],para->precision);
+               if(para->format == 3){
+                  writeBytes(writer,flag ? " 1" : " 0",2);
+               }
+               if(para->nz || para->zrange){
+                  writeBytes(writer," ",1);
+                  writeFixed(writer,z,para->precision);
                }
+               writeBytes(writer,"\n",1);
             }
          }
          fprintf(stderr,"\b\b\b\b100%%\n");
 
       }
 
+      free(xx);
+      free(yy);
+      free(inside);
+      if(cells != NULL) free_Cells(cells);
 
    }else if(!strcmp(para->fileRegInName,"\0")){
 
@@ -968,33 +1204,55 @@ int randomCat(const Config *para){
             fits_create_tbl(fileOutFits, BINARY_TBL, 0, tfields-1, ttype, tform, tunit, "DATA", &status);
          }
 
+         /*    rows are built in memory by blocks (see writeColsFits()) */
+         long n = 0, Nrows;
+         fits_get_rowsize(fileOutFits, &Nrows, &status);
+         if(Nrows < FITSBLOCKMIN) Nrows = FITSBLOCKMIN;
+         double *bx     = (double *)malloc(Nrows*sizeof(double));
+         double *by     = (double *)malloc(Nrows*sizeof(double));
+         double *bz     = (double *)malloc(Nrows*sizeof(double));
+         void *cols[3]  = {bx, by, bz};
+         int types[3]   = {TDOUBLE, TDOUBLE, TDOUBLE};
+         int Ncols      = (para->nz || para->zrange || para->minDefined[2]) ? 3 : 2;
+         if(bx == NULL || by == NULL || bz == NULL){
+            fprintf(stderr,"%s: not enough memory for %ld rows. Exiting...\n",MYNAME,Nrows);
+            exit(EXIT_FAILURE);
+         }
+
          fprintf(stderr,"Creates a random catalogue with N = %zd objects.\n",npart);
          fprintf(stderr,"Progress =     ");
          for(i=0;i<npart;i++){
             printCount(&i,&npart,1000);
             if(para->coordType == CART){
-               x[0] = gsl_ran_flat(r,xmin[0],xmax[0]);
-               x[1] = gsl_ran_flat(r,xmin[1],xmax[1]);
+               x[0] = randomFlat(para,r,i,0,xmin[0],xmax[0]);
+               x[1] = randomFlat(para,r,i,1,xmin[1],xmax[1]);
             }else{
-               x[0] = gsl_ran_flat(r,xmin[0],xmax[0]);
-               x[1] = gsl_ran_flat(r,sin(xmin[1]*PI/180.0),sin(xmax[1]*PI/180.0));
+               x[0] = randomFlat(para,r,i,0,xmin[0],xmax[0]);
+               x[1] = randomFlat(para,r,i,1,sin(xmin[1]*PI/180.0),sin(xmax[1]*PI/180.0));
                x[1] = asin(x[1])*180.0/PI;
             }
-            fits_write_col(fileOutFits, TDOUBLE,  1, firstrow+i, firstelem, 1, &(x[0]), &status);
-            fits_write_col(fileOutFits, TDOUBLE,  2, firstrow+i, firstelem, 1, &(x[1]), &status);
+            bx[n] = x[0];
+            by[n] = x[1];
+            /*    the z coordinate takes precedence over the redshift */
             if(para->nz || para->zrange){
-               z = gsl_histogram_pdf_sample (nz_PDF, gsl_ran_flat(r, 0.0, 1.0));
-               fits_write_col(fileOutFits, TDOUBLE, 3, firstrow+i, firstelem, 1, &z, &status);
+               bz[n] = gsl_histogram_pdf_sample (nz_PDF, randomFlat(para,r,i,2,0.0,1.0));
             }
             if(para->minDefined[2]){
-               x[2] = gsl_ran_flat(r,xmin[2],xmax[2]);
-               fits_write_col(fileOutFits, TDOUBLE, 3, firstrow+i, firstelem, 1,  &(x[2]), &status);
+               bz[n] = randomFlat(para,r,i,3,xmin[2],xmax[2]);
             }
-            if (status) {
-               fits_report_error(stderr, status);
-               exit(EXIT_FAILURE);
+            if(++n == Nrows || i == npart-1){
+               writeColsFits(fileOutFits, Ncols, types, cols, firstrow, n, &status);
+               if (status) {
+                  fits_report_error(stderr, status);
+                  exit(EXIT_FAILURE);
+               }
+               firstrow += n;
+               n = 0;
             }
          }
+         free(bx);
+         free(by);
+         free(bz);
 
          fprintf(stderr,"\b\b\b\b100%%\n");
 
@@ -1003,32 +1261,37 @@ int randomCat(const Config *para){
          fprintf(stderr, "Outpout file or stdout format: ascii\n");
 
          fileOut = fopenAndCheck(para->fileOutName,"w");
+         writer  = openWriter(fileOut, IOBUFFERSIZE);
 
-         fprintf(fileOut, "# %f\n", area);
+         writeBytes(writer,"# ",2);
+         writeFixed(writer,area,6);
+         writeBytes(writer,"\n",1);
 
          fprintf(stderr,"Creates a random catalogue with N = %zd objects.\n",npart);
          fprintf(stderr,"Progress =     ");
          for(i=0;i<npart;i++){
             printCount(&i,&npart,1000);
             if(para->coordType == CART){
-               x[0] = gsl_ran_flat(r,xmin[0],xmax[0]);
-               x[1] = gsl_ran_flat(r,xmin[1],xmax[1]);
+               x[0] = randomFlat(para,r,i,0,xmin[0],xmax[0]);
+               x[1] = randomFlat(para,r,i,1,xmin[1],xmax[1]);
             }else{
-               x[0] = gsl_ran_flat(r,xmin[0],xmax[0]);
-               x[1] = gsl_ran_flat(r,sin(xmin[1]*PI/180.0),sin(xmax[1]*PI/180.0));
+               x[0] = randomFlat(para,r,i,0,xmin[0],xmax[0]);
+               x[1] = randomFlat(para,r,i,1,sin(xmin[1]*PI/180.0),sin(xmax[1]*PI/180.0));
                x[1] = asin(x[1])*180.0/PI;
             }
-            if(para->minDefined[2]){
-            }
+            writeFixed(writer,x[0],para->precision);
+            writeBytes(writer," ",1);
+            writeFixed(writer,x[1],para->precision);
             if(para->nz || para->zrange){
-               z = gsl_histogram_pdf_sample (nz_PDF, gsl_ran_flat(r, 0.0, 1.0));
-               fprintf(fileOut,"%f %f %f\n", x[0], x[1], z);
+               z = gsl_histogram_pdf_sample (nz_PDF, randomFlat(para,r,i,2,0.0,1.0));
+               writeBytes(writer," ",1);
+               writeFixed(writer,z,para->precision);
             }else if(para->minDefined[2]){
-               x[2] = gsl_ran_flat(r,xmin[2],xmax[2]);
-               fprintf(fileOut,"%f %f %f\n", x[0], x[1], x[2]);
-            }else{
-               fprintf(fileOut,"%f %f\n", x[0], x[1]);
+               x[2] = randomFlat(para,r,i,3,xmin[2],xmax[2]);
+               writeBytes(writer," ",1);
+               writeFixed(writer,x[2],para->precision);
             }
+            writeBytes(writer,"\n",1);
          }
          fflush(stdout);
          fprintf(stderr,"\b\b\b\b100%%\n");
@@ -1053,8 +1316,42 @@ int randomCat(const Config *para){
          exit(EXIT_FAILURE);
       }
    }else{
+      free_Writer(writer);
       fclose(fileOut);
    }
 
    return(EXIT_SUCCESS);
 }
+
+int areaMask(const Config *para){
+   /*    Writes the exact area of the limits, and of the parts inside
+    *    and outside the mask (see maskArea()), in deg^2 with -coord spher.
+    *    The limits are the extrema of the polygons unless set by the user.
+    */
+
+   double xmin[2], xmax[2], area, inside;
+
+   if(!checkFileExt(para->fileRegInName,".reg") && !strcmp(para->fileIndexInName,"")){
+      fprintf(stderr,"%s: -area only works with .reg masks. Exiting...\n",MYNAME);
+      exit(EXIT_FAILURE);
+   }
+
+   Tree *polyTree = readMaskTree(para,xmin,xmax);
+
+   if(para->minDefined[0]) xmin[0] = para->min[0];
+   if(para->maxDefined[0]) xmax[0] = para->max[0];
+   if(para->minDefined[1]) xmin[1] = para->min[1];
+   if(para->maxDefined[1]) xmax[1] = para->max[1];
+   fprintf(stderr,"Mask limits:\n");
+   fprintf(stderr,"-xmin %g -xmax %g -ymin %g -ymax %g\n",xmin[0],xmax[0],xmin[1],xmax[1]);
+
+   area   = rectArea(xmin[0], xmax[0], xmin[1], xmax[1], para->coordType);
+   inside = maskArea(polyTree, xmin, xmax, para->coordType);
+
+   FILE *fileOut = fopenAndCheck(para->fileOutName,"w");
+   fprintf(fileOut,"# area inside outside\n");
+   fprintf(fileOut,"%.*f %.*f %.*f\n",para->precision,area,para->precision,inside,para->precision,area - inside);
+   fclose(fileOut);
+
+   return(EXIT_SUCCESS);
+}
@@ -10,58 +10,756 @@
  *		Utils - geometric
  */
 
-int insidePolygonTree(Node *polyTree, double x0[2], double x[2], int *poly_id){
+int insidePolygonTree(Tree *polyTree, double x[2], int *poly_id){
 	/*		Returns 1 if the point (x,y) is inside one of the polygons in
 	 *		polys. Returns 0 if the object is oustide of any polygon or outside the
-	 *		mask limits. See insidePolygon() for the algorithm explanations.
+	 *		mask limits. If the tree holds a grid (see createGrid()), most points
+	 *		are answered by a single cell lookup and only points in boundary cells
+	 *		are tested against the cell candidates. Otherwise, or if the cell has
+	 *		more than leafSize candidates (clustered masks), the tree is walked
+	 *		down to the leaf and the shorter of the two lists is used.
+	 *		See crossingNumberOdd() for the algorithm explanations.
 	 */
 
-	int i,j,k,Ncross,result;
-	double s,t,D;
+	int b;
+	size_t Nids = 0;
+	const int *ids = NULL;
+	Grid *grid = polyTree->grid;
+	Node *node;
+
+	if(grid != NULL){
+		b = gridLookup(grid, x[0], x[1]);
+		if(b >= 0){
+			*poly_id = b;
+			return 1;
+		}
+		if(b == GRID_OUTSIDE){
+			*poly_id = -1;
+			return 0;
+		}
+		b    = -2 - b;
+		ids  = grid->ids + grid->start[b];
+		Nids = grid->start[b+1] - grid->start[b];
+		if(Nids <= polyTree->leafSize) return insidePolygonList(polyTree->polys, ids, Nids, x, poly_id);
+	}
 
-	if(polyTree->Npolys == 0){
-		*poly_id = -1;
-		return 0;
+	node = findLeaf(polyTree, x);
+
+	if(grid != NULL && Nids < node->Npolys) return insidePolygonList(polyTree->polys, ids, Nids, x, poly_id);
+
+	return insidePolygonList(polyTree->polys, polyTree->ids + node->start, node->Npolys, x, poly_id);
+}
+
+Node *findLeaf(const Tree *polyTree, const double x[2]){
+	/*		Walks the tree down to the leaf containing the point (x,y).
+	 */
+
+	Node *node = polyTree->nodes;
+
+	while(node->type != LEAF){
+		node = polyTree->nodes + node->Left + (x[node->SplitDim] < node->SplitValue ? 0 : 1);
 	}
 
-	if(polyTree->type != LEAF){
-		if(x[polyTree->SplitDim] < polyTree->SplitValue){
-			result = insidePolygonTree(polyTree->Left,  x0, x, poly_id);
-		}else{
-			result = insidePolygonTree(polyTree->Right, x0, x, poly_id);
+	return node;
+}
+
+int insidePolygonList(Polygon *polys, const int *ids, size_t N, double x[2], int *poly_id){
+	/*		Returns 1 if the point (x,y) is inside one of the N polygons
+	 *		listed in ids, and the id of the first one found in poly_id
+	 *		(-1 if outside).
+	 */
+
+	size_t k;
+	int i;
+
+	for(k=0;k<N;k++){
+		i = ids[k];
+		if(BBOX_MIN(polys,i,0) < x[0] && x[0] < BBOX_MAX(polys,i,0) && BBOX_MIN(polys,i,1) < x[1] && x[1] < BBOX_MAX(polys,i,1)){
+			/* the object is inside the square around the polygon */
+			if(insideRegion(polys, i, x[0], x[1])){
+				*poly_id = i;
+				return 1;
+			}
 		}
-	}else{
-		Polygon *polys = (Polygon *)polyTree->polysAll;
-		for(k=0;k<polyTree->Npolys;k++){
-			i = polyTree->poly_id[k];
-			if(polys[i].xmin[0] < x[0] && x[0] < polys[i].xmax[0] && polys[i].xmin[1] < x[1] && x[1] < polys[i].xmax[1]){
-				/* the object is inside the square around the polygon */
-				Ncross=0;
-				for(j=0;j<polys[i].N;j++){
-					if(j<polys[i].N-1){
-						D = (polys[i].x[j+1]-polys[i].x[j])*(x[1]-x0[1])-(polys[i].y[j+1]-polys[i].y[j])*(x[0]-x0[0]);
-						s = ((x[0]-x0[0])*(polys[i].y[j]-x[1])-(x[1]-x0[1])*(polys[i].x[j]-x[0]))/D;
-						t = ((polys[i].x[j]-x[0])*(polys[i].y[j+1]-polys[i].y[j])-(polys[i].y[j]-x[1])*(polys[i].x[j+1]-polys[i].x[j]))/D;
-					}else{
-						D = (polys[i].x[0]-polys[i].x[j])*(x[1]-x0[1])-(polys[i].y[0]-polys[i].y[j])*(x[0]-x0[0]);
-						s = ((x[0]-x0[0])*(polys[i].y[j]-x[1])-(x[1]-x0[1])*(polys[i].x[j]-x[0]))/D;
-						t = ((polys[i].x[j]-x[0])*(polys[i].y[0]-polys[i].y[j])-(polys[i].y[j]-x[1])*(polys[i].x[0]-polys[i].x[j]))/D;
+	}
+
+	*poly_id = -1;
+	return 0;
+}
+
+void insidePolygonTreeBatch(Tree *polyTree, const double *x, const double *y, size_t N, int *inside, int *poly_id){
+	/*		Batch version of insidePolygonTree(): for the N points (x[i],y[i]),
+	 *		sets inside[i] to 1 if the point is inside one of the polygons
+	 *		and 0 otherwise. If poly_id is not NULL, it receives the id of
+	 *		the polygon (-1 if outside).
+	 *		Points are processed in chunks of NBATCH (small enough to stay in
+	 *		cache). In each chunk, points fully inside or outside a grid cell
+	 *		are answered directly. The other points are grouped by boundary
+	 *		cell (or by leaf if there is no grid or if the leaf has fewer
+	 *		candidates than a crowded cell), then each candidate polygon
+	 *		of a group is tested against all remaining points of that group
+	 *		lying inside its bounding box with insideRegionKernel(),
+	 *		vectorised across points. As in insidePolygonTree(), the first
+	 *		candidate polygon containing the point is returned.
+	 *		With OpenMP, chunks are shared among threads (the tree is
+	 *		only read), each thread with its own work arrays.
+	 */
+
+	size_t Ngroups, leafGroup;
+	long chunk, Nchunks;
+	Grid *grid = polyTree->grid;
+
+	if(N == 0) return;
+
+	/* 	single point: no need for work arrays */
+	if(N == 1){
+		double xx[2] = {x[0], y[0]};
+		int id;
+		inside[0] = insidePolygonTree(polyTree, xx, &id);
+		if(poly_id != NULL) poly_id[0] = id;
+		return;
+	}
+
+	Polygon *polys = polyTree->polys;
+	leafGroup      = (grid != NULL) ? grid->Nboundary : 0;
+	Ngroups        = leafGroup + polyTree->Nnodes;
+	Nchunks        = (long)((N + NBATCH - 1)/NBATCH);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		size_t i, j, k, t, m, n, start, pos, Npending, Nsort, Ntouched, Nids;
+		int b, p;
+		double xx[2];
+		const int *ids;
+		Node *node;
+
+		size_t *group     = (size_t *)malloc(NBATCH*sizeof(size_t));
+		size_t *touched   = (size_t *)malloc(NBATCH*sizeof(size_t));
+		size_t *begin     = (size_t *)malloc((NBATCH+1)*sizeof(size_t));
+		size_t *Nlist     = (size_t *)malloc(NBATCH*sizeof(size_t));
+		const int **list  = (const int **)malloc(NBATCH*sizeof(const int *));
+		size_t *count     = (size_t *)calloc(Ngroups+1, sizeof(size_t));
+		size_t *order     = (size_t *)malloc(NBATCH*sizeof(size_t));
+		size_t *pending   = (size_t *)malloc(NBATCH*sizeof(size_t));
+		size_t *sel       = (size_t *)malloc(NBATCH*sizeof(size_t));
+		double *xgroup    = (double *)malloc(NBATCH*sizeof(double));
+		double *ygroup    = (double *)malloc(NBATCH*sizeof(double));
+		double *xsel      = (double *)malloc(NBATCH*sizeof(double));
+		double *ysel      = (double *)malloc(NBATCH*sizeof(double));
+		int *odd          = (int *)malloc(NBATCH*sizeof(int));
+		int *found        = (int *)malloc(NBATCH*sizeof(int));
+
+		if(group == NULL || touched == NULL || begin == NULL || Nlist == NULL || list == NULL || count == NULL || order == NULL
+			|| pending == NULL || sel == NULL || xgroup == NULL || ygroup == NULL || xsel == NULL || ysel == NULL || odd == NULL || found == NULL){
+			fprintf(stderr,"%s: not enough memory to flag points. Exiting...\n",MYNAME);
+			exit(EXIT_FAILURE);
+		}
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for(chunk=0;chunk<Nchunks;chunk++){
+			start = (size_t)chunk*NBATCH;
+			n     = (N - start < NBATCH) ? N - start : NBATCH;
+
+			/* 	answer points from the grid when possible, otherwise
+			 * 	find their group (boundary cell or leaf) and count points per group */
+			Ntouched = 0;
+			for(i=0;i<n;i++){
+				xx[0]    = x[start+i];
+				xx[1]    = y[start+i];
+				group[i] = Ngroups;
+				Nids     = 0;
+				if(grid != NULL){
+					b = gridLookup(grid, xx[0], xx[1]);
+					if(b >= 0){
+						inside[start+i] = 1;
+						if(poly_id != NULL) poly_id[start+i] = b;
+						continue;
+					}
+					if(b != GRID_OUTSIDE){
+						k    = (size_t)(-2 - b);
+						ids  = grid->ids + grid->start[k];
+						Nids = grid->start[k+1] - grid->start[k];
+						/* 	long candidate list: use the leaf if shorter */
+						if(Nids > polyTree->leafSize){
+							node = findLeaf(polyTree, xx);
+							if(node->Npolys < Nids){
+								k    = leafGroup + (size_t)(node - polyTree->nodes);
+								ids  = polyTree->ids + node->start;
+								Nids = node->Npolys;
+							}
+						}
+					}
+				}else{
+					node = findLeaf(polyTree, xx);
+					k    = (size_t)(node - polyTree->nodes);
+					ids  = polyTree->ids + node->start;
+					Nids = node->Npolys;
+				}
+				if(Nids > 0){
+					if(count[k]++ == 0){
+						list[Ntouched]  = ids;
+						Nlist[Ntouched] = Nids;
+						touched[Ntouched++] = k;
 					}
-					if(0.0 < s && s < 1.0 + EPS && 0.0 < t && t < 1.0 + EPS) Ncross++;
+					group[i] = k;
 				}
-				if(GSL_IS_ODD(Ncross)){
-					*poly_id = i;
-					return 1;
+				if(group[i] == Ngroups){
+					inside[start+i] = 0;
+					if(poly_id != NULL) poly_id[start+i] = -1;
 				}
 			}
+
+			/* 	sort the remaining points by group (counting sort over the groups touched only) */
+			pos = 0;
+			for(t=0;t<Ntouched;t++){
+				begin[t]           = pos;
+				pos               += count[touched[t]];
+				count[touched[t]]  = begin[t];
+			}
+			begin[Ntouched] = Nsort = pos;
+			for(i=0;i<n;i++){
+				if(group[i] == Ngroups) continue;
+				j         = count[group[i]]++;
+				order[j]  = i;
+				xgroup[j] = x[start+i];
+				ygroup[j] = y[start+i];
+				found[j]  = -1;
+			}
+			for(t=0;t<Ntouched;t++) count[touched[t]] = 0;
+
+			/* 	loop over groups of points sharing the same candidate list */
+			for(t=0;t<Ntouched;t++){
+
+				Npending = 0;
+				for(j=begin[t];j<begin[t+1];j++) pending[Npending++] = j;
+
+				for(k=0;k<Nlist[t] && Npending > 0;k++){
+					p = list[t][k];
+
+					/* 	select the remaining points inside the square around the polygon */
+					m = 0;
+					for(i=0;i<Npending;i++){
+						j = pending[i];
+						if(BBOX_MIN(polys,p,0) < xgroup[j] && xgroup[j] < BBOX_MAX(polys,p,0) && BBOX_MIN(polys,p,1) < ygroup[j] && ygroup[j] < BBOX_MAX(polys,p,1)){
+							sel[m]  = j;
+							xsel[m] = xgroup[j];
+							ysel[m] = ygroup[j];
+							m++;
+						}
+					}
+					if(m == 0) continue;
+
+					insideRegionKernel(polys, p, xsel, ysel, m, odd);
+
+					for(i=0;i<m;i++){
+						if(odd[i]) found[sel[i]] = p;
+					}
+
+					/* 	remove points found inside */
+					m = 0;
+					for(i=0;i<Npending;i++){
+						if(found[pending[i]] < 0) pending[m++] = pending[i];
+					}
+					Npending = m;
+				}
+			}
+
+			for(j=0;j<Nsort;j++){
+				inside[start+order[j]] = found[j] >= 0;
+				if(poly_id != NULL) poly_id[start+order[j]] = found[j];
+			}
+		}
+
+		free(group);
+		free(touched);
+		free(begin);
+		free(Nlist);
+		free(list);
+		free(count);
+		free(order);
+		free(pending);
+		free(sel);
+		free(xgroup);
+		free(ygroup);
+		free(xsel);
+		free(ysel);
+		free(odd);
+		free(found);
+
+	}
+
+	return;
+}
+
+int insideRegion(const Polygon *polys, int i, double x, double y){
+	/*		Returns 1 if the point (x,y) is inside the region i. Polygons
+	 *		use the crossing number test (see crossingNumberOdd(), or
+	 *		crossingNumberSlab() for polygons with many vertices), circles,
+	 *		ellipses and boxes are tested exactly from their parameters
+	 *		(see setPrimitive()).
+	 */
+
+	const double *p = polys->param + NPARAM*i;
+	double dx, dy, u, v, sin_dra, sin_ddec;
+
+	switch(polys->type[i]){
+		case REG_CIRCLE:
+			dx = x - p[0];
+			dy = y - p[1];
+			return (dx*dx + dy*dy)*p[6] < 1.0;
+		case REG_ELLIPSE:
+			dx = x - p[0];
+			dy = y - p[1];
+			u  = dx*p[4] + dy*p[5];
+			v  = dy*p[4] - dx*p[5];
+			return u*u*p[6] + v*v*p[7] < 1.0;
+		case REG_BOX:
+			return BBOX_MIN(polys,i,0) < x && x < BBOX_MAX(polys,i,0) && BBOX_MIN(polys,i,1) < y && y < BBOX_MAX(polys,i,1);
+		case REG_CIRCLE_SPHER:
+			/* 	angular distance (see distAngSpher()) */
+			sin_dra  = sin((x - p[0])*PI/180.0/2.0);
+			sin_ddec = sin((y - p[1])*PI/180.0/2.0);
+			return sin_ddec*sin_ddec + cos(y*PI/180.0)*p[4]*sin_dra*sin_dra < p[6];
+		case REG_ELLIPSE_SPHER:
+			/* 	local coordinates: distance along the parallel and dec offset */
+			dx = 2.0*asin(sin((x - p[0])*PI/180.0/2.0)*cos(y*PI/180.0))*180.0/PI;
+			dy = y - p[1];
+			u  = dx*p[4] + dy*p[5];
+			v  = dy*p[4] - dx*p[5];
+			return u*u*p[6] + v*v*p[7] < 1.0;
+		default:
+			if(polys->slab != NULL && polys->slab[i+1] > polys->slab[i]) return crossingNumberSlab(polys, i, x, y);
+			return crossingNumberOdd(polys->x + polys->start[i], polys->y + polys->start[i], polys->N[i], x, y);
+	}
+}
+
+void insideRegionKernel(const Polygon *polys, int i, const double *x, const double *y, size_t N, int *odd){
+	/*		Batch version of insideRegion() for N points. */
+
+	size_t k;
+	const double *p = polys->param + NPARAM*i;
+	double dx, dy;
+
+	switch(polys->type[i]){
+		case REG_POLYGON:
+			if(polys->slab != NULL && polys->slab[i+1] > polys->slab[i]){
+				/* 	only a few edges per point, see crossingNumberSlab() */
+				for(k=0;k<N;k++) odd[k] = crossingNumberSlab(polys, i, x[k], y[k]);
+				break;
+			}
+			insidePolygonKernel(polys->x + polys->start[i], polys->y + polys->start[i], polys->N[i], x, y, N, odd);
+			break;
+		case REG_CIRCLE:
+			for(k=0;k<N;k++){
+				dx     = x[k] - p[0];
+				dy     = y[k] - p[1];
+				odd[k] = (dx*dx + dy*dy)*p[6] < 1.0;
+			}
+			break;
+		default:
+			for(k=0;k<N;k++) odd[k] = insideRegion(polys, i, x[k], y[k]);
+			break;
+	}
+}
+
+void setPrimitive(Polygon *polys, size_t i, int type, double x0, double y0, double rx, double ry, double angle){
+	/*		Sets region i as a circle, an ellipse or an axis-aligned box
+	 *		centered on (x0,y0), with radii rx, ry (full sizes for a box) and
+	 *		position angle angle (radians), and computes its bounding box.
+	 *		Parameters: x0, y0, rx, ry, cos(angle), sin(angle), 1/rx^2, 1/ry^2.
+	 *		For spherical circles: x0, y0, r, r, cos(y0), 0, sin^2(r/2), 0.
+	 *		On the sphere the angle goes the other way (RA increases to
+	 *		the East), hence the sign of sin(angle).
+	 */
+
+	double *p = polys->param + NPARAM*i;
+	double wx, wy, decMax, s;
+
+	polys->type[i] = type;
+	polys->N[i]    = 0;
+
+	p[0] = x0;
+	p[1] = y0;
+	p[2] = rx;
+	p[3] = ry;
+	p[4] = cos(angle);
+	p[5] = (type == REG_ELLIPSE_SPHER) ? -sin(angle) : sin(angle);
+	p[6] = 1.0/(rx*rx);
+	p[7] = 1.0/(ry*ry);
+
+	switch(type){
+		case REG_BOX:
+			wx = rx/2.0;
+			wy = ry/2.0;
+			break;
+		case REG_CIRCLE_SPHER:
+			p[4] = cos(y0*PI/180.0);
+			p[5] = 0.0;
+			p[6] = SQUARE(sin(rx*PI/180.0/2.0));
+			p[7] = 0.0;
+			wy   = rx;
+			/* 	maximum RA extent of the cap */
+			if(fabs(y0) + rx < 90.0) wx = asin(sin(rx*PI/180.0)/cos(y0*PI/180.0))*180.0/PI;
+			else wx = 180.0;
+			break;
+		default:
+			wx = sqrt(SQUARE(rx*p[4]) + SQUARE(ry*p[5]));
+			wy = sqrt(SQUARE(rx*p[5]) + SQUARE(ry*p[4]));
+			if(type == REG_ELLIPSE_SPHER){
+				/* 	the RA extent is largest at the highest |dec| */
+				decMax = MAX(fabs(y0 - wy), fabs(y0 + wy));
+				s      = (decMax < 90.0) ? sin(wx*PI/180.0/2.0)/cos(decMax*PI/180.0) : 2.0;
+				wx     = (s < 1.0) ? 2.0*asin(s)*180.0/PI : 180.0;
+			}
+			break;
+	}
+
+	BBOX_MIN(polys,i,0) = x0 - wx;
+	BBOX_MAX(polys,i,0) = x0 + wx;
+	BBOX_MIN(polys,i,1) = y0 - wy;
+	BBOX_MAX(polys,i,1) = y0 + wy;
+}
+
+int classifyCell(const Polygon *polys, int i, const double xmin[2], const double xmax[2]){
+	/*		Returns 1 if the cell [xmin,xmax] is fully inside the (primitive)
+	 *		region i, 0 if it is fully outside and -1 if the region boundary
+	 *		may cross it. Used by createGrid(). The answer is exact for
+	 *		boxes, circles and ellipses and conservative on the sphere.
+	 */
+
+	const double *p = polys->param + NPARAM*i;
+	double dx[2], dy[2], s[2], cdec[2], a, b, ddec, h, hmin, hmax, xi;
+	int k, l;
+
+	switch(polys->type[i]){
+		case REG_BOX:
+			if(BBOX_MIN(polys,i,0) < xmin[0] && xmax[0] < BBOX_MAX(polys,i,0) && BBOX_MIN(polys,i,1) < xmin[1] && xmax[1] < BBOX_MAX(polys,i,1)) return 1;
+			if(xmax[0] < BBOX_MIN(polys,i,0) || BBOX_MAX(polys,i,0) < xmin[0] || xmax[1] < BBOX_MIN(polys,i,1) || BBOX_MAX(polys,i,1) < xmin[1]) return 0;
+			return -1;
+		case REG_CIRCLE_SPHER:
+			/* 	largest distance: at a corner, unless the cell contains the antipode meridian */
+			hmax = 0.0;
+			for(k=0;k<2;k++){
+				for(l=0;l<2;l++){
+					h    = SQUARE(sin((xmin[1]+l*(xmax[1]-xmin[1]) - p[1])*PI/180.0/2.0))
+						+ cos((xmin[1]+l*(xmax[1]-xmin[1]))*PI/180.0)*p[4]*SQUARE(sin((xmin[0]+k*(xmax[0]-xmin[0]) - p[0])*PI/180.0/2.0));
+					hmax = MAX(hmax, h);
+				}
+			}
+			if(hmax < p[6]*(1.0 - 1.0e-9) && !(xmin[0] <= p[0] + 180.0 && p[0] + 180.0 <= xmax[0]) && !(xmin[0] <= p[0] - 180.0 && p[0] - 180.0 <= xmax[0])) return 1;
+
+			/* 	smallest distance: on the parallels, at the RA closest to the center;
+			 * 	on the meridians, at the dec of closest approach or at an end */
+			if(xmin[0] <= p[0] && p[0] <= xmax[0] && xmin[1] <= p[1] && p[1] <= xmax[1]) return -1;
+			a    = MIN(MAX(p[0], xmin[0]), xmax[0]);
+			hmin = 1.0;
+			for(l=0;l<2;l++){
+				ddec = (l ? xmax[1] : xmin[1]);
+				h    = SQUARE(sin((ddec - p[1])*PI/180.0/2.0)) + cos(ddec*PI/180.0)*p[4]*SQUARE(sin((a - p[0])*PI/180.0/2.0));
+				hmin = MIN(hmin, h);
+			}
+			for(k=0;k<2;k++){
+				a    = (k ? xmax[0] : xmin[0]);
+				b    = atan2(sin(p[1]*PI/180.0), p[4]*cos((a - p[0])*PI/180.0))*180.0/PI;
+				ddec = MIN(MAX(b, xmin[1]), xmax[1]);
+				h    = SQUARE(sin((ddec - p[1])*PI/180.0/2.0)) + cos(ddec*PI/180.0)*p[4]*SQUARE(sin((a - p[0])*PI/180.0/2.0));
+				hmin = MIN(hmin, h);
+			}
+			if(hmin > p[6]*(1.0 + 1.0e-9)) return 0;
+			return -1;
+		case REG_ELLIPSE_SPHER:
+			/* 	rectangle enclosing the cell in local coordinates */
+			s[0]    = sin((xmin[0] - p[0])*PI/180.0/2.0);
+			s[1]    = sin((xmax[0] - p[0])*PI/180.0/2.0);
+			cdec[0] = MIN(cos(xmin[1]*PI/180.0), cos(xmax[1]*PI/180.0));
+			cdec[1] = (xmin[1] <= 0.0 && 0.0 <= xmax[1]) ? 1.0 : MAX(cos(xmin[1]*PI/180.0), cos(xmax[1]*PI/180.0));
+			dx[0]   = dx[1] = 2.0*asin(s[0]*cdec[0])*180.0/PI;
+			for(k=0;k<2;k++){
+				for(l=0;l<2;l++){
+					xi    = 2.0*asin(s[k]*cdec[l])*180.0/PI;
+					dx[0] = MIN(dx[0], xi);
+					dx[1] = MAX(dx[1], xi);
+				}
+			}
+			dy[0] = xmin[1] - p[1];
+			dy[1] = xmax[1] - p[1];
+			return classifyEllipseRect(p, dx, dy);
+		default:
+			/* 	REG_CIRCLE and REG_ELLIPSE */
+			dx[0] = xmin[0] - p[0];
+			dx[1] = xmax[0] - p[0];
+			dy[0] = xmin[1] - p[1];
+			dy[1] = xmax[1] - p[1];
+			return classifyEllipseRect(p, dx, dy);
+	}
+}
+
+int classifyEllipseRect(const double *p, const double dx[2], const double dy[2]){
+	/*		Same as classifyCell() for the rectangle [dx[0],dx[1]] x [dy[0],dy[1]]
+	 *		(relative to the center) and the ellipse with parameters p. In the
+	 *		frame where the ellipse is the unit circle, the rectangle is a
+	 *		parallelogram: it is inside if its 4 corners are inside (the
+	 *		ellipse is convex) and outside if its distance to the center is
+	 *		larger than 1.
+	 */
+
+	double u[4], v[4], d2, d2min, t, eu, ev, cross;
+	int k, l, inside = 1, sign = 0;
+
+	for(k=0;k<4;k++){
+		/* 	corners in order: (0,0), (1,0), (1,1), (0,1) */
+		double x = dx[(k == 1 || k == 2)];
+		double y = dy[(k >= 2)];
+		u[k] = (x*p[4] + y*p[5])/p[2];
+		v[k] = (y*p[4] - x*p[5])/p[3];
+		if(u[k]*u[k] + v[k]*v[k] >= 1.0 - 1.0e-9) inside = 0;
+	}
+	if(inside) return 1;
+
+	d2min = 1.0e300;
+	for(k=0;k<4;k++){
+		l  = (k+1)%4;
+		eu = u[l] - u[k];
+		ev = v[l] - v[k];
+		/* 	is the center on the same side of all edges? */
+		cross = eu*(-v[k]) - ev*(-u[k]);
+		if(cross != 0.0){
+			if(sign == 0) sign = (cross > 0.0) ? 1 : -1;
+			else if((cross > 0.0) != (sign > 0)) sign = 2;
+		}
+		/* 	distance to the edge */
+		d2 = eu*eu + ev*ev;
+		t  = (d2 > 0.0) ? -(u[k]*eu + v[k]*ev)/d2 : 0.0;
+		t  = MIN(MAX(t, 0.0), 1.0);
+		d2 = SQUARE(u[k] + t*eu) + SQUARE(v[k] + t*ev);
+		d2min = MIN(d2min, d2);
+	}
+	if(sign != 2) return -1;   /* the center is inside the cell */
+	if(d2min > 1.0 + 1.0e-9) return 0;
+
+	return -1;
+}
+
+int crossingNumberOdd(const double *px, const double *py, int n, double x, double y){
+	/*		Returns 1 if (x,y) is inside the polygon with the n vertices
+	 *		(px,py). Counts how many edges are crossed by the half-line
+	 *		starting at (x,y) towards +x: the point is inside if the number
+	 *		is odd (Press et al 2007, Numerical recipes in c++).
+	 *		The edge (i,j) is crossed if y lies between py[i] and py[j] and
+	 *		x is on the left of the edge, i.e. (x-px[i])*(py[j]-py[i]) <
+	 *		(px[j]-px[i])*(y-py[i]) if py[j] > py[i] (reversed otherwise),
+	 *		so that no division is needed. The loop starts with the closing
+	 *		edge (n-1,0) to avoid a branch.
+	 */
+
+	int i, j, result = 0;
+	double d;
+
+	for(i=n-1,j=0;j<n;i=j++){
+		if((py[i] > y) != (py[j] > y)){
+			d = (px[j]-px[i])*(y-py[i]) - (x-px[i])*(py[j]-py[i]);
+			if((d > 0.0) == (py[j] > py[i])) result ^= 1;
 		}
-		*poly_id = -1;
-		return 0;
 	}
 
 	return result;
 }
 
+int crossingNumberSlab(const Polygon *polys, int i, double x, double y){
+	/*		Same as crossingNumberOdd() for polygon i, but only the edges
+	 *		of the horizontal slab containing y are tested (see
+	 *		createEdgeIndex()): the other edges cannot be crossed.
+	 */
+
+	size_t k, s = polys->slab[i] + slabIndex(polys->param + NPARAM*i, polys->slab[i+1] - polys->slab[i], y);
+	int e, j, n = polys->N[i], result = 0;
+	const double *px = polys->x + polys->start[i];
+	const double *py = polys->y + polys->start[i];
+	double d;
+
+	for(k=polys->slabStart[s];k<polys->slabStart[s+1];k++){
+		j = polys->slabEdges[k];
+		e = (j == 0) ? n-1 : j-1;
+		if((py[e] > y) != (py[j] > y)){
+			d = (px[j]-px[e])*(y-py[e]) - (x-px[e])*(py[j]-py[e]);
+			if((d > 0.0) == (py[j] > py[e])) result ^= 1;
+		}
+	}
+
+	return result;
+}
+
+size_t slabIndex(const double *p, size_t Nslabs, double y){
+	/*		Returns the slab containing y, for a polygon with parameters
+	 *		p = {ymin, Nslabs/(ymax-ymin)} (see createEdgeIndex()). Values
+	 *		outside [ymin, ymax] go to the first or last slab.
+	 */
+	double t = (y - p[0])*p[1];
+	if(!(t > 0.0)) return 0;
+	if(t >= (double)Nslabs) return Nslabs-1;
+	return (size_t)t;
+}
+
+void createEdgeIndex(Polygon *polys){
+	/*		Splits each polygon with EDGESLABMIN vertices or more into
+	 *		horizontal slabs of equal height, with about SLABEDGES edges
+	 *		per slab, and lists the edges overlapping each slab, so that
+	 *		the crossing number test of a point only reads the edges of
+	 *		its slab. The slabs of polygon i are slab[i], ..., slab[i+1]-1
+	 *		and the edges of slab s are slabEdges[slabStart[s]], ...,
+	 *		slabEdges[slabStart[s+1]-1], with edge j going from vertex
+	 *		j-1 (n-1 for j=0) to vertex j. Slab parameters are stored in
+	 *		param[NPARAM*i] = {ymin, Nslabs/(ymax-ymin)}.
+	 *		Edges are assigned with slabIndex(), as the points are, so the
+	 *		result is exactly the same as with crossingNumberOdd().
+	 *		An edge is copied into every slab it spans, so polygons whose
+	 *		index would hold more than SLABEDGESMAX*n edges (e.g. zigzags,
+	 *		where the index grows as n^2) get no index and keep the plain
+	 *		crossingNumberOdd() loop.
+	 */
+
+	size_t i, s, k0, k1, Nslabs, NslabEdges, Ncopies, *fill;
+	int j, e, n;
+	double *p, *py, ymin, ymax;
+
+	polys->slab = (size_t *)malloc((polys->Npolys+1)*sizeof(size_t));
+	if(polys->slab == NULL){
+		fprintf(stderr,"%s: not enough memory for the polygon edge index. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+
+	/* 	count slabs and edges */
+	Nslabs     = 0;
+	NslabEdges = 0;
+	for(i=0;i<polys->Npolys;i++){
+		polys->slab[i] = Nslabs;
+		n = polys->N[i];
+		if(polys->type[i] != REG_POLYGON || n < EDGESLABMIN) continue;
+		p    = polys->param + NPARAM*i;
+		py   = polys->y + polys->start[i];
+		p[0] = BBOX_MIN(polys,i,1);
+		p[1] = BBOX_MAX(polys,i,1) > p[0] ? (double)(n/SLABEDGES)/(BBOX_MAX(polys,i,1) - p[0]) : 0.0;
+		Ncopies = 0;
+		for(j=0;j<n;j++){
+			e    = (j == 0) ? n-1 : j-1;
+			ymin = MIN(py[e], py[j]);
+			ymax = MAX(py[e], py[j]);
+			Ncopies += slabIndex(p, n/SLABEDGES, ymax) - slabIndex(p, n/SLABEDGES, ymin) + 1;
+		}
+		if(Ncopies > SLABEDGESMAX*(size_t)n) continue;
+		Nslabs     += n/SLABEDGES;
+		NslabEdges += Ncopies;
+	}
+	polys->slab[polys->Npolys] = Nslabs;
+	polys->Nslabs              = Nslabs;
+	polys->NslabEdges          = NslabEdges;
+
+	polys->slabStart = (size_t *)calloc(Nslabs+1, sizeof(size_t));
+	polys->slabEdges = (int *)malloc((NslabEdges+1)*sizeof(int));
+	fill             = (size_t *)malloc((Nslabs+1)*sizeof(size_t));
+	if(polys->slabStart == NULL || polys->slabEdges == NULL || fill == NULL){
+		fprintf(stderr,"%s: not enough memory for the polygon edge index. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+	if(Nslabs == 0){
+		free(fill);
+		return;
+	}
+
+	/* 	number of edges per slab, then edge lists */
+	for(i=0;i<polys->Npolys;i++){
+		if(polys->slab[i+1] == polys->slab[i]) continue;
+		n  = polys->N[i];
+		p  = polys->param + NPARAM*i;
+		py = polys->y + polys->start[i];
+		for(j=0;j<n;j++){
+			e  = (j == 0) ? n-1 : j-1;
+			ymin = MIN(py[e], py[j]);
+			ymax = MAX(py[e], py[j]);
+			k0 = slabIndex(p, polys->slab[i+1] - polys->slab[i], ymin);
+			k1 = slabIndex(p, polys->slab[i+1] - polys->slab[i], ymax);
+			for(s=polys->slab[i]+k0;s<=polys->slab[i]+k1;s++) polys->slabStart[s+1]++;
+		}
+	}
+	for(s=0;s<Nslabs;s++){
+		polys->slabStart[s+1] += polys->slabStart[s];
+		fill[s] = polys->slabStart[s];
+	}
+	for(i=0;i<polys->Npolys;i++){
+		if(polys->slab[i+1] == polys->slab[i]) continue;
+		n  = polys->N[i];
+		p  = polys->param + NPARAM*i;
+		py = polys->y + polys->start[i];
+		for(j=0;j<n;j++){
+			e  = (j == 0) ? n-1 : j-1;
+			ymin = MIN(py[e], py[j]);
+			ymax = MAX(py[e], py[j]);
+			k0 = slabIndex(p, polys->slab[i+1] - polys->slab[i], ymin);
+			k1 = slabIndex(p, polys->slab[i+1] - polys->slab[i], ymax);
+			for(s=polys->slab[i]+k0;s<=polys->slab[i]+k1;s++) polys->slabEdges[fill[s]++] = j;
+		}
+	}
+
+	free(fill);
+
+	return;
+}
+
+void insidePolygonKernel(const double *px, const double *py, int n, const double *x, const double *y, size_t N, int *odd){
+	/*		Crossing number test of N points against a single polygon
+	 *		(see crossingNumberOdd()), vectorised across points with
+	 *		AVX-512 or AVX2 when available. odd[i] is set to 1 if
+	 *		(x[i],y[i]) is inside the polygon and 0 otherwise.
+	 */
+
+	size_t k = 0;
+	int i, j;
+
+#if defined(__AVX512F__)
+	__m512d zero = _mm512_setzero_pd();
+	for(;k+8<=N;k+=8){
+		__m512d X = _mm512_loadu_pd(x+k);
+		__m512d Y = _mm512_loadu_pd(y+k);
+		__mmask8 acc = 0;
+		for(i=n-1,j=0;j<n;i=j++){
+			__m512d xi = _mm512_set1_pd(px[i]), yi = _mm512_set1_pd(py[i]);
+			__mmask8 straddle = _mm512_cmp_pd_mask(yi, Y, _CMP_GT_OQ) ^ _mm512_cmp_pd_mask(_mm512_set1_pd(py[j]), Y, _CMP_GT_OQ);
+			__m512d d = _mm512_sub_pd(_mm512_mul_pd(_mm512_set1_pd(px[j]-px[i]), _mm512_sub_pd(Y, yi)), _mm512_mul_pd(_mm512_sub_pd(X, xi), _mm512_set1_pd(py[j]-py[i])));
+			__mmask8 left = (py[j] > py[i]) ? _mm512_cmp_pd_mask(d, zero, _CMP_GT_OQ) : _mm512_cmp_pd_mask(d, zero, _CMP_LE_OQ);
+			acc ^= straddle & left;
+		}
+		for(i=0;i<8;i++) odd[k+i] = (acc >> i) & 1;
+	}
+#elif defined(__AVX2__)
+	__m256d zero = _mm256_setzero_pd();
+	for(;k+4<=N;k+=4){
+		__m256d X = _mm256_loadu_pd(x+k);
+		__m256d Y = _mm256_loadu_pd(y+k);
+		__m256d acc = _mm256_setzero_pd();
+		for(i=n-1,j=0;j<n;i=j++){
+			__m256d xi = _mm256_set1_pd(px[i]), yi = _mm256_set1_pd(py[i]);
+			__m256d straddle = _mm256_xor_pd(_mm256_cmp_pd(yi, Y, _CMP_GT_OQ), _mm256_cmp_pd(_mm256_set1_pd(py[j]), Y, _CMP_GT_OQ));
+			__m256d d = _mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(px[j]-px[i]), _mm256_sub_pd(Y, yi)), _mm256_mul_pd(_mm256_sub_pd(X, xi), _mm256_set1_pd(py[j]-py[i])));
+			__m256d left = (py[j] > py[i]) ? _mm256_cmp_pd(d, zero, _CMP_GT_OQ) : _mm256_cmp_pd(d, zero, _CMP_LE_OQ);
+			acc = _mm256_xor_pd(acc, _mm256_and_pd(straddle, left));
+		}
+		int mask = _mm256_movemask_pd(acc);
+		for(i=0;i<4;i++) odd[k+i] = (mask >> i) & 1;
+	}
+#endif
+
+	/* 	scalar fallback and remainder */
+	for(;k<N;k++){
+		odd[k] = crossingNumberOdd(px, py, n, x[k], y[k]);
+	}
+
+	return;
+}
+
 int insidePolygon(Polygon *polys, int Npolys, double x0, double y0, double x, double y, int *poly_id){
 
 	/**************************** NO LONGER USED ****************************** /
@@ -77,24 +775,27 @@ int insidePolygon(Polygon *polys, int Npolys, double x0, double y0, double x, do
 	implies Ncross is an odd number if the point (x0,y0) is outside the polygon
 	(then the point (x0,y0) must be chosen outside any polygon).*/
 
-	int i,j,Ncross;
-	double s,t,D;
+	int i,j,n,Ncross;
+	double s,t,D,*px,*py;
 
 
 	for(i=0;i<Npolys;i++){
 
-		if(polys[i].xmin[0] < x && x < polys[i].xmax[0] && polys[i].xmin[1] < y && y < polys[i].xmax[1]){
+		if(BBOX_MIN(polys,i,0) < x && x < BBOX_MAX(polys,i,0) && BBOX_MIN(polys,i,1) < y && y < BBOX_MAX(polys,i,1)){
 			/*		the object is inside the square around the polygon */
+			n  = polys->N[i];
+			px = polys->x + polys->start[i];
+			py = polys->y + polys->start[i];
 			Ncross=0;
-			for(j=0;j<polys[i].N;j++){
-				if(j<polys[i].N-1){
-					D = (polys[i].x[j+1]-polys[i].x[j])*(y-y0)-(polys[i].y[j+1]-polys[i].y[j])*(x-x0);
-					s = ((x-x0)*(polys[i].y[j]-y)-(y-y0)*(polys[i].x[j]-x))/D;
-					t = ((polys[i].x[j]-x)*(polys[i].y[j+1]-polys[i].y[j])-(polys[i].y[j]-y)*(polys[i].x[j+1]-polys[i].x[j]))/D;
+			for(j=0;j<n;j++){
+				if(j<n-1){
+					D = (px[j+1]-px[j])*(y-y0)-(py[j+1]-py[j])*(x-x0);
+					s = ((x-x0)*(py[j]-y)-(y-y0)*(px[j]-x))/D;
+					t = ((px[j]-x)*(py[j+1]-py[j])-(py[j]-y)*(px[j+1]-px[j]))/D;
 				}else{
-					D = (polys[i].x[0]-polys[i].x[j])*(y-y0)-(polys[i].y[0]-polys[i].y[j])*(x-x0);
-					s = ((x-x0)*(polys[i].y[j]-y)-(y-y0)*(polys[i].x[j]-x))/D;
-					t = ((polys[i].x[j]-x)*(polys[i].y[0]-polys[i].y[j])-(polys[i].y[j]-y)*(polys[i].x[0]-polys[i].x[j]))/D;
+					D = (px[0]-px[j])*(y-y0)-(py[0]-py[j])*(x-x0);
+					s = ((x-x0)*(py[j]-y)-(y-y0)*(px[j]-x))/D;
+					t = ((px[j]-x)*(py[0]-py[j])-(py[j]-y)*(px[0]-px[j]))/D;
 				}
 				if(0.0 < s && s < 1.0 + EPS && 0.0 < t && t < 1.0 + EPS) Ncross++;
 			}
@@ -108,552 +809,1720 @@ int insidePolygon(Polygon *polys, int Npolys, double x0, double y0, double x, do
 	return 0;
 }
 
-Polygon *readPolygonFile(FILE *fileIn, int *Npolys, Node *polyTree){
-	Polygon *result = malloc(sizeof(Polygon));
+Polygon *readPolygonFile(FILE *fileIn, int *Npolys, Tree *polyTree){
+	Polygon *result = allocPolygon(0, 0);
 	return result;
 }
 
-Node *readPolygonFileTree(FILE *fileIn, double xmin[2], double xmax[2]){
+Tree *readPolygonFileTree(FILE *fileIn, double xmin[2], double xmax[2], size_t leafSize){
 	/* 	Reads the file file_in and returns the polygons tree.
 	 * 	See http://hea-www.harvard.edu/RD/ds9/ref/region.html
+	 * 	The file is mapped in memory and parsed in a single pass by
+	 * 	parseRegions(). Large files are split into chunks (on line
+	 * 	boundaries) parsed in parallel and merged in the file order.
 	 */
 
 	 fprintf(stderr,"Reading region mask file...");
 
+	int k, mapped, Nchunks = 1;
+	size_t i, size, NpolysAll;
+	char *buffer = readFileBuffer(fileIn, &size, &mapped);
+
+#ifdef _OPENMP
+	if(size > PARSECHUNKMIN) Nchunks = omp_get_max_threads();
+#endif
+
+	size_t *chunk   = (size_t *)malloc((Nchunks+1)*sizeof(size_t));
+	Polygon **parts = (Polygon **)malloc(Nchunks*sizeof(Polygon *));
+	chunk[0]        = 0;
+	chunk[Nchunks]  = size;
+	for(k=1;k<Nchunks;k++){
+		/* 	chunks start at the beginning of a line */
+		chunk[k] = size/Nchunks*k;
+		if(chunk[k] < chunk[k-1]) chunk[k] = chunk[k-1];
+		while(chunk[k] < size && buffer[chunk[k]-1] != '\n') chunk[k]++;
+	}
 
-	char line[NFIELD*NCHAR], item[NFIELD*NCHAR],*str_begin,*str_end;
-	int i,j, spherical;
-	size_t N, NpolysAll;
-	double x0, y0, x, y, r, rx, ry, alpha, angle;
-
-	NpolysAll = 0;
-	/*		Read the entire file and count the total number of polygons, NpolysAll. */
-	while(fgets(line,NFIELD*NCHAR,fileIn) != NULL)
-	if(strstr(line,"polygon") != NULL || strstr(line,"circle") != NULL || strstr(line,"ellipse") != NULL || strstr(line,"box") != NULL) NpolysAll += 1;
-	rewind(fileIn);
-	Polygon *polysAll = (Polygon *)malloc(NpolysAll*sizeof(Polygon));
-	// Polygon *polysAll;
-
-	/*
-	for(i=0; i<NpolysAll; i++){
-		polysAll[i].x    = (double *)malloc(NVERTICES*sizeof(double));
-		polysAll[i].y    = (double *)malloc(NVERTICES*sizeof(double));
-		polysAll[i].xmin = (double *)malloc(2*sizeof(double));
-		polysAll[i].xmax = (double *)malloc(2*sizeof(double));
-	}
-	*/
-	i=0;
-	/*		Read the file and fill the array with polygons. */
-	while(fgets(line,NFIELD*NCHAR,fileIn) != NULL){
-
-		if(strstr(line,"polygon") != NULL){
-
-			str_begin = strstr(line,"(")+sizeof(char);
-			str_end = strstr(line,")");
-			strcpy(str_end,"\n\0");
-			//strcpy(line,str_begin);
-			//getStrings(line,item,",",&N);
-			//DEBUGGING
-			getStrings(str_begin, item, ",", &N);
-			/*
-			 * 	get all coordinates separated by comas.
-			 */
-			polysAll[i].N = N/2;
-			if(N/2 > NVERTICES){
-				fprintf(stderr,"%s: %zd = too many points for polygon %d (%d maxi). Exiting...\n",MYNAME,N/2,i,NVERTICES);
-				exit(EXIT_FAILURE);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,1) num_threads(Nchunks)
+#endif
+	for(k=0;k<Nchunks;k++){
+		parts[k] = parseRegions(buffer+chunk[k], buffer+chunk[k+1]);
+	}
+
+	Polygon *polysAll = mergePolygons(parts, Nchunks);
+	createEdgeIndex(polysAll);
+
+	if(mapped) munmap(buffer, size);
+	else free(buffer);
+	free(parts);
+	free(chunk);
+
+	NpolysAll = polysAll->Npolys;
+	if(NpolysAll == 0){
+		fprintf(stderr,"%s: 0 polygon found, check input file. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}else{
+		fprintf(stderr,"%zd polygon(s) found\n",NpolysAll);
+	}
+
+	xmin[0] = BBOX_MIN(polysAll,0,0);
+	xmax[0] = BBOX_MAX(polysAll,0,0);
+	xmin[1] = BBOX_MIN(polysAll,0,1);
+	xmax[1] = BBOX_MAX(polysAll,0,1);
+	for(i=0;i<NpolysAll;i++){
+		xmin[0] = MIN(xmin[0],BBOX_MIN(polysAll,i,0));
+		xmax[0] = MAX(xmax[0],BBOX_MAX(polysAll,i,0));
+		xmin[1] = MIN(xmin[1],BBOX_MIN(polysAll,i,1));
+		xmax[1] = MAX(xmax[1],BBOX_MAX(polysAll,i,1));
+	}
+
+	Tree *result = createTree(polysAll, xmin, xmax, leafSize);
+
+	/* 	cell classification for fast lookups */
+	result->grid = createGrid(polysAll, xmin, xmax);
+
+	return result;
+}
+
+Polygon *parseRegions(const char *begin, const char *end){
+	/* 	Parses the ds9 regions of the lines in [begin, end) and returns
+	 * 	them in a new arena, grown as needed. Lines are tokenised in
+	 * 	place: the values between the first "(" and the first ")" are
+	 * 	separated by comas (or tabs) and read with parseDouble().
+	 */
+
+	const char *line, *lineEnd, *str_begin, *str_end, *p, **tokBegin, **tokEnd;
+	int j, type, spherical;
+	size_t i, k, N, Nvertices, NtokAlloc, NpolysAlloc, NverticesAlloc, offset;
+	double x0, y0, rx, ry, angle, angleDeg, scale, swap, *px, *py;
+
+	NpolysAlloc     = 1024;
+	NverticesAlloc  = 4*NpolysAlloc;
+	NtokAlloc       = 64;
+	Polygon *result = allocPolygon(NpolysAlloc, NverticesAlloc);
+	tokBegin        = (const char **)malloc(NtokAlloc*sizeof(const char *));
+	tokEnd          = (const char **)malloc(NtokAlloc*sizeof(const char *));
+
+	i      = 0;
+	offset = 0;
+	for(line=begin;line<end;line=lineEnd+1){
+
+		lineEnd = (const char *)memchr(line, '\n', end-line);
+		if(lineEnd == NULL) lineEnd = end;
+
+		if(findWord(line, lineEnd, "polygon") != NULL)      type = REG_POLYGON;
+		else if(findWord(line, lineEnd, "circle") != NULL)  type = REG_CIRCLE;
+		else if(findWord(line, lineEnd, "ellipse") != NULL) type = REG_ELLIPSE;
+		else if(findWord(line, lineEnd, "box") != NULL)     type = REG_BOX;
+		else continue;
+
+		str_begin = (const char *)memchr(line, '(', lineEnd-line);
+		str_end   = (const char *)memchr(line, ')', lineEnd-line);
+		if(str_begin == NULL) continue;
+		if(str_end == NULL || str_end < str_begin) str_end = lineEnd;
+
+		/* 	get all values separated by comas */
+		N = 0;
+		p = str_begin+1;
+		while(p < str_end && *p != '#'){
+			while(p < str_end && (*p == ',' || *p == '\t')) p++;
+			if(p == str_end || *p == '#') break;
+			if(N+NPARAM > NtokAlloc){
+				NtokAlloc *= 2;
+				tokBegin   = (const char **)realloc(tokBegin, NtokAlloc*sizeof(const char *));
+				tokEnd     = (const char **)realloc(tokEnd, NtokAlloc*sizeof(const char *));
 			}
+			tokBegin[N] = p;
+			while(p < str_end && *p != ',' && *p != '\t' && *p != '#') p++;
+			tokEnd[N++] = p;
+		}
+		/* 	missing values are read as 0 */
+		for(k=N;k<NPARAM;k++) tokBegin[k] = tokEnd[k] = str_end;
+
+		/* 	grow the arena if needed */
+		Nvertices = (type == REG_POLYGON) ? N/2 : (type == REG_BOX) ? 4 : 0;
+		if(i == NpolysAlloc || offset + Nvertices > NverticesAlloc){
+			if(i == NpolysAlloc) NpolysAlloc *= 2;
+			while(offset + Nvertices > NverticesAlloc) NverticesAlloc *= 2;
+			reallocPolygon(result, NpolysAlloc, NverticesAlloc);
+		}
 
-			polysAll[i].x    = (double *)malloc(polysAll[i].N*sizeof(double));
-			polysAll[i].y    = (double *)malloc(polysAll[i].N*sizeof(double));
-			polysAll[i].xmin = (double *)malloc(2*sizeof(double));
-			polysAll[i].xmax = (double *)malloc(2*sizeof(double));
+		result->start[i] = offset;
+		x0 = parseDouble(tokBegin[0], tokEnd[0]);
+		y0 = parseDouble(tokBegin[1], tokEnd[1]);
 
-			polysAll[i].id      = i;
-			polysAll[i].xmin[0] = atof(item);
-			polysAll[i].xmax[0] = atof(item);
-			polysAll[i].xmin[1] = atof(item+NCHAR);
-			polysAll[i].xmax[1] = atof(item+NCHAR);
+		if(type == REG_POLYGON){
+
+			result->N[i]    = N/2;
+			result->type[i] = REG_POLYGON;
+			px = result->x + offset;
+			py = result->y + offset;
 			for(j=0;j<N/2;j++){
-				polysAll[i].x[j]    = atof(item+NCHAR*2*j);
-				polysAll[i].y[j]    = atof(item+NCHAR*(2*j+1));
-				polysAll[i].xmin[0] = MIN(polysAll[i].xmin[0], polysAll[i].x[j]);
-				polysAll[i].xmax[0] = MAX(polysAll[i].xmax[0], polysAll[i].x[j]);
-				polysAll[i].xmin[1] = MIN(polysAll[i].xmin[1], polysAll[i].y[j]);
-				polysAll[i].xmax[1] = MAX(polysAll[i].xmax[1], polysAll[i].y[j]);
-			}
-
-			//      fprintf(stderr,"%f %f %f %f\n", polysAll[i].xmin[0], polysAll[i].xmax[0],polysAll[i].xmin[1], polysAll[i].xmax[1]);
-
-			i++;
-		}else if(strstr(line,"circle") != NULL){
-
-			str_begin = strstr(line,"(")+sizeof(char);
-			str_end = strstr(line,")");
-			strcpy(str_end,"\n\0");
-			//strcpy(line,str_begin);
-			//getStrings(line,item,",",&N);
-			//DEBUGGING
-			getStrings(str_begin, item, ",", &N);
-
-			polysAll[i].N = 40;
-			x0 = atof(item+NCHAR*0);
-			y0 = atof(item+NCHAR*1);
-
-			if(strstr(item+NCHAR*2,"\"") != NULL){
-				spherical = 1;
-				r  =  atof(item+NCHAR*2)/3600.0;
-			}else if(strstr(item+NCHAR*2,"\'") != NULL){
-				spherical = 1;
-				r  =  atof(item+NCHAR*2)/60.0;
-			}else if(strstr(item+NCHAR*2,"d") != NULL){
-				spherical = 1;
-				r  =  atof(item+NCHAR*2);
+				px[j] = parseDouble(tokBegin[2*j],   tokEnd[2*j]);
+				py[j] = parseDouble(tokBegin[2*j+1], tokEnd[2*j+1]);
+			}
+			setBoundingBox(result, i);
+			offset += N/2;
+
+		}else if(type == REG_CIRCLE){
+
+			spherical = angleUnit(tokBegin[2], tokEnd[2], &scale);
+			rx = parseDouble(tokBegin[2], tokEnd[2])/scale;
+			setPrimitive(result, i, spherical ? REG_CIRCLE_SPHER : REG_CIRCLE, x0, y0, rx, rx, 0.0);
+
+		}else if(type == REG_ELLIPSE){
+
+			spherical = angleUnit(tokBegin[2], tokEnd[2], &scale);
+			rx    = parseDouble(tokBegin[2], tokEnd[2])/scale;
+			ry    = parseDouble(tokBegin[3], tokEnd[3])/scale;
+			angle = parseDouble(tokBegin[4], tokEnd[4])*PI/180.0;
+			setPrimitive(result, i, spherical ? REG_ELLIPSE_SPHER : REG_ELLIPSE, x0, y0, rx, ry, angle);
+
+		}else{
+
+			spherical = angleUnit(tokBegin[2], tokEnd[2], &scale);
+			rx        = parseDouble(tokBegin[2], tokEnd[2])/scale;
+			ry        = parseDouble(tokBegin[3], tokEnd[3])/scale;
+			if(spherical) rx = 2.0*asin(sin(rx*PI/180.0/2.0)/cos(y0*PI/180.0))*180.0/PI;
+			angleDeg  = parseDouble(tokBegin[4], tokEnd[4]);
+			angle     = angleDeg*PI/180.0;
+
+			if(!spherical && fmod(angleDeg, 90.0) == 0.0){
+				/* 	axis-aligned boxes (cartesian only) */
+				if(fmod(angleDeg, 180.0) != 0.0) SWAP(rx,ry);
+				setPrimitive(result, i, REG_BOX, x0, y0, rx, ry, 0.0);
 			}else{
-				spherical = 0;
-				r  =  atof(item+NCHAR*2);
-			}
-
-			polysAll[i].x    = (double *)malloc(polysAll[i].N*sizeof(double));
-			polysAll[i].y    = (double *)malloc(polysAll[i].N*sizeof(double));
-			polysAll[i].xmin = (double *)malloc(2*sizeof(double));
-			polysAll[i].xmax = (double *)malloc(2*sizeof(double));
-
-			polysAll[i].id      = i;
-			polysAll[i].xmin[0] = x0;
-			polysAll[i].xmax[0] = x0;
-			polysAll[i].xmin[1] = y0;
-			polysAll[i].xmax[1] = y0;
-			for(j=0;j<polysAll[i].N;j++){
-				alpha            = TWOPI*(double)j/((double)polysAll[i].N);
-				polysAll[i].x[j] = r*cos(alpha) + x0;
-				polysAll[i].y[j] = r*sin(alpha) + y0;
-
-				if(spherical){
-					polysAll[i].x[j] = 2.0*asin(sin((polysAll[i].x[j]-x0)*PI/180/2.0)/cos(polysAll[i].y[j]*PI/180))*180.0/PI+x0;
-				}
+				result->N[i]    = 4;
+				result->type[i] = REG_POLYGON;
+				px = result->x + offset;
+				py = result->y + offset;
+				rotate(x0, y0, +rx/2.0+x0, +ry/2.0+y0, &(px[0]), &(py[0]), angle, spherical);
+				rotate(x0, y0, -rx/2.0+x0, +ry/2.0+y0, &(px[1]), &(py[1]), angle, spherical);
+				rotate(x0, y0, -rx/2.0+x0, -ry/2.0+y0, &(px[2]), &(py[2]), angle, spherical);
+				rotate(x0, y0, +rx/2.0+x0, -ry/2.0+y0, &(px[3]), &(py[3]), angle, spherical);
+				setBoundingBox(result, i);
+				offset += 4;
+			}
+		}
+		i++;
+	}
+
+	result->Npolys    = i;
+	result->Nvertices = offset;
+
+	free(tokBegin);
+	free(tokEnd);
+
+	return result;
+}
+
+Polygon *mergePolygons(Polygon **parts, int Nparts){
+	/* 	Concatenates the arenas parts[0], ..., parts[Nparts-1] (in
+	 * 	this order) into a single one and frees them.
+	 */
+
+	int k;
+	size_t i, Npolys = 0, Nvertices = 0;
+
+	if(Nparts == 1) return parts[0];
+
+	for(k=0;k<Nparts;k++){
+		Npolys    += parts[k]->Npolys;
+		Nvertices += parts[k]->Nvertices;
+	}
+	Polygon *result = allocPolygon(Npolys, Nvertices);
+
+	Npolys    = 0;
+	Nvertices = 0;
+	for(k=0;k<Nparts;k++){
+		Polygon *part = parts[k];
+		memcpy(result->N     + Npolys,           part->N,     part->Npolys*sizeof(int));
+		memcpy(result->type  + Npolys,           part->type,  part->Npolys*sizeof(int));
+		memcpy(result->bbox  + 4*Npolys,         part->bbox,  4*part->Npolys*sizeof(double));
+		memcpy(result->param + NPARAM*Npolys,    part->param, NPARAM*part->Npolys*sizeof(double));
+		memcpy(result->x     + Nvertices,        part->x,     part->Nvertices*sizeof(double));
+		memcpy(result->y     + Nvertices,        part->y,     part->Nvertices*sizeof(double));
+		for(i=0;i<part->Npolys;i++) result->start[Npolys+i] = part->start[i] + Nvertices;
+		Npolys    += part->Npolys;
+		Nvertices += part->Nvertices;
+		free_Polygon(part);
+	}
+
+	return result;
+}
+
+const char *findWord(const char *s, const char *end, const char *word){
+	/* 	Returns the first occurrence of word in [s, end), NULL if none */
+
+	size_t n = strlen(word);
+
+	while(end - s >= (long)n){
+		s = (const char *)memchr(s, word[0], end-s-n+1);
+		if(s == NULL) return NULL;
+		if(!memcmp(s, word, n)) return s;
+		s++;
+	}
+	return NULL;
+}
 
-				/* DEBUGGING
-					fprintf(stderr,"%f %f\n",r, distAngSpher(x0, y0, polysAll[i].x[j], polysAll[i].y[j]));
-				*/
-
-				polysAll[i].xmin[0] = MIN(polysAll[i].xmin[0], polysAll[i].x[j]);
-				polysAll[i].xmax[0] = MAX(polysAll[i].xmax[0], polysAll[i].x[j]);
-				polysAll[i].xmin[1] = MIN(polysAll[i].xmin[1], polysAll[i].y[j]);
-				polysAll[i].xmax[1] = MAX(polysAll[i].xmax[1], polysAll[i].y[j]);
-			}
-			i++;
-
-		}else if(strstr(line,"ellipse") != NULL){
-
-			str_begin = strstr(line,"(")+sizeof(char);
-			str_end = strstr(line,")");
-			strcpy(str_end,"\n\0");
-			//strcpy(line,str_begin);
-			//getStrings(line,item,",",&N);
-			//DEBUGGING
-			getStrings(str_begin, item, ",", &N);
-
-			polysAll[i].N = 40;
-			x0 = atof(item+NCHAR*0);
-			y0 = atof(item+NCHAR*1);
-			if(strstr(item+NCHAR*2,"\"") != NULL){
-				spherical = 1;
-				rx  =  atof(item+NCHAR*2)/3600.0;
-				ry  =  atof(item+NCHAR*3)/3600.0;
-			}else if(strstr(item+NCHAR*2,"\'") != NULL){
-				spherical = 1;
-				rx  =  atof(item+NCHAR*2)/60.0;
-				ry  =  atof(item+NCHAR*3)/60.0;
-			}else if(strstr(item+NCHAR*2,"d") != NULL){
-				spherical = 1;
-				rx  =  atof(item+NCHAR*2);
-				ry  =  atof(item+NCHAR*3);
+int angleUnit(const char *s, const char *end, double *scale){
+	/* 	Returns 1 if the size [s, end) is given in arcsec ("),
+	 * 	arcmin (') or degrees (d), with scale the number of units
+	 * 	per degree, and 0 otherwise (no unit).
+	 */
+	if(memchr(s, '"', end-s) != NULL){
+		*scale = 3600.0;
+		return 1;
+	}else if(memchr(s, '\'', end-s) != NULL){
+		*scale = 60.0;
+		return 1;
+	}else if(memchr(s, 'd', end-s) != NULL){
+		*scale = 1.0;
+		return 1;
+	}
+	*scale = 1.0;
+	return 0;
+}
+
+double parseDouble(const char *s, const char *end){
+	/* 	Reads the number at the beginning of [s, end), as atof() would,
+	 * 	with no copy. Numbers with up to 19 significant digits and a
+	 * 	decimal exponent of at most 22 (in absolute value) are converted
+	 * 	exactly with a single multiplication or division by a power
+	 * 	of ten. The others (and inf, nan, hexadecimal, ...) are
+	 * 	converted by strtod().
+	 */
+
+	static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	const char *p = s, *q;
+	unsigned long long mant = 0;
+	int neg = 0, Ndigits = 0, Nsignificant = 0, dropped = 0, exp10 = 0, e, eneg;
+	char tmp[NUMBERSIZE];
+	double result;
+
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' || *p == '\v' || *p == '\f')) p++;
+	if(p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+
+	for(;p < end && '0' <= *p && *p <= '9';p++, Ndigits++){
+		if(Nsignificant < 19){
+			mant = 10*mant + (*p - '0');
+			if(mant > 0) Nsignificant++;
+		}else{
+			dropped |= (*p != '0');
+			exp10++;
+		}
+	}
+	if(p < end && *p == '.'){
+		for(p++;p < end && '0' <= *p && *p <= '9';p++, Ndigits++){
+			if(Nsignificant < 19){
+				mant = 10*mant + (*p - '0');
+				if(mant > 0) Nsignificant++;
+				exp10--;
 			}else{
-				spherical = 0;
-				rx  =  atof(item+NCHAR*2);
-				ry  =  atof(item+NCHAR*3);
-			}
-			angle = atof(item+NCHAR*4)*PI/180.0;
-
-			polysAll[i].x    = (double *)malloc(polysAll[i].N*sizeof(double));
-			polysAll[i].y    = (double *)malloc(polysAll[i].N*sizeof(double));
-			polysAll[i].xmin = (double *)malloc(2*sizeof(double));
-			polysAll[i].xmax = (double *)malloc(2*sizeof(double));
-
-			polysAll[i].id      = i;
-			polysAll[i].xmin[0] = x0;
-			polysAll[i].xmax[0] = x0;
-			polysAll[i].xmin[1] = y0;
-			polysAll[i].xmax[1] = y0;
-			for(j=0;j<polysAll[i].N;j++){
-				alpha            = TWOPI*(double)j/((double)polysAll[i].N);
-				x = rx*cos(alpha) + x0;
-				y = ry*sin(alpha) + y0;
-
-				if(spherical){
-					x = 2.0*asin(sin((x-x0)*PI/180/2.0)/cos(y*PI/180))*180.0/PI+x0;
+				dropped |= (*p != '0');
+			}
+		}
+	}
+	if(Ndigits == 0 || (p < end && (*p == 'x' || *p == 'X'))) goto fallback;
+
+	if(p < end && (*p == 'e' || *p == 'E')){
+		q    = p+1;
+		eneg = 0;
+		if(q < end && (*q == '-' || *q == '+')) eneg = (*q++ == '-');
+		if(q < end && '0' <= *q && *q <= '9'){
+			for(e=0;q < end && '0' <= *q && *q <= '9';q++) if(e < 100000) e = 10*e + (*q - '0');
+			exp10 += eneg ? -e : e;
+		}
+	}
+
+	if(dropped || mant > (1ULL << 53) || exp10 < -22 || exp10 > 22) goto fallback;
+
+	result = (double)mant;
+	result = exp10 < 0 ? result/pow10[-exp10] : result*pow10[exp10];
+	return neg ? -result : result;
+
+fallback:
+	e = (end - s < NUMBERSIZE) ? end - s : NUMBERSIZE - 1;
+	memcpy(tmp, s, e);
+	tmp[e] = '\0';
+	return strtod(tmp, NULL);
+}
+
+char *readFileBuffer(FILE *fileIn, size_t *size, int *mapped){
+	/* 	Returns the content of fileIn: mapped read-only if fileIn is
+	 * 	a regular file (*mapped = 1, see munmap()), read otherwise
+	 * 	(*mapped = 0, see free()). The buffer is not null-terminated.
+	 */
+
+	struct stat st;
+	size_t n, sizeAlloc;
+	char *result;
+
+	if(fstat(fileno(fileIn), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+		result = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fileIn), 0);
+		if(result != MAP_FAILED){
+			madvise(result, st.st_size, MADV_SEQUENTIAL);
+			*size   = st.st_size;
+			*mapped = 1;
+			return result;
+		}
+	}
+
+	sizeAlloc = 1 << 20;
+	result    = (char *)malloc(sizeAlloc);
+	*size     = 0;
+	while(result != NULL && (n = fread(result + *size, 1, sizeAlloc - *size, fileIn)) > 0){
+		*size += n;
+		if(*size == sizeAlloc){
+			sizeAlloc *= 2;
+			result     = (char *)realloc(result, sizeAlloc);
+		}
+	}
+	if(result == NULL){
+		fprintf(stderr,"%s: not enough memory to read the region file. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+	*mapped = 0;
+
+	return result;
+}
+
+Tree *createTree(Polygon *polys, double xmin[2], double xmax[2], size_t leafSize){
+	/* 	Builds a flat kd-tree over the polygons of the arena polys.
+	 * 	Nodes are stored breadth-first in a single array (the root
+	 * 	is nodes[0] and the children of an internal node are stored
+	 * 	next to each other), and leaves point to ranges of a single
+	 * 	shared id array. Polygons overlapping the split value go to
+	 * 	both children. Nodes are split with findSplit() until they hold
+	 * 	leafSize polygons or fewer, or until splitting no longer pays.
+	 */
+
+	size_t i, k, NL, NR, NnodesAlloc, NidsAlloc;
+	int SplitDim;
+	double SplitValue;
+
+	fprintf(stderr,"Building region mask tree...");
+
+	if(leafSize < 1) leafSize = 1;
+
+	Tree *result     = (Tree *)malloc(sizeof(Tree));
+	result->polys    = polys;
+	result->grid     = NULL;
+	result->map      = NULL;
+	result->mapSize  = 0;
+	result->leafSize = leafSize;
+	result->Nnodes   = 1;
+	result->Nids     = 0;
+	NnodesAlloc      = 64;
+	NidsAlloc        = polys->Npolys + 1;
+	result->nodes    = (Node *)malloc(NnodesAlloc*sizeof(Node));
+	result->ids      = (int *)malloc(NidsAlloc*sizeof(int));
+
+	/* 	Temporary data: polygons, limits and depth of the nodes to build */
+	int **nodeIds     = (int **)malloc(NnodesAlloc*sizeof(int *));
+	double *nodeLimit = (double *)malloc(4*NnodesAlloc*sizeof(double));
+	int *nodeDepth    = (int *)malloc(NnodesAlloc*sizeof(int));
+
+	if(result->nodes == NULL || result->ids == NULL || nodeIds == NULL || nodeLimit == NULL || nodeDepth == NULL){
+		fprintf(stderr,"%s: not enough memory to build the tree. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+
+	/* 	the root holds all polygons */
+	result->nodes[0].Npolys = polys->Npolys;
+	nodeIds[0]              = (int *)malloc((polys->Npolys+1)*sizeof(int));
+	for(i=0;i<polys->Npolys;i++) nodeIds[0][i] = i;
+	nodeLimit[0] = xmin[0];
+	nodeLimit[1] = xmin[1];
+	nodeLimit[2] = xmax[0];
+	nodeLimit[3] = xmax[1];
+	nodeDepth[0] = 0;
+
+	/* 	nodes are built in the order they are created (breadth-first) */
+	for(k=0;k<result->Nnodes;k++){
+		Node *node = result->nodes + k;
+		int *ids   = nodeIds[k];
+
+		if(node->Npolys > leafSize && nodeDepth[k] < TREEDEPTHMAX
+			&& findSplit(polys, ids, node->Npolys, nodeLimit+4*k, nodeLimit+4*k+2, &SplitDim, &SplitValue)){
+
+			if(result->Nnodes + 2 > NnodesAlloc){
+				NnodesAlloc *= 2;
+				result->nodes = (Node *)realloc(result->nodes, NnodesAlloc*sizeof(Node));
+				nodeIds       = (int **)realloc(nodeIds, NnodesAlloc*sizeof(int *));
+				nodeLimit     = (double *)realloc(nodeLimit, 4*NnodesAlloc*sizeof(double));
+				nodeDepth     = (int *)realloc(nodeDepth, NnodesAlloc*sizeof(int));
+				if(result->nodes == NULL || nodeIds == NULL || nodeLimit == NULL || nodeDepth == NULL){
+					fprintf(stderr,"%s: not enough memory to build the tree. Exiting...\n",MYNAME);
+					exit(EXIT_FAILURE);
+				}
+				node = result->nodes + k;
+			}
+
+			node->type       = NODE;
+			node->SplitDim   = SplitDim;
+			node->SplitValue = SplitValue;
+			node->Left       = result->Nnodes;
+			node->start      = 0;
+
+			int *idsLeft  = (int *)malloc((node->Npolys+1)*sizeof(int));
+			int *idsRight = (int *)malloc((node->Npolys+1)*sizeof(int));
+			NL = NR = 0;
+			for(i=0;i<node->Npolys;i++){
+				if(BBOX_MIN(polys,ids[i],SplitDim) < SplitValue) idsLeft[NL++]  = ids[i];
+				if(BBOX_MAX(polys,ids[i],SplitDim) > SplitValue) idsRight[NR++] = ids[i];
+			}
+
+			/* 	"left" and "right" */
+			result->nodes[node->Left].Npolys   = NL;
+			result->nodes[node->Left+1].Npolys = NR;
+			nodeIds[node->Left]   = idsLeft;
+			nodeIds[node->Left+1] = idsRight;
+			for(i=0;i<4;i++){
+				nodeLimit[4*node->Left+i]     = nodeLimit[4*k+i];
+				nodeLimit[4*(node->Left+1)+i] = nodeLimit[4*k+i];
+			}
+			nodeLimit[4*node->Left+2+SplitDim] = SplitValue;
+			nodeLimit[4*(node->Left+1)+SplitDim] = SplitValue;
+			nodeDepth[node->Left]   = nodeDepth[k] + 1;
+			nodeDepth[node->Left+1] = nodeDepth[k] + 1;
+
+			result->Nnodes += 2;
+		}else{
+			/* 	Leaf: copy the polygon ids into the shared array */
+			if(result->Nids + node->Npolys > NidsAlloc){
+				while(result->Nids + node->Npolys > NidsAlloc) NidsAlloc *= 2;
+				result->ids = (int *)realloc(result->ids, NidsAlloc*sizeof(int));
+				if(result->ids == NULL){
+					fprintf(stderr,"%s: not enough memory to build the tree. Exiting...\n",MYNAME);
+					exit(EXIT_FAILURE);
 				}
+			}
+			node->type       = LEAF;
+			node->SplitDim   = 0;
+			node->SplitValue = 0.0;
+			node->Left       = 0;
+			node->start      = result->Nids;
+			for(i=0;i<node->Npolys;i++) result->ids[result->Nids++] = ids[i];
+		}
+
+		free(ids);
+	}
+
+	free(nodeIds);
+	free(nodeLimit);
+	free(nodeDepth);
+
+	fprintf(stderr,"Done (%zd nodes).\n",result->Nnodes);
+
+	return result;
+}
+
+int findSplit(Polygon *polys, const int *ids, size_t N, const double xmin[2], const double xmax[2], int *SplitDim, double *SplitValue){
+	/* 	Finds the best split of a node with limits xmin, xmax holding the
+	 * 	N polygons ids, using the surface area heuristic: the expected
+	 * 	cost of a query is proportional to the number of polygons to test
+	 * 	weighted by the probability (area) to fall in each child. Split
+	 * 	values are taken on TREEBINS bins spanning the polygons bounding
+	 * 	boxes in each dimension. Returns 0 if a leaf is cheaper.
+	 */
+
+	size_t i, b;
+	int dim, found = 0;
+	size_t countMin[TREEBINS], countMax[TREEBINS], NL, NR;
+	double lo, hi, width, s, f, cost, costBest;
+
+	/* 	cost of a leaf: N polygons to test */
+	costBest = (double)N;
+
+	for(dim=0;dim<2;dim++){
+		if(xmax[dim] <= xmin[dim]) continue;
+
+		/* 	range covered by the polygons within the node */
+		lo = xmax[dim];
+		hi = xmin[dim];
+		for(i=0;i<N;i++){
+			if(BBOX_MIN(polys,ids[i],dim) < lo) lo = BBOX_MIN(polys,ids[i],dim);
+			if(BBOX_MAX(polys,ids[i],dim) > hi) hi = BBOX_MAX(polys,ids[i],dim);
+		}
+		if(lo < xmin[dim]) lo = xmin[dim];
+		if(hi > xmax[dim]) hi = xmax[dim];
+		if(hi <= lo) continue;
+		width = (hi - lo)/(double)TREEBINS;
+
+		/* 	number of polygons starting and ending in each bin */
+		for(b=0;b<TREEBINS;b++) countMin[b] = countMax[b] = 0;
+		for(i=0;i<N;i++){
+			s = (BBOX_MIN(polys,ids[i],dim) - lo)/width;
+			b = (s <= 0.0) ? 0 : (s >= TREEBINS) ? TREEBINS-1 : (size_t)s;
+			countMin[b]++;
+			s = (BBOX_MAX(polys,ids[i],dim) - lo)/width;
+			b = (s <= 0.0) ? 0 : (s >= TREEBINS) ? TREEBINS-1 : (size_t)s;
+			countMax[b]++;
+		}
+
+		/* 	split between bins b-1 and b: polygons starting before
+		 * 	go left, polygons not ending before go right */
+		NL = countMin[0];
+		NR = N - countMax[0];
+		for(b=1;b<TREEBINS;b++){
+			s    = lo + (double)b*width;
+			f    = (s - xmin[dim])/(xmax[dim] - xmin[dim]);
+			cost = TREETRAVERSAL + f*(double)NL + (1.0-f)*(double)NR;
+			if(cost < costBest){
+				costBest    = cost;
+				*SplitDim   = dim;
+				*SplitValue = s;
+				found       = 1;
+			}
+			NL += countMin[b];
+			NR -= countMax[b];
+		}
+	}
+
+	return found;
+}
+
+Grid *createGrid(Polygon *polys, double xmin[2], double xmax[2]){
+	/* 	Builds a uniform grid over the mask limits and classifies each
+	 * 	cell as fully inside a polygon, fully outside all polygons, or
+	 * 	boundary (at least one polygon edge crosses the cell). Only boundary
+	 * 	cells keep a list of candidate polygons. With about GRIDCELLS cells
+	 * 	per polygon, most points are answered by a single lookup.
+	 *
+	 * 	For each polygon, the cells crossed by its edges are marked first
+	 * 	(row by row along each edge), then the other cells of its bounding
+	 * 	box are filled row by row: a cell not crossed by any edge is either
+	 * 	fully inside or fully outside the polygon, and this state can only
+	 * 	change across marked cells, so the (exact) test of the cell center
+	 * 	is only needed after each run of marked cells. Circles, ellipses
+	 * 	and boxes have no edges and each cell is classified directly.
+	 */
+
+	size_t i, j, k, p, ic, i0, i1, j0, j1, Ncells, Npairs, NpairsAlloc;
+	int e, n, state, *stamp, *pairs;
+	double W, H, tol[2], cellMin[2], cellMax[2], ya, yb, xa, xb, ymin, ymax, ylo, yhi, xlo, xhi, swap, *px, *py, center[2];
+
+	fprintf(stderr,"Building region mask grid...");
+
+	Grid *result = (Grid *)malloc(sizeof(Grid));
+
+	/* 	grid size: about GRIDCELLS cells per polygon, same aspect ratio as the mask */
+	W = xmax[0] - xmin[0];
+	H = xmax[1] - xmin[1];
+	if(W <= 0.0) W = 1.0;
+	if(H <= 0.0) H = 1.0;
+	Ncells = GRIDCELLS*polys->Npolys;
+	if(Ncells < GRIDCELLSMIN) Ncells = GRIDCELLSMIN;
+	if(Ncells > GRIDCELLSMAX) Ncells = GRIDCELLSMAX;
+	result->nx = (size_t)ceil(sqrt((double)Ncells*W/H));
+	result->ny = (size_t)ceil((double)Ncells/(double)result->nx);
+	if(result->nx < 1) result->nx = 1;
+	if(result->ny < 1) result->ny = 1;
+	Ncells = result->nx*result->ny;
+
+	for(k=0;k<2;k++){
+		result->xmin[k] = xmin[k];
+		result->xmax[k] = xmin[k] + (k == 0 ? W : H);
+	}
+	result->dx[0]  = W/(double)result->nx;
+	result->dx[1]  = H/(double)result->ny;
+	result->idx[0] = 1.0/result->dx[0];
+	result->idx[1] = 1.0/result->dx[1];
+	/* 	cells are marked conservatively, i.e. slightly enlarged */
+	tol[0] = 1.0e-8*result->dx[0];
+	tol[1] = 1.0e-8*result->dx[1];
+
+	result->cell = (int *)malloc(Ncells*sizeof(int));
+	stamp        = (int *)malloc(Ncells*sizeof(int));
+	NpairsAlloc  = 2*polys->Npolys + 1;
+	pairs        = (int *)malloc(2*NpairsAlloc*sizeof(int));
+	if(result->cell == NULL || stamp == NULL || pairs == NULL){
+		fprintf(stderr,"%s: not enough memory for the grid (%zd cells). Exiting...\n",MYNAME,Ncells);
+		exit(EXIT_FAILURE);
+	}
+	for(ic=0;ic<Ncells;ic++){
+		result->cell[ic] = GRID_OUTSIDE;
+		stamp[ic]        = -1;
+	}
+
+	Npairs = 0;
+	for(p=0;p<polys->Npolys;p++){
+		n  = polys->N[p];
+		px = polys->x + polys->start[p];
+		py = polys->y + polys->start[p];
+
+		/* 	1. cells crossed by the edges */
+		for(e=0;e<n;e++){
+			xa = px[e];
+			ya = py[e];
+			xb = px[(e+1)%n];
+			yb = py[(e+1)%n];
+			ymin = (ya < yb) ? ya : yb;
+			ymax = (ya < yb) ? yb : ya;
+			j0   = gridIndex(result, ymin - tol[1], 1);
+			j1   = gridIndex(result, ymax + tol[1], 1);
+			for(j=j0;j<=j1;j++){
+				/* 	part of the edge within the row [ylo,yhi] */
+				ylo = result->xmin[1] + (double)j*result->dx[1] - tol[1];
+				yhi = ylo + result->dx[1] + 2.0*tol[1];
+				if(ya == yb){
+					xlo = xa;
+					xhi = xb;
+				}else{
+					if(ylo < ymin) ylo = ymin;
+					if(yhi > ymax) yhi = ymax;
+					xlo = xa + (xb-xa)*(ylo-ya)/(yb-ya);
+					xhi = xa + (xb-xa)*(yhi-ya)/(yb-ya);
+				}
+				if(xlo > xhi) SWAP(xlo,xhi);
+				i0 = gridIndex(result, xlo - tol[0], 0);
+				i1 = gridIndex(result, xhi + tol[0], 0);
+				for(i=i0;i<=i1;i++) stamp[j*result->nx + i] = (int)p;
+			}
+		}
+
+		/* 	2. cells fully inside the polygon, and (cell, polygon) pairs for
+		 * 	boundary cells. Primitives are classified cell by cell (see classifyCell()) */
+		i0 = gridIndex(result, BBOX_MIN(polys,p,0) - tol[0], 0);
+		i1 = gridIndex(result, BBOX_MAX(polys,p,0) + tol[0], 0);
+		j0 = gridIndex(result, BBOX_MIN(polys,p,1) - tol[1], 1);
+		j1 = gridIndex(result, BBOX_MAX(polys,p,1) + tol[1], 1);
+		for(j=j0;j<=j1;j++){
+			state = -1;
+			for(i=i0;i<=i1;i++){
+				ic = j*result->nx + i;
+				if(polys->type[p] != REG_POLYGON){
+					cellMin[0] = result->xmin[0] + (double)i*result->dx[0] - tol[0];
+					cellMin[1] = result->xmin[1] + (double)j*result->dx[1] - tol[1];
+					cellMax[0] = cellMin[0] + result->dx[0] + 2.0*tol[0];
+					cellMax[1] = cellMin[1] + result->dx[1] + 2.0*tol[1];
+					state = classifyCell(polys, p, cellMin, cellMax);
+				}else if(stamp[ic] == (int)p){
+					state = -1;
+				}else if(state < 0){
+					center[0] = result->xmin[0] + ((double)i + 0.5)*result->dx[0];
+					center[1] = result->xmin[1] + ((double)j + 0.5)*result->dx[1];
+					state = insideRegion(polys, p, center[0], center[1]);
+				}
+				if(state < 0){
+					if(Npairs == NpairsAlloc){
+						NpairsAlloc *= 2;
+						pairs = (int *)realloc(pairs, 2*NpairsAlloc*sizeof(int));
+						if(pairs == NULL){
+							fprintf(stderr,"%s: not enough memory for the grid. Exiting...\n",MYNAME);
+							exit(EXIT_FAILURE);
+						}
+					}
+					pairs[2*Npairs]   = (int)ic;
+					pairs[2*Npairs+1] = (int)p;
+					Npairs++;
+				}else if(state && result->cell[ic] == GRID_OUTSIDE){
+					result->cell[ic] = (int)p;
+				}
+			}
+		}
+	}
+
+	/* 	3. candidate lists for boundary cells (cells fully inside
+	 * 	a polygon do not need one) */
+	result->Nboundary = 0;
+	for(k=0;k<Npairs;k++){
+		ic = pairs[2*k];
+		if(result->cell[ic] == GRID_OUTSIDE){
+			result->cell[ic] = -2 - (int)result->Nboundary;
+			stamp[ic]        = 0;
+			result->Nboundary++;
+		}
+		if(result->cell[ic] < GRID_OUTSIDE) stamp[ic]++;
+	}
+	result->start = (size_t *)malloc((result->Nboundary+1)*sizeof(size_t));
+	result->start[0] = 0;
+	for(ic=0;ic<Ncells;ic++){
+		if(result->cell[ic] < GRID_OUTSIDE){
+			k = -2 - result->cell[ic];
+			result->start[k+1] = stamp[ic];
+		}
+	}
+	for(k=0;k<result->Nboundary;k++) result->start[k+1] += result->start[k];
+	result->ids = (int *)malloc((result->start[result->Nboundary]+1)*sizeof(int));
+	for(ic=0;ic<Ncells;ic++) stamp[ic] = 0;
+	/* 	pairs are sorted by polygon id, so are candidate lists */
+	for(k=0;k<Npairs;k++){
+		ic = pairs[2*k];
+		if(result->cell[ic] < GRID_OUTSIDE){
+			result->ids[result->start[-2 - result->cell[ic]] + stamp[ic]] = pairs[2*k+1];
+			stamp[ic]++;
+		}
+	}
+
+	free(stamp);
+	free(pairs);
 
-				rotate(x0, y0, x, y, &(polysAll[i].x[j]), &(polysAll[i].y[j]), angle, spherical);
+	fprintf(stderr,"Done (%zd x %zd cells, %zd boundary).\n",result->nx,result->ny,result->Nboundary);
 
-				polysAll[i].xmin[0] = MIN(polysAll[i].xmin[0], polysAll[i].x[j]);
-				polysAll[i].xmax[0] = MAX(polysAll[i].xmax[0], polysAll[i].x[j]);
-				polysAll[i].xmin[1] = MIN(polysAll[i].xmin[1], polysAll[i].y[j]);
-				polysAll[i].xmax[1] = MAX(polysAll[i].xmax[1], polysAll[i].y[j]);
+	return result;
+}
+
+size_t gridIndex(const Grid *grid, double x, int dim){
+	/* 	Returns the cell index of coordinate x along dim,
+	 * 	clipped to the grid limits.
+	 */
+	size_t n = (dim == 0) ? grid->nx : grid->ny;
+	double i = (x - grid->xmin[dim])*grid->idx[dim];
+
+	if(i < 0.0) return 0;
+	if(i >= (double)n) return n-1;
+	return (size_t)i;
+}
+
+int gridLookup(const Grid *grid, double x, double y){
+	/* 	Returns the value of the cell containing (x,y): a polygon id if
+	 * 	the cell is fully inside a polygon, GRID_OUTSIDE if the cell
+	 * 	(or the point) is outside all polygons, or -2-b for the
+	 * 	boundary cell b.
+	 */
+	if(!(grid->xmin[0] < x && x < grid->xmax[0] && grid->xmin[1] < y && y < grid->xmax[1])) return GRID_OUTSIDE;
+	return grid->cell[gridIndex(grid, y, 1)*grid->nx + gridIndex(grid, x, 0)];
+}
+
+void free_Grid(Grid *grid){
+	free(grid->cell);
+	free(grid->start);
+	free(grid->ids);
+	free(grid);
+}
+
+Cells *createCells(const Tree *polyTree, const double xmin[2], const double xmax[2], int coordType, int inside){
+	/* 	Decomposes the limits [xmin,xmax] into the cells where random
+	 * 	objects outside the mask (inside the mask if inside = 1) can
+	 * 	fall: the grid cells outside all polygons (resp. fully inside
+	 * 	one), the boundary cells, and the parts of the limits outside
+	 * 	the grid (no polygon there). Cells fully excluded are dropped,
+	 * 	so that only objects drawn in boundary cells can be rejected.
+	 * 	Without a grid, the limits are a single boundary cell.
+	 */
+
+	size_t i, j, Nalloc;
+	int value;
+	double a[2], b[2], g0[2], g1[2];
+	const Grid *grid = polyTree->grid;
+
+	Cells *result  = (Cells *)malloc(sizeof(Cells));
+	Nalloc         = (grid != NULL ? grid->nx*grid->ny : 0) + 5;
+	result->N      = 0;
+	result->x0     = (double *)malloc(Nalloc*sizeof(double));
+	result->x1     = (double *)malloc(Nalloc*sizeof(double));
+	result->y0     = (double *)malloc(Nalloc*sizeof(double));
+	result->y1     = (double *)malloc(Nalloc*sizeof(double));
+	result->weight = (double *)malloc(Nalloc*sizeof(double));
+	if(result->x0 == NULL || result->x1 == NULL || result->y0 == NULL || result->y1 == NULL || result->weight == NULL){
+		fprintf(stderr,"%s: not enough memory for %zd sampling cells. Exiting...\n",MYNAME,Nalloc);
+		exit(EXIT_FAILURE);
+	}
+
+	if(grid == NULL){
+		addCell(result, xmin[0], xmax[0], xmin[1], xmax[1], coordType);
+		return result;
+	}
+
+	/* 	grid cells, clipped to the limits */
+	for(j=0;j<grid->ny;j++){
+		for(i=0;i<grid->nx;i++){
+			value = grid->cell[j*grid->nx+i];
+			if(value >= 0 && !inside) continue;
+			if(value == GRID_OUTSIDE && inside) continue;
+			a[0] = grid->xmin[0] + (double)i*grid->dx[0];
+			a[1] = grid->xmin[1] + (double)j*grid->dx[1];
+			b[0] = (i == grid->nx-1) ? grid->xmax[0] : a[0] + grid->dx[0];
+			b[1] = (j == grid->ny-1) ? grid->xmax[1] : a[1] + grid->dx[1];
+			if(a[0] < xmin[0]) a[0] = xmin[0];
+			if(a[1] < xmin[1]) a[1] = xmin[1];
+			if(b[0] > xmax[0]) b[0] = xmax[0];
+			if(b[1] > xmax[1]) b[1] = xmax[1];
+			addCell(result, a[0], b[0], a[1], b[1], coordType);
+		}
+	}
+
+	/* 	limits outside the grid: left, right, bottom and top strips */
+	if(!inside){
+		g0[0] = (grid->xmin[0] > xmin[0]) ? grid->xmin[0] : xmin[0];
+		g1[0] = (grid->xmax[0] < xmax[0]) ? grid->xmax[0] : xmax[0];
+		g0[1] = (grid->xmin[1] > xmin[1]) ? grid->xmin[1] : xmin[1];
+		g1[1] = (grid->xmax[1] < xmax[1]) ? grid->xmax[1] : xmax[1];
+		if(g0[0] > g1[0] || g0[1] > g1[1]){
+			/* 	the limits do not overlap the grid */
+			addCell(result, xmin[0], xmax[0], xmin[1], xmax[1], coordType);
+		}else{
+			addCell(result, xmin[0], g0[0], xmin[1], xmax[1], coordType);
+			addCell(result, g1[0], xmax[0], xmin[1], xmax[1], coordType);
+			addCell(result, g0[0], g1[0], xmin[1], g0[1], coordType);
+			addCell(result, g0[0], g1[0], g1[1], xmax[1], coordType);
+		}
+	}
+
+	return result;
+}
+
+void addCell(Cells *cells, double x0, double x1, double y0, double y1, int coordType){
+	/* 	Appends the cell [x0,x1] x [y0,y1] if not empty (y in degrees
+	 * 	in spherical coordinates, stored as sin(y)). Memory is allocated
+	 * 	by createCells().
+	 */
+	size_t n = cells->N;
+
+	if(x1 <= x0 || y1 <= y0) return;
+	if(coordType == RADEC){
+		y0 = sin(y0*PI/180.0);
+		y1 = sin(y1*PI/180.0);
+	}
+	cells->x0[n]     = x0;
+	cells->x1[n]     = x1;
+	cells->y0[n]     = y0;
+	cells->y1[n]     = y1;
+	cells->weight[n] = (x1 - x0)*(y1 - y0) + (n > 0 ? cells->weight[n-1] : 0.0);
+	cells->N++;
+}
+
+void drawInCells(const Cells *cells, const double u[3], int coordType, double *x, double *y){
+	/* 	Draws (x,y) uniformly in the cells from three uniform
+	 * 	deviates in [0,1): u[0] picks the cell (weighted by
+	 * 	area), u[1] and u[2] are the position in the cell.
+	 */
+	size_t lo = 0, hi = cells->N-1, mid;
+	double target = u[0]*cells->weight[cells->N-1];
+
+	/* 	first cell with weight > target */
+	while(lo < hi){
+		mid = (lo + hi)/2;
+		if(cells->weight[mid] > target) hi = mid;
+		else lo = mid + 1;
+	}
+
+	*x = cells->x0[lo]*(1.0 - u[1]) + cells->x1[lo]*u[1];
+	*y = cells->y0[lo]*(1.0 - u[2]) + cells->y1[lo]*u[2];
+	if(coordType == RADEC) *y = asin(*y)*180.0/PI;
+}
+
+void free_Cells(Cells *cells){
+	free(cells->x0);
+	free(cells->x1);
+	free(cells->y0);
+	free(cells->y1);
+	free(cells->weight);
+	free(cells);
+}
+
+double maskArea(const Tree *polyTree, const double xmin[2], const double xmax[2], int coordType){
+	/* 	Returns the exact area of the union of the mask regions within
+	 * 	the limits [xmin,xmax] (in deg^2 in spherical coordinates). The
+	 * 	grid cells fully inside a region count for their whole area,
+	 * 	the cells outside all regions for nothing, and in the boundary
+	 * 	cells the area of the candidate regions is integrated (see
+	 * 	regionArea()). The part of the limits outside the grid has no
+	 * 	region. Rows are summed in order, so the result does not depend
+	 * 	on the number of threads.
+	 */
+
+	size_t i, j, b;
+	int value, *ids;
+	double a0[2], a1[2], result, *rowArea;
+	const Grid *grid    = polyTree->grid;
+	const Polygon *polys = polyTree->polys;
+
+	if(grid == NULL){
+		/* 	all regions are candidates in the whole limits */
+		ids = (int *)malloc((polys->Npolys+1)*sizeof(int));
+		if(ids == NULL){
+			fprintf(stderr,"%s: not enough memory to compute the mask area. Exiting...\n",MYNAME);
+			exit(EXIT_FAILURE);
+		}
+		for(i=0;i<polys->Npolys;i++) ids[i] = (int)i;
+		result = regionArea(polys, ids, polys->Npolys, xmin, xmax, coordType);
+		free(ids);
+		return result;
+	}
+
+	rowArea = (double *)calloc(grid->ny, sizeof(double));
+	if(rowArea == NULL){
+		fprintf(stderr,"%s: not enough memory to compute the mask area. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for private(i,b,value,a0,a1) schedule(dynamic)
+#endif
+	for(j=0;j<grid->ny;j++){
+		for(i=0;i<grid->nx;i++){
+			value = grid->cell[j*grid->nx+i];
+			if(value == GRID_OUTSIDE) continue;
+			/* 	cell clipped to the limits, as in createCells() */
+			a0[0] = grid->xmin[0] + (double)i*grid->dx[0];
+			a0[1] = grid->xmin[1] + (double)j*grid->dx[1];
+			a1[0] = (i == grid->nx-1) ? grid->xmax[0] : a0[0] + grid->dx[0];
+			a1[1] = (j == grid->ny-1) ? grid->xmax[1] : a0[1] + grid->dx[1];
+			if(a0[0] < xmin[0]) a0[0] = xmin[0];
+			if(a0[1] < xmin[1]) a0[1] = xmin[1];
+			if(a1[0] > xmax[0]) a1[0] = xmax[0];
+			if(a1[1] > xmax[1]) a1[1] = xmax[1];
+			if(a1[0] <= a0[0] || a1[1] <= a0[1]) continue;
+			if(value >= 0){
+				rowArea[j] += rectArea(a0[0], a1[0], a0[1], a1[1], coordType);
+			}else{
+				b = (size_t)(-2-value);
+				rowArea[j] += regionArea(polys, grid->ids + grid->start[b], grid->start[b+1] - grid->start[b], a0, a1, coordType);
 			}
-			i++;
+		}
+	}
+
+	result = 0.0;
+	for(j=0;j<grid->ny;j++) result += rowArea[j];
+	free(rowArea);
+
+	return result;
+}
+
+double rectArea(double x0, double x1, double y0, double y1, int coordType){
+	/* 	Area of the rectangle [x0,x1] x [y0,y1] (in deg^2 between two
+	 * 	parallels in spherical coordinates). */
+	if(coordType == RADEC) return (x1 - x0)*(sin(y1*PI/180.0) - sin(y0*PI/180.0))*180.0/PI;
+	return (x1 - x0)*(y1 - y0);
+}
+
+double regionArea(const Polygon *polys, const int *ids, size_t N, const double xmin[2], const double xmax[2], int coordType){
+	/* 	Returns the area of the union of the regions ids[0], ...,
+	 * 	ids[N-1] inside the rectangle [xmin,xmax], as the integral over
+	 * 	y of the length of the cross-section at y (see sliceLength()),
+	 * 	times cos(y) in spherical coordinates: regions are bounded by
+	 * 	straight lines in (x,y) (polygons are tested in the plane,
+	 * 	see insideRegion()), so this is their exact area on the sphere.
+	 * 	y is cut into slabs where the cross-section length has kinks
+	 * 	or jumps: at the bottom and top of the regions, at the polygon
+	 * 	vertices and where the region boundaries cross the left and
+	 * 	right sides of the rectangle (see clipBreaks()). Over a slab
+	 * 	it is smooth except where the boundaries of two regions cross,
+	 * 	and for polygons it is linear: slabs are integrated with an
+	 * 	adaptive Gauss-Kronrod rule, after the change of variable
+	 * 	y = y0 + (y1-y0)(1-cos t)/2, which removes the square root
+	 * 	singularities at the bottom and top of circles and ellipses.
+	 */
+
+	size_t k, m, s0, s1, Nbreaks, NbreaksAlloc, Nintervals, Ncrossings;
+	int i, j, e, n, indexed;
+	double tol, result, *breaks;
+	const double *px, *py;
+	Slice slice;
+
+	if(xmax[0] <= xmin[0] || xmax[1] <= xmin[1]) return 0.0;
+
+	NbreaksAlloc = 2*N + 2;
+	Nintervals   = 0;
+	Ncrossings   = 0;
+	for(k=0;k<N;k++){
+		n = polys->N[ids[k]];
+		Nintervals += (polys->type[ids[k]] == REG_POLYGON) ? (size_t)n/2+1 : 1;
+		if((size_t)n > Ncrossings) Ncrossings = (size_t)n;
+	}
+	breaks = (double *)malloc(NbreaksAlloc*sizeof(double));
+	if(breaks == NULL){
+		fprintf(stderr,"%s: not enough memory to compute the mask area. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+	Nbreaks = 0;
+	addBreak(&breaks, &Nbreaks, &NbreaksAlloc, xmin[1], xmin[1], xmax[1]);
+	addBreak(&breaks, &Nbreaks, &NbreaksAlloc, xmax[1], xmin[1], xmax[1]);
+	for(k=0;k<N;k++){
+		i = ids[k];
+		addBreak(&breaks, &Nbreaks, &NbreaksAlloc, BBOX_MIN(polys,i,1), xmin[1], xmax[1]);
+		addBreak(&breaks, &Nbreaks, &NbreaksAlloc, BBOX_MAX(polys,i,1), xmin[1], xmax[1]);
+		if(polys->type[i] != REG_POLYGON){
+			clipBreaks(polys, i, xmin, xmax, &breaks, &Nbreaks, &NbreaksAlloc);
+			continue;
+		}
+
+		/* 	polygons: vertices inside the rectangle (outside it, a
+		 * 	vertex does not change the clipped cross-section) and edges
+		 * 	crossing its sides. With an edge index, only the edges of
+		 * 	the slabs overlapping the rectangle are read */
+		n  = polys->N[i];
+		px = polys->x + polys->start[i];
+		py = polys->y + polys->start[i];
+		indexed = (polys->slab != NULL && polys->slab[i+1] > polys->slab[i]);
+		s0 = 0;
+		s1 = (size_t)n;
+		if(indexed){
+			s0 = polys->slabStart[polys->slab[i] + slabIndex(polys->param + NPARAM*i, polys->slab[i+1] - polys->slab[i], xmin[1])];
+			s1 = polys->slabStart[polys->slab[i] + slabIndex(polys->param + NPARAM*i, polys->slab[i+1] - polys->slab[i], xmax[1]) + 1];
+		}
+		for(m=s0;m<s1;m++){
+			j = indexed ? polys->slabEdges[m] : (int)m;
+			e = (j == 0) ? n-1 : j-1;
+			if(xmin[0] <= px[j] && px[j] <= xmax[0]) addBreak(&breaks, &Nbreaks, &NbreaksAlloc, py[j], xmin[1], xmax[1]);
+			if((px[e] > xmin[0]) != (px[j] > xmin[0])) addBreak(&breaks, &Nbreaks, &NbreaksAlloc, py[e] + (xmin[0] - px[e])*(py[j] - py[e])/(px[j] - px[e]), xmin[1], xmax[1]);
+			if((px[e] > xmax[0]) != (px[j] > xmax[0])) addBreak(&breaks, &Nbreaks, &NbreaksAlloc, py[e] + (xmax[0] - px[e])*(py[j] - py[e])/(px[j] - px[e]), xmin[1], xmax[1]);
+		}
+	}
+	qsort(breaks, Nbreaks, sizeof(double), compareDoubles);
+
+	slice.polys     = polys;
+	slice.ids       = ids;
+	slice.N         = N;
+	slice.coordType = coordType;
+	slice.x0        = xmin[0];
+	slice.x1        = xmax[0];
+	slice.buffer    = (double *)malloc(2*(Nintervals+1)*sizeof(double));
+	slice.crossings = (double *)malloc((Ncrossings+1)*sizeof(double));
+	if(slice.buffer == NULL || slice.crossings == NULL){
+		fprintf(stderr,"%s: not enough memory to compute the mask area. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+
+	result = 0.0;
+	for(k=0;k+1<Nbreaks;k++){
+		if(breaks[k+1] <= breaks[k]) continue;
+		tol     = AREATOL*(xmax[0] - xmin[0])*(breaks[k+1] - breaks[k]);
+		result += integrateSlice(&slice, breaks[k], breaks[k+1], 0.0, PI, tol, 0);
+	}
+
+	free(slice.buffer);
+	free(slice.crossings);
+	free(breaks);
+
+	return result;
+}
+
+void addBreak(double **breaks, size_t *N, size_t *Nalloc, double y, double ymin, double ymax){
+	/* 	Appends y to the slab limits if ymin <= y <= ymax. */
+
+	if(!(ymin <= y && y <= ymax)) return;
+	if(*N == *Nalloc){
+		*Nalloc *= 2;
+		*breaks  = (double *)realloc(*breaks, *Nalloc*sizeof(double));
+		if(*breaks == NULL){
+			fprintf(stderr,"%s: not enough memory to compute the mask area. Exiting...\n",MYNAME);
+			exit(EXIT_FAILURE);
+		}
+	}
+	(*breaks)[(*N)++] = y;
+}
+
+void clipBreaks(const Polygon *polys, int i, const double xmin[2], const double xmax[2], double **breaks, size_t *N, size_t *Nalloc){
+	/* 	Appends the y where the boundary of the (primitive) region i
+	 * 	crosses the left or right side of the rectangle [xmin,xmax],
+	 * 	i.e. where an end of its x interval at y (see regionInterval())
+	 * 	equals xmin[0] or xmax[0]. Roots are bracketed on AREASCAN
+	 * 	steps over the y range of the region (within the rectangle)
+	 * 	and refined by bisection.
+	 */
+
+	int k, q, it, ok, okPrev = 0;
+	double f, y, y0, y1, ya, yb, x[2], xs[2], g, ga, g0[4], g1[4], side[2];
+	double ymin = MAX(BBOX_MIN(polys,i,1), xmin[1]);
+	double ymax = MIN(BBOX_MAX(polys,i,1), xmax[1]);
+
+	if(!(ymin < ymax)) return;
+	if(polys->type[i] == REG_CIRCLE_SPHER){
+		/* 	where a cap around a pole starts to cover whole parallels */
+		addBreak(breaks, N, Nalloc,  180.0 - polys->param[NPARAM*i+1] - polys->param[NPARAM*i+2], xmin[1], xmax[1]);
+		addBreak(breaks, N, Nalloc, -180.0 - polys->param[NPARAM*i+1] + polys->param[NPARAM*i+2], xmin[1], xmax[1]);
+	}
+	side[0] = xmin[0];
+	side[1] = xmax[0];
+
+	/* 	g[2*s+q] = end q of the interval - side s */
+	y0 = ymin;
+	for(k=0;k<=AREASCAN;k++){
+		/* 	steps are finer towards the ends, where the boundary is
+		 * 	almost horizontal, and the ends themselves are moved
+		 * 	slightly inside, where the region has an interval */
+		f  = MIN(MAX(SQUARE(sin(0.5*PI*(double)k/(double)AREASCAN)), 1.0e-12), 1.0 - 1.0e-12);
+		y1 = ymin + (ymax - ymin)*f;
+		ok = regionInterval(polys, i, y1, x);
+		for(q=0;q<4;q++){
+			g1[q] = x[q%2] - side[q/2];
+			if(!ok || !okPrev || (g0[q] > 0.0) == (g1[q] > 0.0)) continue;
+			/* 	bisection */
+			ya = y0;
+			yb = y1;
+			ga = g0[q];
+			for(it=0;it<64 && yb - ya > EPS*(MAX(fabs(ya), fabs(yb)));it++){
+				y = 0.5*(ya + yb);
+				if(!regionInterval(polys, i, y, xs)) break;
+				g = xs[q%2] - side[q/2];
+				if((g > 0.0) == (ga > 0.0)){
+					ya = y;
+					ga = g;
+				}else{
+					yb = y;
+				}
+			}
+			addBreak(breaks, N, Nalloc, 0.5*(ya + yb), xmin[1], xmax[1]);
+		}
+		for(q=0;q<4;q++) g0[q] = g1[q];
+		okPrev = ok;
+		y0     = y1;
+	}
+}
+
+double integrateSlice(const Slice *slice, double y0, double y1, double t0, double t1, double tol, int depth){
+	/* 	Adaptive integration of the cross-section length over
+	 * 	t in [t0,t1] (see regionArea()): the interval is halved until
+	 * 	the error estimate of kronrodSlice() is below tol or below the
+	 * 	rounding errors (the integrand is positive). tol is the same
+	 * 	for all the pieces of a slab: where the cross-section length
+	 * 	cannot be computed to full precision (e.g. a cap reaching a
+	 * 	pole), halving it would split the slab down to AREADEPTHMAX
+	 * 	everywhere.
+	 */
+
+	double error, result = kronrodSlice(slice, y0, y1, t0, t1, &error);
+
+	if(depth >= AREADEPTHMAX || error <= (MAX(tol, 4.0*EPS*result))) return result;
+
+	return integrateSlice(slice, y0, y1, t0, 0.5*(t0 + t1), tol, depth+1)
+		+ integrateSlice(slice, y0, y1, 0.5*(t0 + t1), t1, tol, depth+1);
+}
+
+double kronrodSlice(const Slice *slice, double y0, double y1, double t0, double t1, double *error){
+	/* 	15-point Gauss-Kronrod rule over t in [t0,t1] of the cross-
+	 * 	section length at y = y0 + (y1-y0)(1-cos t)/2, times dy/dt.
+	 * 	The error is estimated as the difference with the embedded
+	 * 	7-point Gauss rule. y is computed from the closest end of the
+	 * 	slab, so that the points close to an end keep their distance
+	 * 	to it.
+	 */
 
+	static const double node[8] = {
+		0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+		0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+		0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+		0.207784955007898467600689403773245, 0.000000000000000000000000000000000};
+	static const double weightKronrod[8] = {
+		0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+		0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+		0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+		0.204432940075298892414161999234649, 0.209482141084727828012999174891714};
+	static const double weightGauss[4] = {
+		0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+		0.381830050505118944950369775488975, 0.417959183673469387755102040816327};
+
+	int k, sign;
+	double t, y, f, sumKronrod = 0.0, sumGauss = 0.0, h = 0.5*(t1 - t0), m = 0.5*(t0 + t1);
+
+	for(k=0;k<8;k++){
+		for(sign=-1;sign<=1;sign+=2){
+			if(k == 7 && sign == 1) break;
+			t  = m + (double)sign*h*node[k];
+			y  = (t < 0.5*PI) ? y0 + (y1 - y0)*SQUARE(sin(0.5*t)) : y1 - (y1 - y0)*SQUARE(cos(0.5*t));
+			f  = sliceLength(slice, y)*sin(t);
+			sumKronrod += weightKronrod[k]*f;
+			if(k%2 == 1) sumGauss += weightGauss[k/2]*f;
 		}
+	}
 
-		/*
-		else if(strstr(line,"newbox") != NULL){
-
-			str_begin = strstr(line,"(")+sizeof(char);
-			str_end = strstr(line,")");
-			strcpy(str_end,"\n\0");
+	*error = fabs(sumKronrod - sumGauss)*h*0.5*(y1 - y0);
+	return sumKronrod*h*0.5*(y1 - y0);
+}
 
-			getStrings(str_begin, item, ",", &N);
+double sliceLength(const Slice *slice, double y){
+	/* 	Returns the length of the cross-section at y of the union of
+	 * 	the regions of slice, clipped to [x0,x1], times cos(y) in
+	 * 	spherical coordinates. Each region gives one or several x
+	 * 	intervals: polygons from their edge crossings, paired in order
+	 * 	(crossing number rule, as in crossingNumberOdd()), the others from
+	 * 	regionInterval(). The intervals are then sorted and merged.
+	 */
 
-			polysAll[i].N = 40;
-			x0 = atof(item+NCHAR*0);
-			y0 = atof(item+NCHAR*1);
-			if(strstr(item+NCHAR*2,"\"") != NULL){
-				spherical = 1;
-				rx  =  atof(item+NCHAR*2)/3600.0;
-				ry  =  atof(item+NCHAR*3)/3600.0;
-				rx  = 2.0*asin(sin(rx*PI/180.0/2.0)/cos(y0*PI/180.0))*180.0/PI;
-			}else if(strstr(item+NCHAR*2,"\'") != NULL){
-				spherical = 1;
-				rx  =  atof(item+NCHAR*2)/60.0;
-				ry  =  atof(item+NCHAR*3)/60.0;
-				rx  = 2.0*asin(sin(rx*PI/180.0/2.0)/cos(y0*PI/180.0))*180.0/PI;
-			}else if(strstr(item+NCHAR*2,"d") != NULL){
-				spherical = 1;
-				rx  =  atof(item+NCHAR*2);
-				ry  =  atof(item+NCHAR*3);
-				rx  = 2.0*asin(sin(rx*PI/180.0/2.0)/cos(y0*PI/180.0))*180.0/PI;
-			}else{
-				spherical = 0;
-				rx  =  atof(item+NCHAR*2);
-				ry  =  atof(item+NCHAR*3);
+	const Polygon *polys = slice->polys;
+	size_t k, m, s, Nintervals = 0, Ncrossings;
+	int i, j, e, n, odd;
+	double *interval = slice->buffer, *xc = slice->crossings;
+	const double *px, *py;
+	double x[2], xe, start, result, end;
+
+	for(k=0;k<slice->N;k++){
+		i = slice->ids[k];
+		if(polys->type[i] != REG_POLYGON){
+			if(!regionInterval(polys, i, y, x)) continue;
+			interval[2*Nintervals]   = x[0];
+			interval[2*Nintervals+1] = x[1];
+			Nintervals++;
+			continue;
+		}
+		if(!(BBOX_MIN(polys,i,1) < y && y < BBOX_MAX(polys,i,1))) continue;
+		n  = polys->N[i];
+		px = polys->x + polys->start[i];
+		py = polys->y + polys->start[i];
+		/* 	only the crossings inside [x0,x1] are kept and sorted,
+		 * 	the ones on the left only tell if x0 is inside */
+		Ncrossings = 0;
+		odd        = 0;
+		if(polys->slab != NULL && polys->slab[i+1] > polys->slab[i]){
+			s = polys->slab[i] + slabIndex(polys->param + NPARAM*i, polys->slab[i+1] - polys->slab[i], y);
+			for(m=polys->slabStart[s];m<polys->slabStart[s+1];m++){
+				j = polys->slabEdges[m];
+				e = (j == 0) ? n-1 : j-1;
+				if((py[e] > y) != (py[j] > y)){
+					xe = px[e] + (y - py[e])*(px[j] - px[e])/(py[j] - py[e]);
+					if(xe <= slice->x0) odd ^= 1;
+					else if(xe < slice->x1) xc[Ncrossings++] = xe;
+				}
 			}
-			angle = atof(item+NCHAR*4)*PI/180.0;
-
-			polysAll[i].x    = (double *)malloc(polysAll[i].N*sizeof(double));
-			polysAll[i].y    = (double *)malloc(polysAll[i].N*sizeof(double));
-			polysAll[i].xmin = (double *)malloc(2*sizeof(double));
-			polysAll[i].xmax = (double *)malloc(2*sizeof(double));
-
-			for(j=0;j<polysAll[i].N;j++){
-				alpha            = TWOPI*(double)j/((double)polysAll[i].N);
-				x = rx*cos(alpha) + x0;
-				y = ry*sin(alpha) + y0;
-
-				if(spherical){
-					x = 2.0*asin(sin((x-x0)*PI/180/2.0)/cos(y*PI/180))*180.0/PI+x0;
+		}else{
+			for(e=n-1,j=0;j<n;e=j++){
+				if((py[e] > y) != (py[j] > y)){
+					xe = px[e] + (y - py[e])*(px[j] - px[e])/(py[j] - py[e]);
+					if(xe <= slice->x0) odd ^= 1;
+					else if(xe < slice->x1) xc[Ncrossings++] = xe;
 				}
-				rotate(x0, y0, x, y, &(polysAll[i].x[j]), &(polysAll[i].y[j]), angle, spherical);
-			}
-
-			polysAll[i].id      = i;
-			polysAll[i].xmin[0] = x0;
-			polysAll[i].xmax[0] = x0;
-			polysAll[i].xmin[1] = y0;
-			polysAll[i].xmax[1] = y0;
-			for(j=0;j<polysAll[i].N;j++){
-				polysAll[i].xmin[0] = MIN(polysAll[i].xmin[0], polysAll[i].x[j]);
-				polysAll[i].xmax[0] = MAX(polysAll[i].xmax[0], polysAll[i].x[j]);
-				polysAll[i].xmin[1] = MIN(polysAll[i].xmin[1], polysAll[i].y[j]);
-				polysAll[i].xmax[1] = MAX(polysAll[i].xmax[1], polysAll[i].y[j]);
-			}
-
-			//fprintf(stderr,"\nxmin = %f \nxmax = %f \nymin = %f \nymax = %f\n",polysAll[i].xmin[0],polysAll[i].xmax[0],polysAll[i].xmin[1],polysAll[i].xmax[1]);
-
-			i++;
-		}
-*/
-
-		else if(strstr(line,"box") != NULL){
-
-			str_begin = strstr(line,"(")+sizeof(char);
-			str_end = strstr(line,")");
-			strcpy(str_end,"\n\0");
-
-			//strcpy(line,str_begin);
-			//getStrings(line,item,",",&N);
-			//DEBUGGING
-			getStrings(str_begin, item, ",", &N);
-
-			polysAll[i].N = 4;
-			x0 = atof(item+NCHAR*0);
-			y0 = atof(item+NCHAR*1);
-			if(strstr(item+NCHAR*2,"\"") != NULL){
-				spherical = 1;
-				rx  =  atof(item+NCHAR*2)/3600;
-				ry  =  atof(item+NCHAR*3)/3600;
-				rx  = 2.0*asin(sin(rx*PI/180.0/2.0)/cos(y0*PI/180.0))*180.0/PI;
-			}else if(strstr(item+NCHAR*2,"\'") != NULL){
-				spherical = 1;
-				rx  =  atof(item+NCHAR*2)/60.0;
-				ry  =  atof(item+NCHAR*3)/60.0;
-				rx  = 2.0*asin(sin(rx*PI/180.0/2.0)/cos(y0*PI/180.0))*180.0/PI;
-			}else if(strstr(item+NCHAR*2,"d") != NULL){
-				spherical = 1;
-				rx  =  atof(item+NCHAR*2);
-				ry  =  atof(item+NCHAR*3);
-				rx  = 2.0*asin(sin(rx*PI/180.0/2.0)/cos(y0*PI/180.0))*180.0/PI;
-			}else{
-				spherical = 0;
-				rx  =  atof(item+NCHAR*2);
-				ry  =  atof(item+NCHAR*3);
 			}
-			angle = atof(item+NCHAR*4)*PI/180.0;
-
-			polysAll[i].x    = (double *)malloc(polysAll[i].N*sizeof(double));
-			polysAll[i].y    = (double *)malloc(polysAll[i].N*sizeof(double));
-			polysAll[i].xmin = (double *)malloc(2*sizeof(double));
-			polysAll[i].xmax = (double *)malloc(2*sizeof(double));
-
-			rotate(x0, y0, +rx/2.0+x0, +ry/2.0+y0, &(polysAll[i].x[0]), &(polysAll[i].y[0]), angle, spherical);
-			rotate(x0, y0, -rx/2.0+x0, +ry/2.0+y0, &(polysAll[i].x[1]), &(polysAll[i].y[1]), angle, spherical);
-			rotate(x0, y0, -rx/2.0+x0, -ry/2.0+y0, &(polysAll[i].x[2]), &(polysAll[i].y[2]), angle, spherical);
-			rotate(x0, y0, +rx/2.0+x0, -ry/2.0+y0, &(polysAll[i].x[3]), &(polysAll[i].y[3]), angle, spherical);
-
-			polysAll[i].id      = i;
-			polysAll[i].xmin[0] = x0;
-			polysAll[i].xmax[0] = x0;
-			polysAll[i].xmin[1] = y0;
-			polysAll[i].xmax[1] = y0;
-			for(j=0;j<polysAll[i].N;j++){
-				polysAll[i].xmin[0] = MIN(polysAll[i].xmin[0], polysAll[i].x[j]);
-				polysAll[i].xmax[0] = MAX(polysAll[i].xmax[0], polysAll[i].x[j]);
-				polysAll[i].xmin[1] = MIN(polysAll[i].xmin[1], polysAll[i].y[j]);
-				polysAll[i].xmax[1] = MAX(polysAll[i].xmax[1], polysAll[i].y[j]);
+		}
+		sortDoubles(xc, Ncrossings, 1);
+		start = slice->x0;
+		for(m=0;m<Ncrossings;m++){
+			if(odd){
+				interval[2*Nintervals]   = start;
+				interval[2*Nintervals+1] = xc[m];
+				Nintervals++;
 			}
-
-			//fprintf(stderr,"\nxmin = %f \nxmax = %f \nymin = %f \nymax = %f\n",polysAll[i].xmin[0],polysAll[i].xmax[0],polysAll[i].xmin[1],polysAll[i].xmax[1]);
-
-			i++;
+			start = xc[m];
+			odd  ^= 1;
 		}
+		if(odd){
+			interval[2*Nintervals]   = start;
+			interval[2*Nintervals+1] = slice->x1;
+			Nintervals++;
+		}
+	}
 
+	/* 	union of the intervals, clipped to [x0,x1] */
+	sortDoubles(interval, Nintervals, 2);
+	result = 0.0;
+	end    = slice->x0;
+	for(k=0;k<Nintervals;k++){
+		x[0] = MAX(interval[2*k], end);
+		x[1] = MIN(interval[2*k+1], slice->x1);
+		if(x[1] > x[0]){
+			result += x[1] - x[0];
+			end     = x[1];
+		}
+	}
 
+	return (slice->coordType == RADEC) ? result*cos(y*PI/180.0) : result;
+}
 
-	}
-	if(i==0){
-		fprintf(stderr,"%s: 0 polygon found, check input file. Exiting...\n",MYNAME);
-		exit(EXIT_FAILURE);
-	}else{
-		fprintf(stderr,"%d polygon(s) found\n",i);
-	}
+void sortDoubles(double *x, size_t N, size_t stride){
+	/* 	Sorts the N records of stride doubles in x by their first
+	 * 	value. Cross-sections only have a few crossings and intervals,
+	 * 	which an insertion sort handles much faster than qsort().
+	 */
 
-	double minArea;
-	xmin[0] = polysAll[0].xmin[0];
-	xmax[0] = polysAll[0].xmax[0];
-	xmin[1] = polysAll[0].xmin[1];
-	xmax[1] = polysAll[0].xmax[1];
+	size_t i, j, k;
+	double tmp[2];
 
-	//fprintf(stderr,"xmin = %f \nxmax = %f \nymin = %f \nymax = %f\n",xmin[0],xmax[0],xmin[1],xmax[1]);
-	if(0){
-		minArea = (polysAll[0].xmax[0] - polysAll[0].xmin[0])*(sin(polysAll[0].xmax[1]*PI/180.0) - sin(polysAll[0].xmin[1]*PI/180.0))*180.0/PI;
-	}else{
-		minArea = (polysAll[0].xmax[0] - polysAll[0].xmin[0])*(polysAll[0].xmax[1] - polysAll[0].xmin[1]);
+	if(N > 32 || stride > 2){
+		qsort(x, N, stride*sizeof(double), compareDoubles);
+		return;
 	}
-
-	for(i=1;i<NpolysAll;i++){
-		xmin[0] = MIN(xmin[0],polysAll[i].xmin[0]);
-		xmax[0] = MAX(xmax[0],polysAll[i].xmax[0]);
-		xmin[1] = MIN(xmin[1],polysAll[i].xmin[1]);
-		xmax[1] = MAX(xmax[1],polysAll[i].xmax[1]);
-		if(0){
-			minArea += (polysAll[i].xmax[0] - polysAll[i].xmin[0])*(sin(polysAll[i].xmax[1]*PI/180.0) - sin(polysAll[i].xmin[1]*PI/180.0))*180.0/PI;
-		}else{
-			minArea += (polysAll[i].xmax[0] - polysAll[i].xmin[0])*(polysAll[i].xmax[1] - polysAll[i].xmin[1]);
+	for(i=1;i<N;i++){
+		for(k=0;k<stride;k++) tmp[k] = x[stride*i+k];
+		for(j=i;j>0 && x[stride*(j-1)] > tmp[0];j--){
+			for(k=0;k<stride;k++) x[stride*j+k] = x[stride*(j-1)+k];
 		}
+		for(k=0;k<stride;k++) x[stride*j+k] = tmp[k];
+	}
+}
 
+int regionInterval(const Polygon *polys, int i, double y, double x[2]){
+	/* 	Sets x to the interval of the circle, ellipse or box i at y,
+	 * 	found by solving the inequality of insideRegion() for x, and
+	 * 	returns 1, or returns 0 if the region does not reach y.
+	 */
 
+	int q;
+	const double *p = polys->param + NPARAM*i;
+	double A, B, C, d, u[2], cosy, dy = y - p[1];
+
+	if(!(BBOX_MIN(polys,i,1) < y && y < BBOX_MAX(polys,i,1))) return 0;
+
+	switch(polys->type[i]){
+		case REG_BOX:
+			x[0] = BBOX_MIN(polys,i,0);
+			x[1] = BBOX_MAX(polys,i,0);
+			return 1;
+		case REG_CIRCLE:
+			d = p[2]*p[2] - dy*dy;
+			if(d <= 0.0) return 0;
+			x[0] = p[0] - sqrt(d);
+			x[1] = p[0] + sqrt(d);
+			return 1;
+		case REG_CIRCLE_SPHER:
+			/* 	sin^2(dra/2) < (sin^2(r/2) - sin^2(ddec/2))/(cos(y)cos(y0)),
+			 * 	written with products to keep the precision where the cap
+			 * 	covers the whole parallel, cos(y+y0)+cos(r) = 0 */
+			d = sin((p[2] - dy)*PI/180.0/2.0)*sin((p[2] + dy)*PI/180.0/2.0);
+			if(d <= 0.0) return 0;
+			A    = cos((y + p[1] + p[2])*PI/180.0/2.0)*cos((y + p[1] - p[2])*PI/180.0/2.0);
+			d    = (A > 0.0) ? 2.0*atan2(sqrt(d), sqrt(A))*180.0/PI : 180.0;
+			x[0] = p[0] - d;
+			x[1] = p[0] + d;
+			return 1;
+		default:
+			/* 	ellipses: A dx^2 + B dx + C < 0 in local coordinates */
+			A = p[4]*p[4]*p[6] + p[5]*p[5]*p[7];
+			B = 2.0*dy*p[4]*p[5]*(p[6] - p[7]);
+			C = dy*dy*(p[5]*p[5]*p[6] + p[4]*p[4]*p[7]) - 1.0;
+			d = B*B - 4.0*A*C;
+			if(d <= 0.0) return 0;
+			u[0] = (-B - sqrt(d))/(2.0*A);
+			u[1] = (-B + sqrt(d))/(2.0*A);
+			if(polys->type[i] == REG_ELLIPSE_SPHER){
+				/* 	back to RA: dx = 2 asin(sin(dra/2) cos(y)) */
+				cosy = cos(y*PI/180.0);
+				for(q=0;q<2;q++){
+					if(u[q] <= -180.0 || u[q] >= 180.0){
+						u[q] = (u[q] < 0.0) ? -180.0 : 180.0;
+						continue;
+					}
+					d    = (cosy > 0.0) ? sin(u[q]*PI/180.0/2.0)/cosy : (u[q] < 0.0 ? -1.0 : 1.0);
+					u[q] = 2.0*asin(MAX(-1.0, MIN(1.0, d)))*180.0/PI;
+				}
+			}
+			x[0] = p[0] + u[0];
+			x[1] = p[0] + u[1];
+			return 1;
 	}
-	minArea /= 1.0*(double)NpolysAll;
-
-	int SplitDim = 0, firstCall = 1;
-	return createNode(polysAll,NpolysAll, minArea, SplitDim, xmin, xmax, firstCall);
 }
 
-Node *createNode(Polygon *polys, size_t Npolys, double minArea, int SplitDim, double xmin[2], double xmax[2], int firstCall){
-	size_t i,j,SplitDim_new;
+Polygon *allocPolygon(size_t Npolys, size_t Nvertices){
+	/* 	Allocates the polygon arena: one block per array,
+	 * 	whatever the number of polygons.
+	 */
+	Polygon *result = (Polygon *)malloc(sizeof(Polygon));
+	size_t NpolysAlloc    = Npolys    > 0 ? Npolys    : 1;
+	size_t NverticesAlloc = Nvertices > 0 ? Nvertices : 1;
+
+	result->Npolys     = Npolys;
+	result->Nvertices  = Nvertices;
+	result->Nslabs     = 0;
+	result->NslabEdges = 0;
+	result->slab       = NULL;
+	result->slabStart  = NULL;
+	result->slabEdges  = NULL;
+	result->start      = (size_t *)malloc(NpolysAlloc*sizeof(size_t));
+	result->N         = (int *)malloc(NpolysAlloc*sizeof(int));
+	result->type      = (int *)malloc(NpolysAlloc*sizeof(int));
+	result->bbox      = (double *)malloc(4*NpolysAlloc*sizeof(double));
+	result->param     = (double *)malloc(NPARAM*NpolysAlloc*sizeof(double));
+	result->x         = (double *)malloc(NverticesAlloc*sizeof(double));
+	result->y         = (double *)malloc(NverticesAlloc*sizeof(double));
+
+	if(result->start == NULL || result->N == NULL || result->type == NULL || result->bbox == NULL || result->param == NULL
+		|| result->x == NULL || result->y == NULL){
+		fprintf(stderr,"%s: not enough memory for %zd polygons (%zd vertices). Exiting...\n",MYNAME,Npolys,Nvertices);
+		exit(EXIT_FAILURE);
+	}
 
-	/* 	Allocate memory for THIS node */
-	Node *result = (Node *)malloc(sizeof(Node));
-	static size_t countNodes, NpolysAll;
-	static void   *root, *polysAll;
+	return result;
+}
 
-	Polygon *polysChild;
+void reallocPolygon(Polygon *polys, size_t NpolysAlloc, size_t NverticesAlloc){
+	/* 	Grows the arena to NpolysAlloc polygons and NverticesAlloc vertices */
 
-	/* 	Root & node id */
-	if(firstCall){
-		fprintf(stderr,"Building region mask tree...");
+	polys->start = (size_t *)realloc(polys->start, NpolysAlloc*sizeof(size_t));
+	polys->N     = (int *)realloc(polys->N, NpolysAlloc*sizeof(int));
+	polys->type  = (int *)realloc(polys->type, NpolysAlloc*sizeof(int));
+	polys->bbox  = (double *)realloc(polys->bbox, 4*NpolysAlloc*sizeof(double));
+	polys->param = (double *)realloc(polys->param, NPARAM*NpolysAlloc*sizeof(double));
+	polys->x     = (double *)realloc(polys->x, NverticesAlloc*sizeof(double));
+	polys->y     = (double *)realloc(polys->y, NverticesAlloc*sizeof(double));
 
-		root         = result;
-		countNodes   = 0;
-		polysAll     = polys;
-		NpolysAll    = Npolys;
+	if(polys->start == NULL || polys->N == NULL || polys->type == NULL || polys->bbox == NULL || polys->param == NULL
+		|| polys->x == NULL || polys->y == NULL){
+		fprintf(stderr,"%s: not enough memory for %zd polygons (%zd vertices). Exiting...\n",MYNAME,NpolysAlloc,NverticesAlloc);
+		exit(EXIT_FAILURE);
+	}
+}
 
+void setBoundingBox(Polygon *polys, size_t i){
+	/* 	Computes the bounding box of polygon i from its vertices */
+	int j;
+	double *px = polys->x + polys->start[i];
+	double *py = polys->y + polys->start[i];
+
+	BBOX_MIN(polys,i,0) = BBOX_MAX(polys,i,0) = px[0];
+	BBOX_MIN(polys,i,1) = BBOX_MAX(polys,i,1) = py[0];
+	for(j=1;j<polys->N[i];j++){
+		BBOX_MIN(polys,i,0) = MIN(BBOX_MIN(polys,i,0), px[j]);
+		BBOX_MAX(polys,i,0) = MAX(BBOX_MAX(polys,i,0), px[j]);
+		BBOX_MIN(polys,i,1) = MIN(BBOX_MIN(polys,i,1), py[j]);
+		BBOX_MAX(polys,i,1) = MAX(BBOX_MAX(polys,i,1), py[j]);
+	}
+}
 
+void free_Polygon(Polygon *polys){
+	free(polys->start);
+	free(polys->N);
+	free(polys->type);
+	free(polys->bbox);
+	free(polys->param);
+	free(polys->x);
+	free(polys->y);
+	free(polys->slab);
+	free(polys->slabStart);
+	free(polys->slabEdges);
+	free(polys);
+}
 
+void free_Tree(Tree *tree){
+	if(tree->map != NULL){
+		/* 	arrays belong to the index file mapping */
+		munmap(tree->map, tree->mapSize);
+		free(tree->grid);
+		free(tree->polys);
+		free(tree);
+		return;
 	}
-	result->root      = root;
-	result->id        = countNodes;
-	result->Npolys    = Npolys;
-	result->NpolysAll = NpolysAll;
-	countNodes++;
+	if(tree->grid != NULL) free_Grid(tree->grid);
+	free(tree->nodes);
+	free(tree->ids);
+	free_Polygon(tree->polys);
+	free(tree);
+	return;
+}
 
-	/*		Copy address of the complete polygon sample and
-	 *		save ids of polygons inside the node
+Tree *readMaskTree(const Config *para, double xmin[2], double xmax[2]){
+	/* 	Returns the region mask tree, either read from the .reg file
+	 * 	or mapped from the index file given with -loadIndex.
+	 * 	With -saveIndex, the tree is also written to an index file.
 	 */
-	result->polysAll     = polysAll;
-	result->poly_id      = (int *)malloc(Npolys*sizeof(int));
-	for(i=0;i<Npolys;i++){
-		result->poly_id[i] = polys[i].id;
-	}
 
-	double area;
-	if(0){
-		area = (xmax[0] - xmin[0])*(sin(xmax[1]*PI/180.0) - sin(xmin[1]*PI/180.0))*180.0/PI;
+	unsigned long long hash = 0, hashIndex;
+	int isReg = checkFileExt(para->fileRegInName,".reg");
+	Tree *result;
+
+	if(strcmp(para->fileIndexInName,"")){
+		result = loadIndex(para->fileIndexInName, xmin, xmax, &hashIndex);
+		/* 	make sure the index was built from this mask */
+		if(isReg && hashFile(para->fileRegInName) != hashIndex){
+			fprintf(stderr,"%s: %s was not built from %s, please run with -saveIndex again. Exiting...\n",MYNAME,para->fileIndexInName,para->fileRegInName);
+			exit(EXIT_FAILURE);
+		}
 	}else{
-		area = (xmax[0] - xmin[0])*(xmax[1] - xmin[1]);
+		FILE *fileRegIn = fopenAndCheck(para->fileRegInName,"r");
+		result          = readPolygonFileTree(fileRegIn,xmin,xmax,para->leafSize);
+		fclose(fileRegIn);
 	}
 
+	if(strcmp(para->fileIndexOutName,"")){
+		if(isReg) hash = hashFile(para->fileRegInName);
+		saveIndex(result, xmin, xmax, hash, para->fileIndexOutName);
+	}
 
-	//double area = (xmax[0]-xmin[0])*(xmax[1]-xmin[1]);
-	/* 	Leaf: either no polygon or cell smaller than minArea */
-	if(result->Npolys == 0 || area < minArea) {
-		result->type     = LEAF;
-		result->Left     = NULL;
-		result->Right    = NULL;
-	}else{
-		result->type       = NODE;
-		result->SplitDim   = SplitDim;
-		result->SplitValue = (xmax[result->SplitDim] + xmin[result->SplitDim])/2.0;
-
-		/* 	Temporary data */
-		polysChild = (Polygon *)malloc(Npolys*sizeof(Polygon));
-		//for(i=0; i<Npolys; i++){
-		//	polysChild[i].x    = (double *)malloc(NVERTICES*sizeof(double));
-		//	polysChild[i].y    = (double *)malloc(NVERTICES*sizeof(double));
-		//	polysChild[i].xmin = (double *)malloc(2*sizeof(double));
-		//	polysChild[i].xmax = (double *)malloc(2*sizeof(double));
-		//}
+	return result;
+}
 
-		double xminChild[2], xmaxChild[2];
-		for(i=0;i<2;i++){
-			xminChild[i] = xmin[i];
-			xmaxChild[i] = xmax[i];
-		}
+void saveIndex(const Tree *tree, const double xmin[2], const double xmax[2], unsigned long long hash, const char *fileName){
+	/* 	Writes the polygon arena, tree and grid into a binary index
+	 * 	file that loadIndex() maps back with no parsing. The file is
+	 * 	only meant to be read on the same architecture (it starts with
+	 * 	a header checked by loadIndex()).
+	 */
 
-		/* 	New splitDim for children */
-		SplitDim++;
-		if(SplitDim > 1)  SplitDim = 0;
+	size_t k, pos;
+	const Polygon *polys = tree->polys;
+	const Grid *grid     = tree->grid;
+	const void *array[INDEXNARRAYS];
+	char zero[INDEXALIGN];
+	IndexHeader header;
 
-		/*		"left" */
+	if(grid == NULL){
+		fprintf(stderr,"%s: no grid to write in %s. Exiting...\n",MYNAME,fileName);
+		exit(EXIT_FAILURE);
+	}
 
-		/*		Set new right limit */
-		xmaxChild[result->SplitDim] = result->SplitValue;
-		j=0;
-		for(i=0;i<Npolys;i++){
-			if(polys[i].xmin[result->SplitDim] < result->SplitValue){
-				cpyPolygonAddress(&polysChild[j],&polys[i]);
-				j++;
-			}
-		}
-		result->Left = createNode(polysChild,j,minArea,SplitDim,xminChild,xmaxChild,0);
-		free(polysChild);
+	fprintf(stderr,"Writing mask index file %s...",fileName);
+
+	memset(&header, 0, sizeof(IndexHeader));
+	memset(zero, 0, INDEXALIGN);
+	memcpy(header.magic, INDEXMAGIC, 8);
+	header.version    = INDEXVERSION;
+	header.sizeofNode = sizeof(Node);
+	header.hash       = hash;
+	header.Npolys     = polys->Npolys;
+	header.Nvertices  = polys->Nvertices;
+	header.Nslabs     = polys->Nslabs;
+	header.NslabEdges = polys->NslabEdges;
+	header.Nnodes     = tree->Nnodes;
+	header.Nids       = tree->Nids;
+	header.leafSize   = tree->leafSize;
+	header.nx         = grid->nx;
+	header.ny         = grid->ny;
+	header.Nboundary  = grid->Nboundary;
+	header.Ngrid_ids  = grid->start[grid->Nboundary];
+	for(k=0;k<2;k++){
+		header.xmin[k]    = xmin[k];
+		header.xmax[k]    = xmax[k];
+		header.gridMin[k] = grid->xmin[k];
+		header.gridMax[k] = grid->xmax[k];
+		header.dx[k]      = grid->dx[k];
+		header.idx[k]     = grid->idx[k];
+	}
 
-		/* 	Temporary data */
-		polysChild = (Polygon *)malloc(Npolys*sizeof(Polygon));
+	array[0]  = polys->start; header.size[0]  = polys->Npolys*sizeof(size_t);
+	array[1]  = polys->N;     header.size[1]  = polys->Npolys*sizeof(int);
+	array[2]  = polys->type;  header.size[2]  = polys->Npolys*sizeof(int);
+	array[3]  = polys->x;     header.size[3]  = polys->Nvertices*sizeof(double);
+	array[4]  = polys->y;     header.size[4]  = polys->Nvertices*sizeof(double);
+	array[5]  = polys->bbox;  header.size[5]  = 4*polys->Npolys*sizeof(double);
+	array[6]  = polys->param; header.size[6]  = NPARAM*polys->Npolys*sizeof(double);
+	array[7]  = tree->nodes;  header.size[7]  = tree->Nnodes*sizeof(Node);
+	array[8]  = tree->ids;    header.size[8]  = tree->Nids*sizeof(int);
+	array[9]  = grid->cell;   header.size[9]  = grid->nx*grid->ny*sizeof(int);
+	array[10] = grid->start;  header.size[10] = (grid->Nboundary+1)*sizeof(size_t);
+	array[11] = grid->ids;    header.size[11] = header.Ngrid_ids*sizeof(int);
+	array[12] = polys->slab;      header.size[12] = (polys->Npolys+1)*sizeof(size_t);
+	array[13] = polys->slabStart; header.size[13] = (polys->Nslabs+1)*sizeof(size_t);
+	array[14] = polys->slabEdges; header.size[14] = polys->NslabEdges*sizeof(int);
+
+	pos = sizeof(IndexHeader);
+	for(k=0;k<INDEXNARRAYS;k++){
+		pos              = (pos + INDEXALIGN - 1)/INDEXALIGN*INDEXALIGN;
+		header.offset[k] = pos;
+		pos             += header.size[k];
+	}
+	header.fileSize = pos;
+
+	FILE *fileOut = fopenAndCheck(fileName,"w");
+	pos = fwrite(&header, sizeof(IndexHeader), 1, fileOut) == 1 ? sizeof(IndexHeader) : 0;
+	for(k=0;k<INDEXNARRAYS && pos > 0;k++){
+		if(fwrite(zero, 1, header.offset[k]-pos, fileOut) != header.offset[k]-pos
+			|| fwrite(array[k], 1, header.size[k], fileOut) != header.size[k]) pos = 0;
+		else pos = header.offset[k] + header.size[k];
+	}
+	if(pos == 0 || fclose(fileOut) != 0){
+		fprintf(stderr,"%s: could not write %s. Exiting...\n",MYNAME,fileName);
+		exit(EXIT_FAILURE);
+	}
 
+	fprintf(stderr,"Done (%zd bytes).\n",header.fileSize);
 
+	return;
+}
 
-		/*		"right" */
+Tree *loadIndex(const char *fileName, double xmin[2], double xmax[2], unsigned long long *hash){
+	/* 	Maps the index file written by saveIndex() read-only: the tree
+	 * 	is ready to query with no parsing, and its pages are shared
+	 * 	with the other processes mapping the same file.
+	 */
 
-		/*		restore right limit and set new left limit */
-		xmaxChild[result->SplitDim] = xmax[result->SplitDim];
-		xminChild[result->SplitDim] = result->SplitValue;
-		j=0;
-		for(i=0;i<Npolys;i++){
-			if(polys[i].xmax[result->SplitDim] > result->SplitValue){
-				cpyPolygonAddress(&polysChild[j],&polys[i]);
-				j++;
-			}
-		}
-		result->Right = createNode(polysChild,j,minArea,SplitDim,xminChild,xmaxChild,0);
+	size_t k;
+	struct stat st;
+	IndexHeader *header;
+	char *map;
 
-		free(polysChild);
+	fprintf(stderr,"Mapping mask index file %s...",fileName);
 
-		//free_Polygon(polysChild,Npolys);
+	int fd = open(fileName, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) != 0){
+		fprintf(stderr,"%s: %s not found. Exiting...\n",MYNAME,fileName);
+		exit(EXIT_FAILURE);
 	}
-
-	result->Nnodes=countNodes;
-
-	if (firstCall){
-
-		fprintf(stderr,"Done.\n");
-
+	if((size_t)st.st_size < sizeof(IndexHeader)){
+		fprintf(stderr,"%s: %s is not a mask index file. Exiting...\n",MYNAME,fileName);
+		exit(EXIT_FAILURE);
+	}
+	map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		fprintf(stderr,"%s: could not map %s. Exiting...\n",MYNAME,fileName);
+		exit(EXIT_FAILURE);
 	}
 
-
-	return result;
-}
-
-void free_Polygon(Polygon *polygon, size_t N){
-	size_t i;
-	for(i=0;i<N;i++){
-		free(polygon[i].x);
-		free(polygon[i].y);
-		free(polygon[i].xmin);
-		free(polygon[i].xmax);
+	header = (IndexHeader *)map;
+	if(memcmp(header->magic, INDEXMAGIC, 8) || header->version != INDEXVERSION || header->sizeofNode != sizeof(Node)){
+		fprintf(stderr,"%s: %s is not a mask index file (or was written by another version or architecture). Exiting...\n",MYNAME,fileName);
+		exit(EXIT_FAILURE);
+	}
+	for(k=0;k<INDEXNARRAYS;k++){
+		if(header->offset[k] % INDEXALIGN || header->offset[k] + header->size[k] > header->fileSize) break;
+	}
+	if(k < INDEXNARRAYS || header->fileSize != (size_t)st.st_size){
+		fprintf(stderr,"%s: %s is truncated or corrupted. Exiting...\n",MYNAME,fileName);
+		exit(EXIT_FAILURE);
 	}
-	free(polygon);
-}
 
-void free_Node(Node *node){
-	if(node->type != LEAF){
-		free_Node(node->Left);
-		free_Node(node->Right);
+	Tree *result    = (Tree *)malloc(sizeof(Tree));
+	Polygon *polys  = (Polygon *)malloc(sizeof(Polygon));
+	Grid *grid      = (Grid *)malloc(sizeof(Grid));
+
+	polys->Npolys    = header->Npolys;
+	polys->Nvertices = header->Nvertices;
+	polys->start     = (size_t *)(map + header->offset[0]);
+	polys->N         = (int *)   (map + header->offset[1]);
+	polys->type      = (int *)   (map + header->offset[2]);
+	polys->x         = (double *)(map + header->offset[3]);
+	polys->y         = (double *)(map + header->offset[4]);
+	polys->bbox      = (double *)(map + header->offset[5]);
+	polys->param     = (double *)(map + header->offset[6]);
+	polys->Nslabs     = header->Nslabs;
+	polys->NslabEdges = header->NslabEdges;
+	polys->slab       = (size_t *)(map + header->offset[12]);
+	polys->slabStart  = (size_t *)(map + header->offset[13]);
+	polys->slabEdges  = (int *)   (map + header->offset[14]);
+
+	grid->nx        = header->nx;
+	grid->ny        = header->ny;
+	grid->Nboundary = header->Nboundary;
+	grid->cell      = (int *)   (map + header->offset[9]);
+	grid->start     = (size_t *)(map + header->offset[10]);
+	grid->ids       = (int *)   (map + header->offset[11]);
+
+	for(k=0;k<2;k++){
+		xmin[k]       = header->xmin[k];
+		xmax[k]       = header->xmax[k];
+		grid->xmin[k] = header->gridMin[k];
+		grid->xmax[k] = header->gridMax[k];
+		grid->dx[k]   = header->dx[k];
+		grid->idx[k]  = header->idx[k];
 	}
-	free(node->poly_id);
-	free(node);
-	return;
-}
 
+	result->Nnodes   = header->Nnodes;
+	result->Nids     = header->Nids;
+	result->leafSize = header->leafSize;
+	result->nodes    = (Node *)(map + header->offset[7]);
+	result->ids      = (int *) (map + header->offset[8]);
+	result->polys    = polys;
+	result->grid     = grid;
+	result->map      = map;
+	result->mapSize  = st.st_size;
 
-void cpyPolygonAddress(Polygon *a, Polygon *b){
-	/*		Copies b into a	*/
-	size_t i;
+	*hash = header->hash;
 
-	a->N  = b->N;
-	a->id = b->id;
+	fprintf(stderr,"%zd polygon(s) found\n",polys->Npolys);
 
-	a->x = b->x;
-	a->y = b->y;
-	a->xmin = b->xmin;
-	a->xmax = b->xmax;
+	return result;
 }
 
+unsigned long long hashFile(const char *fileName){
+	/* 	64-bit FNV-1a hash of the file content */
 
-void cpyPolygon(Polygon *a, Polygon *b){
-	/*		Copies b into a	*/
-	size_t i;
+	size_t k, n;
+	unsigned char buffer[65536];
+	unsigned long long result = 14695981039346656037ULL;
 
-	a->N  = b->N;
-	a->id = b->id;
-	for(i=0;i<NVERTICES;i++){
-		a->x[i] = b->x[i];
-		a->y[i] = b->y[i];
-	}
-	for(i=0;i<2;i++){
-		a->xmin[i] = b->xmin[i];
-		a->xmax[i] = b->xmax[i];
+	FILE *fileIn = fopenAndCheck(fileName,"r");
+	while((n = fread(buffer, 1, sizeof(buffer), fileIn)) > 0){
+		for(k=0;k<n;k++){
+			result ^= buffer[k];
+			result *= 1099511628211ULL;
+		}
 	}
+	fclose(fileIn);
+
+	return result;
 }
 
 /*
@@ -739,6 +2608,210 @@ gsl_rng *randomInitialize(size_t seed){
 	return r;
 }
 
+void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]){
+	/*		Philox4x32-10 counter-based generator (Salmon et al. 2011):
+	 *		out is a pseudo-random function of (ctr, key), with no state,
+	 *		so that any draw can be computed independently of the others.
+	 */
+
+	uint32_t k0 = key[0], k1 = key[1], x0 = ctr[0], x1 = ctr[1], x2 = ctr[2], x3 = ctr[3];
+	uint64_t p0, p1;
+	int round;
+
+	for(round=0;round<10;round++){
+		p0 = (uint64_t)0xD2511F53*x0;
+		p1 = (uint64_t)0xCD9E8D57*x2;
+		x0 = (uint32_t)(p1 >> 32)^x1^k0;
+		x1 = (uint32_t)p1;
+		x2 = (uint32_t)(p0 >> 32)^x3^k1;
+		x3 = (uint32_t)p0;
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
+
+	out[0] = x0;
+	out[1] = x1;
+	out[2] = x2;
+	out[3] = x3;
+}
+
+double randomUniform(size_t seed, size_t i, uint32_t j){
+	/*		Returns the j-th uniform deviate in [0,1) of object i, from
+	 *		Philox keyed by seed (53 random bits). The result does not
+	 *		depend on the order of the calls, nor on the thread.
+	 */
+
+	uint32_t ctr[4], key[2], out[4];
+
+	ctr[0] = (uint32_t)i;
+	ctr[1] = (uint32_t)((uint64_t)i >> 32);
+	ctr[2] = j;
+	ctr[3] = 0;
+	key[0] = (uint32_t)seed;
+	key[1] = (uint32_t)((uint64_t)seed >> 32);
+	philox4x32(ctr, key, out);
+
+	return (double)((((uint64_t)out[0] << 32) | out[1]) >> 11)*0x1.0p-53;
+}
+
+double randomFlat(const Config *para, gsl_rng *r, size_t i, uint32_t j, double a, double b){
+	/*		Uniform deviate in [a,b): the next one from r (gsl_ran_flat()),
+	 *		or with -rng philox, the j-th one of object i (thread-safe),
+	 *		or with -sampler sobol/halton, coordinate j of the i-th point
+	 *		of the quasi-random sequence (thread-safe)
+	 */
+
+	double u;
+
+	if(para->sampler != SAMPLER_PSEUDO){
+		u = quasiRandom(para->sampler, para->seed, i, j);
+		return a*(1.0 - u) + b*u;
+	}
+	if(para->rng == RNG_PHILOX){
+		u = randomUniform(para->seed, i, j);
+		return a*(1.0 - u) + b*u;
+	}
+	return gsl_ran_flat(r, a, b);
+}
+
+int randomIsIndexed(const Config *para){
+	/*		Returns 1 if draw j of object i only depends on (seed, i, j),
+	 *		so that objects can be drawn in any order, in parallel
+	 */
+	return para->rng == RNG_PHILOX || para->sampler != SAMPLER_PSEUDO;
+}
+
+double quasiRandom(int sampler, size_t seed, size_t i, uint32_t j){
+	/*		Coordinate j (< QUASIDIM) of the i-th point of the scrambled
+	 *		Sobol or Halton sequence, in [0,1). Each point is computed
+	 *		directly from i, so the sequence splits into independent
+	 *		blocks. The scrambling only depends on seed and j: nested
+	 *		uniform (Owen) scrambling for Sobol, which keeps its net
+	 *		properties, and a random shift modulo 1 for Halton.
+	 */
+
+	uint32_t ctr[4], key[2], out[4];
+	uint64_t scramble;
+	double u;
+
+	ctr[0] = j;
+	ctr[1] = ctr[2] = 0;
+	ctr[3] = 1; /* 	randomUniform() uses ctr[3] = 0 */
+	key[0] = (uint32_t)seed;
+	key[1] = (uint32_t)((uint64_t)seed >> 32);
+	philox4x32(ctr, key, out);
+	scramble = ((uint64_t)out[0] << 32) | out[1];
+
+	if(sampler == SAMPLER_SOBOL){
+		return (double)(owenScramble(sobol(i, j), scramble) >> 11)*0x1.0p-53;
+	}
+
+	u = halton(i, j) + (double)(scramble >> 11)*0x1.0p-53;
+	return (u >= 1.0) ? u - 1.0 : u;
+}
+
+uint64_t sobol(uint64_t i, uint32_t j){
+	/*		Coordinate j (< QUASIDIM) of the i-th point of the Sobol
+	 *		sequence (64-bit fraction), with the Joe & Kuo (2008)
+	 *		direction numbers. The direction numbers are generated up
+	 *		to the highest bit of i.
+	 */
+
+	static const int s[QUASIDIM] = {0, 1, 2, 3, 3};
+	static const int a[QUASIDIM] = {0, 0, 1, 1, 2};
+	static const uint64_t m[QUASIDIM][3] = {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}, {1, 1, 1}};
+	uint64_t V[64], x = 0;
+	int k, l;
+
+	for(k=0;i > 0;k++, i >>= 1){
+		if(j == 0){
+			V[k] = (uint64_t)1 << (63-k);
+		}else if(k < s[j]){
+			V[k] = m[j][k] << (63-k);
+		}else{
+			V[k] = V[k-s[j]] ^ (V[k-s[j]] >> s[j]);
+			for(l=1;l<s[j];l++) if((a[j] >> (s[j]-1-l)) & 1) V[k] ^= V[k-l];
+		}
+		if(i & 1) x ^= V[k];
+	}
+
+	return x;
+}
+
+double halton(uint64_t i, uint32_t j){
+	/*		Coordinate j (< QUASIDIM) of the i-th point of the Halton
+	 *		sequence: radical inverse of i in the j-th prime base
+	 */
+
+	static const uint64_t base[QUASIDIM] = {2, 3, 5, 7, 11};
+	double f = 1.0, result = 0.0;
+
+	while(i > 0){
+		f      /= (double)base[j];
+		result += f*(double)(i%base[j]);
+		i      /= base[j];
+	}
+
+	return result;
+}
+
+uint64_t reverseBits(uint64_t x){
+	x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+	x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+	x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+	x = ((x >> 8) & 0x00FF00FF00FF00FFULL) | ((x & 0x00FF00FF00FF00FFULL) << 8);
+	x = ((x >> 16) & 0x0000FFFF0000FFFFULL) | ((x & 0x0000FFFF0000FFFFULL) << 16);
+	return (x >> 32) | (x << 32);
+}
+
+uint64_t owenScramble(uint64_t x, uint64_t seed){
+	/*		Nested uniform scrambling of the binary fraction x (Laine &
+	 *		Karras 2011, Burley 2020): on the reversed bits, each step
+	 *		(addition, multiplication by an odd number, xor with a
+	 *		multiple by an even number) only propagates to higher bits,
+	 *		i.e. each digit of x is flipped depending on the previous
+	 *		digits only.
+	 */
+
+	x  = reverseBits(x);
+	x += seed;
+	x ^= x*0x6C50B47CDB26D3F2ULL;
+	x *= seed | 1;
+	x ^= x*0xB82F1E52C8A9E3F6ULL;
+	x ^= x*0xC7AFE638A5D1B2E4ULL;
+	return reverseBits(x);
+}
+
+void randomPoints(const Config *para, gsl_rng *r, size_t first, size_t N, const double xmin[2], const double xmax[2], const Cells *cells, double *x, double *y){
+	/*		Draws the random objects first, ..., first+N-1 in (x,y), uniformly
+	 *		within the limits (on the sphere with -coord spher), or within
+	 *		cells if not NULL (see createCells()). With -rng philox or
+	 *		-sampler sobol/halton, objects are drawn in parallel.
+	 */
+
+	size_t k;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(randomIsIndexed(para))
+#endif
+	for(k=0;k<N;k++){
+		double u[3];
+		if(cells != NULL){
+			u[0] = randomFlat(para, r, first+k, 4, 0.0, 1.0);
+			u[1] = randomFlat(para, r, first+k, 0, 0.0, 1.0);
+			u[2] = randomFlat(para, r, first+k, 1, 0.0, 1.0);
+			drawInCells(cells, u, para->coordType, &x[k], &y[k]);
+		}else if(para->coordType == CART){
+			x[k] = randomFlat(para, r, first+k, 0, xmin[0], xmax[0]);
+			y[k] = randomFlat(para, r, first+k, 1, xmin[1], xmax[1]);
+		}else{
+			x[k] = randomFlat(para, r, first+k, 0, xmin[0], xmax[0]);
+			y[k] = randomFlat(para, r, first+k, 1, sin(xmin[1]*PI/180.0), sin(xmax[1]*PI/180.0));
+			y[k] = asin(y[k])*180.0/PI;
+		}
+	}
+}
+
 double determineMachineEpsilon()
 {
 	double u, den;
@@ -812,6 +2885,321 @@ int getStrings(char *line, char *strings, char *delimit, size_t *N){
 }
 
 
+int isMainThread(){
+	/* 	Returns 1 for the master thread (or without OpenMP) */
+#ifdef _OPENMP
+	return omp_get_thread_num() == 0;
+#else
+	return 1;
+#endif
+}
+
+Lines *allocLines(size_t N){
+	/* 	Allocates a block of N lines (grows if needed) */
+	Lines *result     = (Lines *)malloc(sizeof(Lines));
+	result->N         = 0;
+	result->Nalloc    = N > 0 ? N : 1;
+	result->line      = (const char **)malloc(result->Nalloc*sizeof(const char *));
+	result->length    = (size_t *)malloc(result->Nalloc*sizeof(size_t));
+	result->isObject  = (int *)malloc(result->Nalloc*sizeof(int));
+	if(result->line == NULL || result->length == NULL || result->isObject == NULL){
+		fprintf(stderr,"%s: not enough memory for %zd lines. Exiting...\n",MYNAME,N);
+		exit(EXIT_FAILURE);
+	}
+	return result;
+}
+
+void appendLine(Lines *lines, const char *line, size_t length, int isObject){
+	/* 	Adds line at the end of the block (no copy: line must stay
+	 * 	valid until the block is written) */
+
+	if(lines->N == lines->Nalloc){
+		lines->Nalloc  *= 2;
+		lines->line     = (const char **)realloc(lines->line, lines->Nalloc*sizeof(const char *));
+		lines->length   = (size_t *)realloc(lines->length, lines->Nalloc*sizeof(size_t));
+		lines->isObject = (int *)realloc(lines->isObject, lines->Nalloc*sizeof(int));
+		if(lines->line == NULL || lines->length == NULL || lines->isObject == NULL){
+			fprintf(stderr,"%s: not enough memory for %zd lines. Exiting...\n",MYNAME,lines->N);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	lines->line[lines->N]     = line;
+	lines->length[lines->N]   = length;
+	lines->isObject[lines->N] = isObject;
+	lines->N++;
+}
+
+void free_Lines(Lines *lines){
+	free(lines->line);
+	free(lines->length);
+	free(lines->isObject);
+	free(lines);
+}
+
+Reader *openReader(FILE *file, size_t sizeAlloc){
+	/* 	Buffered reader on file (stdin is fine: the file is
+	 * 	read once, sequentially) */
+	Reader *result    = (Reader *)malloc(sizeof(Reader));
+	result->file      = file;
+	result->sizeAlloc = sizeAlloc > 0 ? sizeAlloc : 1;
+	result->buffer    = (char *)malloc(result->sizeAlloc*sizeof(char));
+	result->pos       = result->size = result->total = 0;
+	result->eof       = 0;
+	if(result->buffer == NULL){
+		fprintf(stderr,"%s: not enough memory to read the catalogue. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+	return result;
+}
+
+int nextLine(Reader *reader, const char **line, size_t *length){
+	/* 	Returns the next line already in the buffer (newline included)
+	 * 	or 0 if fillReader() must be called first. The lines
+	 * 	returned stay valid until then. The last line of the file may
+	 * 	have no newline.
+	 */
+	const char *begin = reader->buffer+reader->pos, *end;
+	size_t Nleft = reader->size-reader->pos;
+
+	if(Nleft == 0) return 0;
+	end = (const char *)memchr(begin, '\n', Nleft);
+	if(end != NULL){
+		*length = (size_t)(end-begin)+1;
+	}else if(reader->eof){
+		*length = Nleft;
+	}else{
+		return 0;
+	}
+	*line          = begin;
+	reader->pos   += *length;
+	reader->total += *length;
+	return 1;
+}
+
+int fillReader(Reader *reader){
+	/* 	Moves the unread bytes to the beginning of the buffer and
+	 * 	reads more (the buffer grows if a single line does not fit).
+	 * 	Returns 0 when all lines have been read.
+	 */
+	size_t Nleft = reader->size-reader->pos, Nread;
+
+	memmove(reader->buffer, reader->buffer+reader->pos, Nleft);
+	reader->pos  = 0;
+	reader->size = Nleft;
+
+	while(!reader->eof){
+		if(reader->size == reader->sizeAlloc){
+			reader->sizeAlloc *= 2;
+			reader->buffer     = (char *)realloc(reader->buffer, reader->sizeAlloc*sizeof(char));
+			if(reader->buffer == NULL){
+				fprintf(stderr,"%s: not enough memory to read the catalogue. Exiting...\n",MYNAME);
+				exit(EXIT_FAILURE);
+			}
+		}
+		Nread = fread(reader->buffer+reader->size, sizeof(char), reader->sizeAlloc-reader->size, reader->file);
+		reader->size += Nread;
+		if(Nread == 0){
+			if(ferror(reader->file)){
+				fprintf(stderr,"%s: error while reading the catalogue. Exiting...\n",MYNAME);
+				exit(EXIT_FAILURE);
+			}
+			reader->eof = 1;
+		}
+		/* 	stop as soon as a complete line is available */
+		if(memchr(reader->buffer+Nleft, '\n', reader->size-Nleft) != NULL) break;
+		Nleft = reader->size;
+	}
+
+	return reader->size > 0;
+}
+
+void free_Reader(Reader *reader){
+	free(reader->buffer);
+	free(reader);
+}
+
+Writer *openWriter(FILE *file, size_t sizeAlloc){
+	/* 	Buffered writer on file, flushed with fwrite() when full.
+	 * 	If file is NULL, the buffer grows instead (in-memory writer,
+	 * 	emptied by the caller).
+	 */
+	Writer *result    = (Writer *)malloc(sizeof(Writer));
+	result->file      = file;
+	result->sizeAlloc = sizeAlloc > 0 ? sizeAlloc : 1;
+	result->size      = 0;
+	result->buffer    = (char *)malloc(result->sizeAlloc*sizeof(char));
+	if(result->buffer == NULL){
+		fprintf(stderr,"%s: not enough memory to write the catalogue. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+	return result;
+}
+
+void writeBytes(Writer *writer, const char *s, size_t length){
+	if(writer->file == NULL){
+		while(writer->size + length > writer->sizeAlloc){
+			writer->sizeAlloc *= 2;
+			writer->buffer     = (char *)realloc(writer->buffer, writer->sizeAlloc*sizeof(char));
+			if(writer->buffer == NULL){
+				fprintf(stderr,"%s: not enough memory to write the catalogue. Exiting...\n",MYNAME);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}else{
+		if(writer->size + length > writer->sizeAlloc) flushWriter(writer);
+		if(length > writer->sizeAlloc){
+			if(fwrite(s, sizeof(char), length, writer->file) != length){
+				fprintf(stderr,"%s: error while writing the catalogue. Exiting...\n",MYNAME);
+				exit(EXIT_FAILURE);
+			}
+			return;
+		}
+	}
+	memcpy(writer->buffer+writer->size, s, length);
+	writer->size += length;
+}
+
+void flushWriter(Writer *writer){
+	if(writer->file != NULL && writer->size > 0 && fwrite(writer->buffer, sizeof(char), writer->size, writer->file) != writer->size){
+		fprintf(stderr,"%s: error while writing the catalogue. Exiting...\n",MYNAME);
+		exit(EXIT_FAILURE);
+	}
+	writer->size = 0;
+}
+
+void free_Writer(Writer *writer){
+	/* 	Flushes and frees the writer (the file is not closed) */
+	flushWriter(writer);
+	free(writer->buffer);
+	free(writer);
+}
+
+int getColumns(const char *line, size_t length, const int *cols, int Ncols, double *values){
+	/* 	Reads columns cols[0], ..., cols[Ncols-1] (starting at 1) of
+	 * 	line, delimited by spaces or tabs, in values (0.0 if missing).
+	 * 	Only the fields up to the last column needed are located.
+	 * 	Returns 0 for comments and empty lines (as getStrings()) and
+	 * 	1 otherwise.
+	 */
+	const char *p = line, *end = line+length, *begin;
+	int j, k, colMax = 0, found = 0;
+
+	for(k=0;k<Ncols;k++){
+		values[k] = 0.0;
+		if(cols[k] > colMax) colMax = cols[k];
+	}
+	if(length == 0 || line[0] == '#') return 0;
+
+	for(j=1;p < end;j++){
+		while(p < end && (*p == ' ' || *p == '\t')) p++;
+		if(p == end || *p == '#' || *p == '\n' || *p == '\0') break;
+		begin = p;
+		while(p < end && *p != ' ' && *p != '\t' && *p != '#' && *p != '\n' && *p != '\0') p++;
+		found = 1;
+		for(k=0;k<Ncols;k++) if(cols[k] == j) values[k] = parseDouble(begin, p);
+		if(j >= colMax) break;
+	}
+
+	return found;
+}
+
+size_t formatFixed(char *s, double x, int precision){
+	/* 	Writes x in s as printf("%.*f", precision, x) would (same
+	 * 	rounding, ties to even on the exact binary value, no locale)
+	 * 	and returns the number of characters. When |x|*10^precision
+	 * 	< 2^52, x*10^precision is computed exactly as a sum of two
+	 * 	doubles (fma()) and rounded to an integer, whose digits
+	 * 	are written directly. The other numbers go to snprintf().
+	 */
+
+	static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17};
+	double a = fabs(x), prod, err, r, e;
+	unsigned long long n;
+	char digits[32];
+	size_t length = 0;
+	int i, Ndigits = 0;
+
+	if(precision < 0 || precision > PRECISIONMAX || !(a*pow10[precision] < 4503599627370496.0)){
+		return (size_t)snprintf(s, NUMBERSIZE, "%.*f", precision, x);
+	}
+
+	/* 	a*10^precision = prod + err exactly, rounded to the nearest integer r */
+	prod = a*pow10[precision];
+	err  = fma(a, pow10[precision], -prod);
+	r    = floor(prod);
+	e    = (prod - r - 0.5) + err;  /* the sign is exact */
+	if(e > 0.0 || (e == 0.0 && fmod(r, 2.0) == 1.0)) r += 1.0;
+	n = (unsigned long long)r;
+
+	/* 	digits in reverse order, at least precision+1 */
+	do{
+		digits[Ndigits++] = '0' + (char)(n%10);
+		n /= 10;
+	}while(n > 0 || Ndigits <= precision);
+
+	if(signbit(x)) s[length++] = '-';
+	for(i=Ndigits-1;i>=precision;i--) s[length++] = digits[i];
+	if(precision > 0){
+		s[length++] = '.';
+		for(i=precision-1;i>=0;i--) s[length++] = digits[i];
+	}
+	s[length] = '\0';
+
+	return length;
+}
+
+size_t formatGeneral(char *s, double x){
+	/* 	Writes x in s as printf("%g", x) would and returns the
+	 * 	number of characters. Integers below 10^6 (pixel values,
+	 * 	flags) are written directly.
+	 */
+
+	if(fabs(x) < 1e6 && x == floor(x)){
+		if(signbit(x)){
+			s[0] = '-';
+			return 1 + formatInt(s+1, -(long)x);
+		}
+		return formatInt(s, (long)x);
+	}
+	return (size_t)snprintf(s, NUMBERSIZE, "%g", x);
+}
+
+size_t formatInt(char *s, long n){
+	/* 	Writes n in s in decimal and returns the number of characters */
+	unsigned long u = n < 0 ? 0UL-(unsigned long)n : (unsigned long)n;
+	char digits[32];
+	size_t length = 0;
+	int i, Ndigits = 0;
+
+	do{
+		digits[Ndigits++] = '0' + (char)(u%10);
+		u /= 10;
+	}while(u > 0);
+
+	if(n < 0) s[length++] = '-';
+	for(i=Ndigits-1;i>=0;i--) s[length++] = digits[i];
+	s[length] = '\0';
+
+	return length;
+}
+
+void writeFixed(Writer *writer, double x, int precision){
+	char number[NUMBERSIZE];
+	writeBytes(writer, number, formatFixed(number, x, precision));
+}
+
+void writeGeneral(Writer *writer, double x){
+	char number[NUMBERSIZE];
+	writeBytes(writer, number, formatGeneral(number, x));
+}
+
+void writeInt(Writer *writer, long n){
+	char number[NUMBERSIZE];
+	writeBytes(writer, number, formatInt(number, n));
+}
+
 void printCount(const size_t *count, const size_t *total, const size_t step){
 	if((*count)%step == 0){
 		fflush(stdout);
@@ -0,0 +1,48 @@
+/*
+ *    readColsFits.c
+ *    venice
+ *    Checks that readColsFits() reads the first element of each row of
+ *    a vector column (x, 3D) next to a scalar one (y, 1D).
+ *    make test
+ */
+
+#include "fits.h"
+
+#define NROWS 5000
+#define FILETEST "!test/readColsFits.fits"
+
+int main(void){
+
+	int status = 0, cols[2] = {1, 2};
+	long i, bad = 0;
+	double vector[3*NROWS], scalar[NROWS], x[NROWS], y[NROWS], *xy[2] = {x, y};
+	char *ttype[] = {"x", "y"}, *tform[] = {"3D", "1D"}, *tunit[] = {"", ""};
+	fitsfile *fptr;
+
+	for(i=0;i<NROWS;i++){
+		vector[3*i]   = 10.0*i;
+		vector[3*i+1] = -1.0;
+		vector[3*i+2] = -2.0;
+		scalar[i]     = 100.0*i;
+	}
+
+	fits_create_file(&fptr, FILETEST, &status);
+	fits_create_tbl(fptr, BINARY_TBL, 0, 2, ttype, tform, tunit, "DATA", &status);
+	fits_write_col(fptr, TDOUBLE, 1, 1, 1, 3*NROWS, vector, &status);
+	fits_write_col(fptr, TDOUBLE, 2, 1, 1, NROWS, scalar, &status);
+	if(status){
+		fits_report_error(stderr, status);
+		exit(EXIT_FAILURE);
+	}
+
+	/* 	rows 3 to NROWS */
+	readColsFits(fptr, 2, cols, 3, NROWS-2, xy);
+	for(i=0;i<NROWS-2;i++){
+		if(x[i] != 10.0*(i+2) || y[i] != 100.0*(i+2)) bad++;
+	}
+	fits_close_file(fptr, &status);
+
+	fprintf(stderr,"readColsFits, vector column: %s (%ld wrong rows)\n", bad ? "FAILED" : "passed", bad);
+
+	return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}